@@ -0,0 +1,65 @@
+cmake_minimum_required(VERSION 3.10)
+
+# Runs SCRIPT through the optimized and the unoptimized interpreter and
+# compares what both print, and their exit codes, with the .out file next
+# to the script.
+#
+# A .run file next to the script replaces the single run with one run per
+# line. A line holds the interpreter's arguments, after any NAME=value
+# environment settings and an optional "in <directory>" to run somewhere
+# other than the test directory. @WORK@ stands for a scratch directory
+# that is emptied before each interpreter's runs, and is also passed to
+# the scripts as PHELT_TEST_WORK.
+get_filename_component(directory ${SCRIPT} DIRECTORY)
+get_filename_component(name ${SCRIPT} NAME_WE)
+file(READ ${directory}/${name}.out expected)
+
+if(EXISTS ${directory}/${name}.run)
+    file(STRINGS ${directory}/${name}.run runs)
+else()
+    set(runs ${name}.ph)
+endif()
+
+foreach(interpreter ${PHELT} ${PHELT_NOOPT})
+    file(REMOVE_RECURSE ${WORK})
+    file(MAKE_DIRECTORY ${WORK})
+
+    set(output "")
+    foreach(run ${runs})
+        if(run STREQUAL "" OR run MATCHES "^#")
+            continue()
+        endif()
+
+        string(REPLACE "@WORK@" ${WORK} run ${run})
+        separate_arguments(arguments UNIX_COMMAND ${run})
+
+        # a bytecode cache would hand both the same code, unless the run
+        # asks for one
+        set(environment --unset=PHELT_CACHE_DIR PHELT_TEST_WORK=${WORK})
+        set(runDirectory ${directory})
+        while(arguments)
+            list(GET arguments 0 argument)
+            if(argument MATCHES "^[A-Z_]+=")
+                list(APPEND environment ${argument})
+                list(REMOVE_AT arguments 0)
+            elseif(argument STREQUAL "in")
+                list(GET arguments 1 runDirectory)
+                list(REMOVE_AT arguments 0 1)
+            else()
+                break()
+            endif()
+        endwhile()
+
+        execute_process(
+            COMMAND ${CMAKE_COMMAND} -E env ${environment} ${interpreter} ${arguments}
+            WORKING_DIRECTORY ${runDirectory}
+            OUTPUT_VARIABLE runOutput
+            ERROR_VARIABLE runOutput
+            RESULT_VARIABLE status)
+        string(APPEND output "${runOutput}exit ${status}\n")
+    endforeach()
+
+    if(NOT output STREQUAL expected)
+        message(FATAL_ERROR "${interpreter} ${name}.ph printed:\n${output}\nexpected:\n${expected}")
+    endif()
+endforeach()
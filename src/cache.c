@@ -0,0 +1,673 @@
+#include "cache.h"
+
+#include "compiler.h"
+#include "debug.h"
+#include "memory.h"
+#include "optimizer.h"
+#include "vm.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Compiled scripts are cached in the directory named by PHELT_CACHE_DIR,
+// one file per script named after a hash of its source and of the VM that
+// compiled it, so an edited script or a rebuilt VM simply misses. A file
+// is a header followed by the script's function tree, written depth first
+// through the constant pools: each function's fields, line runs,
+// constants and finally its code. Loading maps the file copy-on-write and
+// points each chunk straight at its code in the mapping, only constants
+// and line runs are rebuilt on the heap.
+
+typedef enum {
+    CACHED_NIL,
+    CACHED_FALSE,
+    CACHED_TRUE,
+    CACHED_NUMBER,
+    CACHED_STRING,
+    CACHED_FUNCTION,
+    CACHED_TABLE,
+    CACHED_FUNCTION_REF,
+} CachedType;
+
+static const char* opcodeNames[] = {
+#define OPCODE(op) #op,
+#include "opcodes.h"
+#undef OPCODE
+};
+
+static uint64_t hashBytes(uint64_t hash, const void* bytes, size_t length)
+{
+    const uint8_t* data = (const uint8_t*)bytes;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= data[i];
+        hash *= 1099511628211u;
+    }
+    return hash;
+}
+
+// Changes whenever an opcode is added, removed or renumbered, which covers
+// regenerated superinstructions too.
+static uint64_t opcodeHash(void)
+{
+    uint64_t hash = 14695981039346656037u;
+    for (int op = 0; op < OPCODE_COUNT; op++) {
+        hash = hashBytes(hash, opcodeNames[op], strlen(opcodeNames[op]) + 1);
+    }
+    return hash;
+}
+
+void initHeader(CacheHeader* header, uint32_t magic)
+{
+    memset(header, 0, sizeof(CacheHeader));
+    header->magic       = magic;
+    header->format      = CACHE_FORMAT;
+    header->opcodeCount = OPCODE_COUNT;
+    header->opcodeHash  = opcodeHash();
+}
+
+static void fillHeader(CacheHeader* header, const utf8_int8_t* source)
+{
+    size_t length = strlen((const char*)source);
+
+    initHeader(header, CACHE_MAGIC);
+    header->sourceHash   = hashBytes(14695981039346656037u, source, length);
+    header->sourceLength = length;
+}
+
+static char* cachePath(CacheHeader* header)
+{
+    const char* directory = getenv("PHELT_CACHE_DIR");
+    if (directory == NULL || directory[0] == '\0')
+        return NULL;
+
+    uint64_t key    = hashBytes(header->sourceHash, &header->opcodeHash, sizeof(uint64_t));
+    size_t   length = strlen(directory) + 32;
+    char*    path   = malloc(length);
+    snprintf(path, length, "%s/%016llx.phc", directory, (unsigned long long)key);
+    return path;
+}
+
+void writeBytes(Buffer* buffer, const void* bytes, size_t length)
+{
+    if (buffer->capacity < buffer->count + length) {
+        while (buffer->capacity < buffer->count + length) {
+            buffer->capacity = buffer->capacity < 256 ? 256 : buffer->capacity * 2;
+        }
+        buffer->bytes = realloc(buffer->bytes, buffer->capacity);
+    }
+
+    memcpy(buffer->bytes + buffer->count, bytes, length);
+    buffer->count += length;
+}
+
+void writeU8(Buffer* buffer, uint8_t value)
+{
+    writeBytes(buffer, &value, sizeof(value));
+}
+
+void writeU32(Buffer* buffer, uint32_t value)
+{
+    writeBytes(buffer, &value, sizeof(value));
+}
+
+static bool writeFunction(Buffer* buffer, ObjFunction* function);
+
+static bool writeValue(Buffer* buffer, Value value)
+{
+    if (IS_NIL(value)) {
+        writeU8(buffer, CACHED_NIL);
+    } else if (IS_BOOL(value)) {
+        writeU8(buffer, AS_BOOL(value) ? CACHED_TRUE : CACHED_FALSE);
+    } else if (IS_NUMBER(value)) {
+        double number = AS_NUMBER(value);
+        writeU8(buffer, CACHED_NUMBER);
+        writeBytes(buffer, &number, sizeof(number));
+    } else if (IS_STRING(value)) {
+        ObjString* string = AS_STRING(value);
+        writeU8(buffer, CACHED_STRING);
+        writeU32(buffer, (uint32_t)string->length);
+        writeBytes(buffer, string->chars, string->length);
+    } else if (IS_FUNCTION(value)) {
+        for (unsigned int i = 0; i < buffer->functions.count; i++) {
+            if (AS_OBJ(buffer->functions.values[i]) == AS_OBJ(value)) {
+                writeU8(buffer, CACHED_FUNCTION_REF);
+                writeU32(buffer, i);
+                return true;
+            }
+        }
+        writeU8(buffer, CACHED_FUNCTION);
+        return writeFunction(buffer, AS_FUNCTION(value));
+    } else if (IS_TABLE(value)) {
+        Table* table = &AS_TABLE(value)->table;
+        writeU8(buffer, CACHED_TABLE);
+        writeU32(buffer, table->count);
+        for (unsigned int i = 0; i < table->capacity; i++) {
+            Entry* entry = &table->entries[i];
+            if (IS_EMPTY(entry->key))
+                continue;
+            if (!writeValue(buffer, entry->key) || !writeValue(buffer, entry->value))
+                return false;
+        }
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+static bool writeFunction(Buffer* buffer, ObjFunction* function)
+{
+    Chunk*  chunk     = &function->chunk;
+    int32_t fields[5] = { function->arity, function->upvalueCount, function->line, function->lazyLine, function->lazyType };
+    writeValueArray(&buffer->functions, OBJ_VAL(function));
+    writeBytes(buffer, fields, sizeof(fields));
+    if (!writeValue(buffer, function->name != NULL ? OBJ_VAL(function->name) : NIL_VAL))
+        return false;
+
+    writeU32(buffer, (uint32_t)chunk->lineCount);
+    writeBytes(buffer, chunk->lines, sizeof(LineStart) * chunk->lineCount);
+
+    writeU32(buffer, chunk->constants.count);
+    for (unsigned int i = 0; i < chunk->constants.count; i++) {
+        if (!writeValue(buffer, chunk->constants.values[i]))
+            return false;
+    }
+
+    writeU32(buffer, (uint32_t)chunk->count);
+    writeBytes(buffer, chunk->code, chunk->count);
+
+    uint32_t lazyLength = function->lazyBody != NULL ? (uint32_t)strlen(function->lazyBody) + 1 : 0;
+    writeU32(buffer, lazyLength);
+    writeBytes(buffer, function->lazyBody, lazyLength);
+    return true;
+}
+
+// Written under a temporary name and renamed into place, so concurrent
+// runs of the same script never see half a file.
+bool writeFile(const char* path, Buffer* buffer)
+{
+    size_t length    = strlen(path) + 32;
+    char*  temporary = malloc(length);
+    bool   written   = false;
+    snprintf(temporary, length, "%s.%ld.tmp", path, (long)getpid());
+
+    FILE* file = fopen(temporary, "wb");
+    if (file != NULL) {
+        written = fwrite(buffer->bytes, 1, buffer->count, file) == buffer->count;
+        written = fclose(file) == 0 && written && rename(temporary, path) == 0;
+        if (!written)
+            remove(temporary);
+    }
+
+    free(temporary);
+    return written;
+}
+
+static void storeFunction(CacheHeader* header, ObjFunction* function)
+{
+    char* path = cachePath(header);
+    if (path == NULL)
+        return;
+
+    Buffer buffer = { NULL, 0, 0, { 0, 0, NULL } };
+    writeBytes(&buffer, header, sizeof(CacheHeader));
+    if (writeFunction(&buffer, function))
+        writeFile(path, &buffer);
+
+    free(buffer.bytes);
+    freeValueArray(&buffer.functions);
+    free(path);
+}
+
+bool readBytes(Reader* reader, void* bytes, size_t length)
+{
+    if ((size_t)(reader->end - reader->current) < length)
+        return false;
+    memcpy(bytes, reader->current, length);
+    reader->current += length;
+    return true;
+}
+
+bool readU32(Reader* reader, uint32_t* value)
+{
+    return readBytes(reader, value, sizeof(uint32_t));
+}
+
+static ObjFunction* readFunction(Reader* reader);
+
+// Every object read is rooted until it reaches a constant pool or table
+// that is itself reachable.
+static bool readValue(Reader* reader, Value* value)
+{
+    uint8_t type;
+    if (!readBytes(reader, &type, 1))
+        return false;
+
+    switch (type) {
+    case CACHED_NIL:
+        *value = NIL_VAL;
+        return true;
+    case CACHED_FALSE:
+        *value = BOOL_VAL(false);
+        return true;
+    case CACHED_TRUE:
+        *value = BOOL_VAL(true);
+        return true;
+    case CACHED_NUMBER: {
+        double number;
+        if (!readBytes(reader, &number, sizeof(number)))
+            return false;
+        *value = NUMBER_VAL(number);
+        return true;
+    }
+    case CACHED_STRING: {
+        uint32_t length;
+        if (!readU32(reader, &length) || (size_t)(reader->end - reader->current) < length)
+            return false;
+        *value = OBJ_VAL(copyString((const char*)reader->current, (int)length));
+        reader->current += length;
+        return true;
+    }
+    case CACHED_FUNCTION: {
+        ObjFunction* function = readFunction(reader);
+        if (function == NULL)
+            return false;
+        *value = OBJ_VAL(function);
+        return true;
+    }
+    case CACHED_FUNCTION_REF: {
+        uint32_t index;
+        if (!readU32(reader, &index) || index >= reader->functions.count)
+            return false;
+        *value = reader->functions.values[index];
+        return true;
+    }
+    case CACHED_TABLE: {
+        uint32_t count;
+        if (!readU32(reader, &count))
+            return false;
+
+        ObjTable* table = newTable();
+        push(OBJ_VAL(table));
+        bool valid = true;
+        for (uint32_t i = 0; valid && i < count; i++) {
+            Value key;
+            Value entry;
+            valid = readValue(reader, &key);
+            if (valid) {
+                push(key);
+                valid = readValue(reader, &entry);
+                if (valid)
+                    tableSet(&table->table, key, entry);
+                pop();
+            }
+        }
+        pop();
+        *value = OBJ_VAL(table);
+        return valid;
+    }
+    default:
+        return false;
+    }
+}
+
+static ObjFunction* readFunction(Reader* reader)
+{
+    ObjFunction* function = newFunction();
+    function->source      = reader->sourcePath;
+    push(OBJ_VAL(function));
+    writeValueArray(&reader->functions, OBJ_VAL(function));
+
+    Chunk*   chunk = &function->chunk;
+    int32_t  fields[5];
+    Value    name;
+    uint32_t count;
+    bool     valid = readBytes(reader, fields, sizeof(fields)) && readValue(reader, &name)
+        && (IS_NIL(name) || IS_STRING(name)) && readU32(reader, &count)
+        && count <= (size_t)(reader->end - reader->current) / sizeof(LineStart);
+
+    if (valid) {
+        function->arity        = fields[0];
+        function->upvalueCount = fields[1];
+        function->line         = fields[2];
+        function->lazyLine     = fields[3];
+        function->lazyType     = fields[4];
+        function->name         = IS_NIL(name) ? NULL : AS_STRING(name);
+
+        chunk->lines        = ALLOCATE(LineStart, count);
+        chunk->lineCapacity = (int)count;
+        chunk->lineCount    = (int)count;
+        valid               = readBytes(reader, chunk->lines, sizeof(LineStart) * count) && readU32(reader, &count);
+    }
+
+    for (uint32_t i = 0; valid && i < count; i++) {
+        Value constant;
+        valid = readValue(reader, &constant);
+        if (valid)
+            addConstant(chunk, constant);
+    }
+
+    if (valid && readU32(reader, &count) && count <= (size_t)(reader->end - reader->current)) {
+        chunk->code     = reader->current;
+        chunk->count    = (int)count;
+        chunk->isMapped = true;
+        reader->current += count;
+    } else {
+        valid = false;
+    }
+
+    if (valid && readU32(reader, &count) && count <= (size_t)(reader->end - reader->current)) {
+        if (count > 0 && reader->current[count - 1] == '\0') {
+            function->lazyBody = malloc(count);
+            memcpy(function->lazyBody, reader->current, count);
+        }
+        valid = count == 0 || function->lazyBody != NULL;
+        reader->current += count;
+    } else {
+        valid = false;
+    }
+
+    if (valid)
+        classifyAccessor(function);
+    pop();
+    return valid ? function : NULL;
+}
+
+// Maps a file whose first bytes match `header`. Chunks point into the
+// mapping for as long as the process runs, so it is only unmapped again
+// when the contents turn out to be unusable.
+uint8_t* mapFile(const char* path, CacheHeader* header, size_t* size)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(CacheHeader)) {
+        close(fd);
+        return NULL;
+    }
+
+    *size        = (size_t)info.st_size;
+    uint8_t* map = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    if (memcmp(map, header, sizeof(CacheHeader)) != 0) {
+        munmap(map, *size);
+        return NULL;
+    }
+
+    return map;
+}
+
+static ObjFunction* loadFunction(CacheHeader* header, const char* sourcePath)
+{
+    char* path = cachePath(header);
+    if (path == NULL)
+        return NULL;
+
+    size_t   size;
+    uint8_t* map = mapFile(path, header, &size);
+    free(path);
+    if (map == NULL)
+        return NULL;
+
+    Reader       reader   = { map + sizeof(CacheHeader), map + size, sourcePath, { 0, 0, NULL } };
+    ObjFunction* function = readFunction(&reader);
+    freeValueArray(&reader.functions);
+    if (function == NULL)
+        munmap(map, size);
+    return function;
+}
+
+ObjFunction* compileCached(const char* sourcePath, utf8_int8_t* source)
+{
+    CacheHeader header;
+    fillHeader(&header, source);
+
+    lockHeap();
+    ObjFunction* function = loadFunction(&header, sourcePath);
+    unlockHeap();
+    if (function != NULL)
+        return function;
+
+    function = compile(sourcePath, source);
+    if (function != NULL) {
+        lockHeap();
+        push(OBJ_VAL(function));
+        storeFunction(&header, function);
+        pop();
+        unlockHeap();
+    }
+
+    return function;
+}
+
+// A bundle is one header followed by every module reachable from an entry
+// script through literal imports, each as its bundle path and function
+// record. Bundle paths are relative to the entry script's directory and
+// resolved lexically, so a bundle runs the same from anywhere.
+
+typedef struct {
+    ObjTable*  modules; // bundle path -> compiled function
+    ValueArray order;   // bundle paths in the order they were found
+} BundleBuilder;
+
+static void addModule(BundleBuilder* builder, const char* path)
+{
+    Value key = OBJ_VAL(copyString(path, (int)strlen(path)));
+    Value function;
+    push(key);
+    if (!tableGet(&builder->modules->table, key, &function)) {
+        tableSet(&builder->modules->table, key, NIL_VAL);
+        writeValueArray(&builder->order, key);
+    }
+    pop();
+}
+
+// The name an OP_IMPORT at `offset` imports, when the instruction before
+// it loads a string constant.
+static Value importedName(Chunk* chunk, int previous, int offset)
+{
+    uint8_t* code = chunk->code;
+    uint32_t index;
+
+    switch (code[previous]) {
+    case OP_CONSTANT:
+        index = (uint32_t)((code[previous + 1] << 8) | code[previous + 2]);
+        break;
+    case OP_CONSTANT_BYTE:
+        index = code[previous + 1];
+        break;
+    case OP_CONSTANT_LONG:
+        index = ((uint32_t)code[previous + 1] << 24) | ((uint32_t)code[previous + 2] << 16)
+            | ((uint32_t)code[previous + 3] << 8) | code[previous + 4];
+        break;
+    case OP_LOAD_CONSTANT_0:
+    case OP_LOAD_CONSTANT_1:
+    case OP_LOAD_CONSTANT_2:
+    case OP_LOAD_CONSTANT_3:
+        index = (uint32_t)(code[previous] - OP_LOAD_CONSTANT_0);
+        break;
+#define SUPERINSTRUCTION(first, second, operands)                        \
+    case OP_##first##__##second:                                         \
+        if (OP_##second != OP_CONSTANT)                                  \
+            return NIL_VAL;                                              \
+        index = (uint32_t)((code[offset - 2] << 8) | code[offset - 1]); \
+        break;
+#include "superinstructions.def"
+#undef SUPERINSTRUCTION
+    default:
+        return NIL_VAL;
+    }
+
+    if (index >= chunk->constants.count || !IS_STRING(chunk->constants.values[index]))
+        return NIL_VAL;
+    return chunk->constants.values[index];
+}
+
+void findImports(ObjFunction* function, ImportFn found, void* context)
+{
+    Chunk* chunk    = &function->chunk;
+    int    previous = -1;
+
+    for (int offset = 0; offset < chunk->count; offset = moveForward(chunk, offset)) {
+        if (chunk->code[offset] == OP_IMPORT && previous >= 0) {
+            Value name = importedName(chunk, previous, offset);
+            if (IS_STRING(name))
+                found(AS_CSTRING(name), function, context);
+        }
+        previous = offset;
+    }
+
+    for (unsigned int i = 0; i < chunk->constants.count; i++) {
+        if (IS_FUNCTION(chunk->constants.values[i]))
+            findImports(AS_FUNCTION(chunk->constants.values[i]), found, context);
+    }
+}
+
+static void collectImport(const char* name, ObjFunction* importer, void* context)
+{
+    char* path = resolveBundlePath(name, importer->source);
+    addModule((BundleBuilder*)context, path);
+    free(path);
+}
+
+bool writeBundle(const char* entryPath, const char* outputPath)
+{
+    const char*   root    = getFilePath(entryPath);
+    BundleBuilder builder = { newTable(), { 0, 0, NULL } };
+    bool          valid   = true;
+    bool          lazy    = lazyCompilation;
+    push(OBJ_VAL(builder.modules));
+
+    // imports are found in the bytecode, so every body has to be compiled
+    lazyCompilation = false;
+    addModule(&builder, root != NULL ? entryPath + strlen(root) + 1 : entryPath);
+
+    for (unsigned int i = 0; valid && i < builder.order.count; i++) {
+        ObjString* path   = AS_STRING(builder.order.values[i]);
+        size_t     length = (root != NULL ? strlen(root) : 0) + path->length + 2;
+        char*      file   = malloc(length);
+        if (root != NULL && path->chars[0] != '/')
+            snprintf(file, length, "%s/%s", root, path->chars);
+        else
+            snprintf(file, length, "%s", path->chars);
+
+        utf8_int8_t* source   = readFile(file);
+        ObjFunction* function = compile(path->chars, source);
+        free(source);
+        free(file);
+
+        valid = function != NULL;
+        if (valid) {
+            push(OBJ_VAL(function));
+            tableSet(&builder.modules->table, OBJ_VAL(path), OBJ_VAL(function));
+            findImports(function, collectImport, &builder);
+            pop();
+        }
+    }
+
+    Buffer buffer = { NULL, 0, 0, { 0, 0, NULL } };
+    if (valid) {
+        CacheHeader header;
+        initHeader(&header, BUNDLE_MAGIC);
+        writeBytes(&buffer, &header, sizeof(CacheHeader));
+        writeU32(&buffer, builder.order.count);
+
+        for (unsigned int i = 0; valid && i < builder.order.count; i++) {
+            Value function;
+            tableGet(&builder.modules->table, builder.order.values[i], &function);
+            valid = writeValue(&buffer, builder.order.values[i]) && writeFunction(&buffer, AS_FUNCTION(function));
+        }
+
+        if (!valid || !writeFile(outputPath, &buffer)) {
+            fprintf(stderr, "Could not write bundle \"%s\".\n", outputPath);
+            valid = false;
+        }
+    }
+
+    free(buffer.bytes);
+    freeValueArray(&buffer.functions);
+    freeValueArray(&builder.order);
+    free((void*)root);
+    lazyCompilation = lazy;
+    pop();
+    return valid;
+}
+
+uint32_t fileMagic(const char* path)
+{
+    FILE*    file  = fopen(path, "rb");
+    uint32_t magic = 0;
+    if (file == NULL)
+        return 0;
+
+    if (fread(&magic, sizeof(magic), 1, file) != 1)
+        magic = 0;
+    fclose(file);
+    return magic;
+}
+
+ObjFunction* loadBundle(const char* path)
+{
+    CacheHeader header;
+    initHeader(&header, BUNDLE_MAGIC);
+
+    size_t   size;
+    uint8_t* map = mapFile(path, &header, &size);
+    if (map == NULL)
+        return NULL;
+
+    Reader       reader = { map + sizeof(CacheHeader), map + size, NULL, { 0, 0, NULL } };
+    ObjFunction* entry  = NULL;
+    uint32_t     count;
+    bool         valid = readU32(&reader, &count) && count > 0;
+
+    for (uint32_t i = 0; valid && i < count; i++) {
+        Value name;
+        valid = readValue(&reader, &name) && IS_STRING(name);
+        if (!valid)
+            break;
+
+        push(name);
+        reader.sourcePath     = AS_CSTRING(name);
+        ObjFunction* function = readFunction(&reader);
+        valid                 = function != NULL;
+        if (valid) {
+            push(OBJ_VAL(function));
+            tableSet(&vm.bundle, name, OBJ_VAL(function));
+            pop();
+            if (entry == NULL)
+                entry = function;
+        }
+        pop();
+    }
+
+    freeValueArray(&reader.functions);
+    if (!valid) {
+        freeTable(&vm.bundle);
+        munmap(map, size);
+        return NULL;
+    }
+
+    return entry;
+}
+
+ObjFunction* findBundled(const char* path, const char* currentFile)
+{
+    if (vm.bundle.count == 0)
+        return NULL;
+
+    char* bundlePath = resolveBundlePath(path, currentFile);
+    Value key        = OBJ_VAL(copyString(bundlePath, (int)strlen(bundlePath)));
+    Value function;
+    free(bundlePath);
+
+    if (!tableGet(&vm.bundle, key, &function))
+        return NULL;
+    return AS_FUNCTION(function);
+}
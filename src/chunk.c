@@ -8,12 +8,21 @@ void initChunk(Chunk* chunk)
     chunk->count    = 0;
     chunk->capacity = 0;
     chunk->code     = NULL;
+    chunk->isMapped = false;
+
+    chunk->lineCount    = 0;
+    chunk->lineCapacity = 0;
+    chunk->lines        = NULL;
 
     initValueArray(&chunk->constants);
-    initValueArray(&chunk->lines);
 }
 
 void writeChunk(Chunk* chunk, uint8_t byte, int line)
+{
+    writeInlinedChunk(chunk, byte, line, false);
+}
+
+void writeInlinedChunk(Chunk* chunk, uint8_t byte, int line, bool inlined)
 {
     if (chunk->capacity < chunk->count + 1) {
         int oldCapacity = chunk->capacity;
@@ -22,8 +31,75 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line)
     }
 
     chunk->code[chunk->count] = byte;
-    writeValueArray(&chunk->lines, NUMBER_VAL(line));
     chunk->count++;
+
+    if (chunk->lineCount > 0 && chunk->lines[chunk->lineCount - 1].line == line
+        && chunk->lines[chunk->lineCount - 1].inlined == inlined)
+        return;
+
+    if (chunk->lineCapacity < chunk->lineCount + 1) {
+        int oldCapacity     = chunk->lineCapacity;
+        chunk->lineCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->lines        = GROW_ARRAY(LineStart, chunk->lines, oldCapacity, chunk->lineCapacity);
+    }
+
+    LineStart* start = &chunk->lines[chunk->lineCount++];
+    start->offset    = chunk->count - 1;
+    start->line      = line;
+    start->inlined   = inlined;
+}
+
+// The index of the run holding `offset`, -1 if there is none.
+static int findLineStart(Chunk* chunk, int offset)
+{
+    int low   = 0;
+    int high  = chunk->lineCount - 1;
+    int index = -1;
+
+    while (low <= high) {
+        int middle = low + (high - low) / 2;
+        if (chunk->lines[middle].offset <= offset) {
+            index = middle;
+            low   = middle + 1;
+        } else {
+            high = middle - 1;
+        }
+    }
+
+    return index;
+}
+
+int getLine(Chunk* chunk, int offset)
+{
+    int index = findLineStart(chunk, offset);
+    return index == -1 ? 0 : chunk->lines[index].line;
+}
+
+bool isInlinedCode(Chunk* chunk, int offset)
+{
+    int index = findLineStart(chunk, offset);
+    return index != -1 && chunk->lines[index].inlined;
+}
+
+// The offset of the OP_INLINE whose body holds `offset`, -1 if the byte
+// wasn't inlined. The body starts right after the 7 byte instruction,
+// whose second operand is the inlined function.
+int getInlineSite(Chunk* chunk, int offset)
+{
+    int index = findLineStart(chunk, offset);
+    if (index == -1 || !chunk->lines[index].inlined)
+        return -1;
+    while (index > 0 && chunk->lines[index - 1].inlined)
+        index--;
+
+    int site = chunk->lines[index].offset - 7;
+    if (site < 0 || chunk->code[site] != OP_INLINE)
+        return -1;
+
+    unsigned int constant = (unsigned int)(chunk->code[site + 3] << 8) | chunk->code[site + 4];
+    if (constant >= chunk->constants.count || !IS_FUNCTION(chunk->constants.values[constant]))
+        return -1;
+    return site;
 }
 
 void remiteBytes(Chunk* chunk, int index, int amount)
@@ -32,26 +108,46 @@ void remiteBytes(Chunk* chunk, int index, int amount)
         return;
     }
 
-    memcpy((chunk->code + index), (chunk->code + index + amount), chunk->count - (index + amount));
+    memmove((chunk->code + index), (chunk->code + index + amount), chunk->count - (index + amount));
     chunk->count -= amount;
 
-    for (int i = 0; i < amount; i++) {
-        removeValueArrayAt(&chunk->lines, index);
+    // shift the runs after the removed bytes, dropping runs that end up
+    // empty and merging neighbours that now share a line
+    int kept = 0;
+    for (int i = 0; i < chunk->lineCount; i++) {
+        LineStart start = chunk->lines[i];
+        if (start.offset >= index + amount)
+            start.offset -= amount;
+        else if (start.offset > index)
+            start.offset = index;
+
+        if (kept > 0 && chunk->lines[kept - 1].offset == start.offset)
+            kept--;
+        if (kept > 0 && chunk->lines[kept - 1].line == start.line
+            && chunk->lines[kept - 1].inlined == start.inlined)
+            continue;
+
+        chunk->lines[kept++] = start;
     }
+    chunk->lineCount = kept;
 }
 
 int addConstant(Chunk* chunk, Value value)
 {
+    lockHeap();
     push(value);
     writeValueArray(&chunk->constants, value);
     pop();
+    unlockHeap();
     return chunk->constants.count - 1;
 }
 
 void freeChunk(Chunk* chunk)
 {
-    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-    freeValueArray(&chunk->lines);
+    // code loaded from a bytecode cache lives in the file mapping
+    if (!chunk->isMapped)
+        FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+    FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
     freeValueArray(&chunk->constants);
     initChunk(chunk);
 }
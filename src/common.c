@@ -86,6 +86,53 @@ const char* resolveRelativePath(const char* path, const char* currentFile)
     return resolvedPath;
 }
 
+// resolve an import against the importing file without touching the
+// filesystem, folding `.` and `..` segments so every spelling of a module
+// inside a bundle names the same entry
+char* resolveBundlePath(const char* path, const char* currentFile)
+{
+    const char* withExtension = ensureExtension(path, ".ph");
+    const char* filePath      = path[0] == '/' ? NULL : getFilePath(currentFile);
+    size_t      length        = (filePath != NULL ? strlen(filePath) + 1 : 0) + strlen(withExtension) + 1;
+    char*       joined        = (char*)malloc(length);
+    char*       resolvedPath  = (char*)malloc(length);
+
+    snprintf(joined, length, "%s%s%s", filePath != NULL ? filePath : "", filePath != NULL ? "/" : "", withExtension);
+    free((void*)filePath);
+    free((void*)withExtension);
+
+    int   end     = 0;
+    char* segment = joined;
+    if (*segment == '/')
+        resolvedPath[end++] = '/';
+
+    while (*segment != '\0') {
+        char*  slash  = strchr(segment, '/');
+        size_t size   = slash != NULL ? (size_t)(slash - segment) : strlen(segment);
+        int    parent = end;
+        while (parent > 0 && resolvedPath[parent - 1] != '/')
+            parent--;
+
+        if (size == 0 || (size == 1 && segment[0] == '.')) {
+            // nothing to add
+        } else if (size == 2 && strncmp(segment, "..", 2) == 0 && end > parent
+            && !(end - parent == 2 && strncmp(resolvedPath + parent, "..", 2) == 0)) {
+            end = parent > 1 ? parent - 1 : parent;
+        } else {
+            if (end > 0 && resolvedPath[end - 1] != '/')
+                resolvedPath[end++] = '/';
+            memcpy(resolvedPath + end, segment, size);
+            end += size;
+        }
+
+        segment += size + (slash != NULL ? 1 : 0);
+    }
+
+    resolvedPath[end] = '\0';
+    free(joined);
+    return resolvedPath;
+}
+
 bool fileExists(const char* path)
 {
     FILE* file = fopen(path, "rb");
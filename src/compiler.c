@@ -1,9 +1,12 @@
+#include <math.h>
+
 #include "compiler.h"
 
 #include "common.h"
 #include "debug.h"
 #include "memory.h"
 #include "object.h"
+#include "optimizer.h"
 #include "scanner.h"
 
 typedef struct
@@ -42,6 +45,8 @@ typedef struct {
     Token name;
     int   depth;
     bool  isCaptured;
+    bool  isConst;
+    Value value; // what a constant evaluated to, or EMPTY_VAL
 } Local;
 
 typedef struct {
@@ -67,26 +72,59 @@ typedef struct Compiler {
     ObjFunction*     function;
     FunctionType     type;
 
-    Local     locals[UINT16_COUNT];
+    Local*    locals;
     int       localCount;
-    Upvalue   upvalues[UINT16_COUNT];
+    int       localCapacity;
+    Upvalue*  upvalues;
+    int       upvalueCapacity;
+    Table     constants;
+    int       reservedConstant;
     int       scopeDepth;
     bool      isInLoop;
     JumpNode* breakNodes;
     int       loopStart;
+    int       loopLocals; // the locals break and continue leave in place
 } Compiler;
 
+// The innermost loop's state, kept aside while a nested loop is compiled.
+typedef struct {
+    bool      isInLoop;
+    JumpNode* breakNodes;
+    int       loopStart;
+    int       loopLocals;
+} LoopState;
+
 typedef struct ClassCompiler {
     struct ClassCompiler* enclosing;
     bool                  hasSuperclass;
 } ClassCompiler;
 
-Parser         parser;
-Chunk*         compilingChunk;
-Compiler*      current        = NULL;
-ClassCompiler* currentClass   = NULL;
-int            anonymousCount = 0;
-bool           inParamList    = false;
+// Compiler state is per thread, imports are compiled on several threads
+// at once before a script starts (see precompile.c).
+static _Thread_local Parser         parser;
+static _Thread_local Compiler*      current        = NULL;
+static _Thread_local ClassCompiler* currentClass   = NULL;
+static _Thread_local int            anonymousCount = 0;
+static _Thread_local bool           inParamList    = false;
+
+// Jumps start out with 16 bit offsets. When one doesn't fit the script is
+// compiled again with 32 bit offsets everywhere, the optimizer narrows the
+// ones that turn out to fit.
+static _Thread_local bool longJumps       = false;
+static _Thread_local bool jumpsOverflowed = false;
+
+// What top level globals hold as far as the rest of the script is
+// concerned, by name: a function calls may inline, or the name of the
+// native module it was loaded with. A name leaves the table once the
+// global is assigned or declared again.
+static _Thread_local Table knownGlobals;
+
+// Top level constants by name, with the value their initializer evaluated to
+// or EMPTY_VAL when it isn't known until runtime.
+static _Thread_local Table constGlobals;
+
+bool               lazyCompilation = false;
+_Thread_local bool silentErrors    = false;
 
 static Chunk* currentChunk(void)
 {
@@ -98,6 +136,9 @@ static void errorAt(Token* token, const char* message)
     if (parser.panicMode)
         return;
     parser.panicMode = true;
+    parser.hadError  = true;
+    if (silentErrors)
+        return;
 
     fprintf(stderr, "[line %d] Error", token->line);
 
@@ -110,7 +151,6 @@ static void errorAt(Token* token, const char* message)
     }
 
     fprintf(stderr, ": %s\n", message);
-    parser.hadError = true;
 }
 
 static void errorAtCurrent(const char* message)
@@ -181,19 +221,37 @@ static void emitOpShort(uint8_t op, uint16_t bytes)
     emitShort(bytes);
 }
 
+static void emitLong(uint32_t bytes)
+{
+    emitShort((uint16_t)(bytes >> 16));
+    emitShort((uint16_t)(bytes & 0xffff));
+}
+
 static void emitLoop(int loopStart)
 {
+    if (longJumps) {
+        emitByte(OP_LOOP_LONG);
+        emitLong((uint32_t)(currentChunk()->count - loopStart + 4));
+        return;
+    }
+
     emitByte(OP_LOOP);
 
     int offset = currentChunk()->count - loopStart + 2;
     if (offset > UINT16_MAX)
-        error("Loop body too large.");
+        jumpsOverflowed = true;
 
     emitShort((uint16_t)offset);
 }
 
 static int emitJump(uint8_t instruction)
 {
+    if (longJumps) {
+        emitByte(instruction == OP_JUMP ? OP_JUMP_LONG : OP_JUMP_IF_FALSE_LONG);
+        emitLong(0xffffffff);
+        return currentChunk()->count - 4;
+    }
+
     emitByte(instruction);
     emitByte(0xff);
     emitByte(0xff);
@@ -215,33 +273,87 @@ static void emitReturn(void)
     emitByte(OP_RETURN);
 }
 
+// Only OP_CONSTANT_LONG can reach past the first 65536 constants, every
+// other instruction names its constant with a 16 bit operand. Once
+// literals fill the pool up to the last RESERVED_CONSTANTS of those slots,
+// the rest are set aside for operands and the literals carry on past them.
+static int addPoolConstant(Value value, bool operand)
+{
+    // identifiers and literals repeat a lot, an equal string or number
+    // already in the pool is reused instead of being added again
+    bool  shared = IS_STRING(value) || IS_NUMBER(value);
+    Value index;
+    if (shared && tableGet(&current->constants, value, &index) && (!operand || AS_NUMBER(index) <= UINT16_MAX))
+        return (int)AS_NUMBER(index);
+
+    ValueArray* pool = &currentChunk()->constants;
+    int         constant;
+    if (operand && current->reservedConstant != 0) {
+        if (current->reservedConstant > UINT16_MAX)
+            return UINT16_COUNT;
+        constant               = current->reservedConstant++;
+        pool->values[constant] = value;
+    } else {
+        if (!operand && current->reservedConstant == 0 && pool->count >= UINT16_COUNT - RESERVED_CONSTANTS) {
+            current->reservedConstant = pool->count;
+            while (pool->count < UINT16_COUNT) {
+                addConstant(currentChunk(), NIL_VAL);
+            }
+        }
+        constant = addConstant(currentChunk(), value);
+    }
+
+    if (shared)
+        tableSet(&current->constants, value, NUMBER_VAL(constant));
+
+    return constant;
+}
+
 static uint16_t makeConstant(Value value)
 {
-    int constant = addConstant(currentChunk(), value);
-    if (constant > UINT8_MAX) {
+    int constant = addPoolConstant(value, true);
+    if (constant > UINT16_MAX) {
         error("Too many constants in one chunk.");
         return 0;
     }
 
-    return constant;
+    return (uint16_t)constant;
 }
 
 static void emitConstant(Value value)
 {
-    emitOpShort(OP_CONSTANT, makeConstant(value));
+    int constant = addPoolConstant(value, false);
+    if (constant > UINT16_MAX) {
+        emitByte(OP_CONSTANT_LONG);
+        emitLong((uint32_t)constant);
+        return;
+    }
+
+    emitOpShort(OP_CONSTANT, (uint16_t)constant);
 }
 
 static void patchJump(int offset)
 {
+    Chunk* chunk = currentChunk();
+
+    if (chunk->code[offset - 1] == OP_JUMP_LONG || chunk->code[offset - 1] == OP_JUMP_IF_FALSE_LONG) {
+        uint32_t jump           = (uint32_t)(chunk->count - offset - 4);
+        chunk->code[offset]     = (jump >> 24) & 0xff;
+        chunk->code[offset + 1] = (jump >> 16) & 0xff;
+        chunk->code[offset + 2] = (jump >> 8) & 0xff;
+        chunk->code[offset + 3] = jump & 0xff;
+        return;
+    }
+
     // -2 to adjust for the bytecode for the jump offset itself.
-    int jump = currentChunk()->count - offset - 2;
+    int jump = chunk->count - offset - 2;
 
     if (jump > UINT16_MAX) {
-        error("Too much code to jump over.");
+        jumpsOverflowed = true;
     }
 
-    currentChunk()->code[offset]     = (jump >> 8) & 0xff;
-    currentChunk()->code[offset + 1] = jump & 0xff;
+    chunk->code[offset]     = (jump >> 8) & 0xff;
+    chunk->code[offset + 1] = jump & 0xff;
 }
 
 static void initCompiler(Compiler* compiler, FunctionType type)
@@ -249,14 +361,24 @@ static void initCompiler(Compiler* compiler, FunctionType type)
     compiler->enclosing  = current;
     compiler->function   = newFunction();
     compiler->type       = type;
-    compiler->localCount = 0;
-    compiler->scopeDepth = 0;
+    compiler->locals          = NULL;
+    compiler->localCount      = 0;
+    compiler->localCapacity   = 0;
+    compiler->upvalues        = NULL;
+    compiler->upvalueCapacity = 0;
+    compiler->scopeDepth      = 0;
+    initTable(&compiler->constants);
+    compiler->reservedConstant = 0;
     compiler->isInLoop   = false;
     compiler->breakNodes = NULL;
     compiler->loopStart  = 0;
+    compiler->loopLocals = 0;
 
     current = compiler;
 
+    compiler->localCapacity = GROW_CAPACITY(0);
+    compiler->locals        = GROW_ARRAY(Local, NULL, 0, compiler->localCapacity);
+
     if (type != TYPE_SCRIPT) {
         if (type == TYPE_ANONYMOUS) {
             char buffer[30];
@@ -270,6 +392,8 @@ static void initCompiler(Compiler* compiler, FunctionType type)
     Local* local      = &current->locals[current->localCount++];
     local->depth      = 0;
     local->isCaptured = false;
+    local->isConst    = false;
+    local->value      = EMPTY_VAL;
     if (type != TYPE_FUNCTION) {
         local->name.start  = "this";
         local->name.length = 4;
@@ -279,20 +403,39 @@ static void initCompiler(Compiler* compiler, FunctionType type)
     }
 }
 
+static ObjFunction* leaveCompiler(void)
+{
+    ObjFunction* function = current->function;
+
+    FREE_ARRAY(Local, current->locals, current->localCapacity);
+    current->locals        = NULL;
+    current->localCapacity = 0;
+    freeTable(&current->constants);
+
+    current = current->enclosing;
+
+    return function;
+}
+
 static ObjFunction* endCompiler(void)
 {
     emitReturn();
-    ObjFunction* function = current->function;
+
+    if (!parser.hadError && !jumpsOverflowed) {
+#ifdef CHUNK_OPTIMIZATION
+        optimizeChunk(currentChunk(), current->function->arity, &knownGlobals);
+#endif
+        classifyAccessor(current->function);
+    }
 
 #ifdef DEBUG_PRINT_CODE
-    if (!parser.hadError) {
-        disassembleChunk(currentChunk(), function->name != NULL ? function->name->chars : "<script>", true);
+    if (!parser.hadError && !jumpsOverflowed) {
+        ObjString* name = current->function->name;
+        disassembleChunk(currentChunk(), name != NULL ? name->chars : "<script>", true);
     }
 #endif
 
-    current = current->enclosing;
-
-    return function;
+    return leaveCompiler();
 }
 
 static void beginScope(void)
@@ -302,7 +445,6 @@ static void beginScope(void)
 
 static void endScope(void)
 {
-    current->isInLoop = false;
     current->scopeDepth--;
 
     while (current->localCount > 0 && current->locals[current->localCount - 1].depth > current->scopeDepth) {
@@ -315,17 +457,18 @@ static void endScope(void)
     }
 }
 
-static void       expression(void);
-static void       statement(void);
-static void       declaration(void);
-static ParseRule* getRule(TokenType type);
-static void       parsePrecedence(Precedence precedence);
-static uint16_t   identifierConstant(Token* name);
-static int        resolveLocal(Compiler* compiler, Token* name);
-static int        resolveUpvalue(Compiler* compiler, Token* name);
-static uint16_t   argumentList(void);
-static void       markInitialized(void);
-static void       function(FunctionType type, int line);
+static void         expression(void);
+static void         statement(void);
+static void         declaration(void);
+static ParseRule*   getRule(TokenType type);
+static void         parsePrecedence(Precedence precedence);
+static uint16_t     identifierConstant(Token* name);
+static int          resolveLocal(Compiler* compiler, Token* name);
+static int          resolveUpvalue(Compiler* compiler, Token* name);
+static bool         identifiersEqual(Token* a, Token* b);
+static uint16_t     argumentList(void);
+static void         markInitialized(void);
+static ObjFunction* function(FunctionType type, int line);
 
 static void binary(bool canAssign)
 {
@@ -507,33 +650,35 @@ static void grouping(bool canAssign)
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
 }
 
-static void number(bool canAssign)
+static Value numberValue(Token* token)
 {
-    UNUSED(canAssign);
-
-    if (parser.previous.start[0] == '0' && parser.previous.start[1] == 'x') {
+    if (token->start[0] == '0' && token->start[1] == 'x') {
         char* end;
-        long  value = strtol(parser.previous.start, &end, 16);
-        emitConstant(NUMBER_VAL(value));
-        return;
+        long  value = strtol(token->start, &end, 16);
+        return NUMBER_VAL(value);
     }
 
-    if (parser.previous.start[0] == '0' && parser.previous.start[1] == 'b') {
+    if (token->start[0] == '0' && token->start[1] == 'b') {
         char* end;
-        long  value = strtol(parser.previous.start + 2, &end, 2);
-        emitConstant(NUMBER_VAL(value));
-        return;
+        long  value = strtol(token->start + 2, &end, 2);
+        return NUMBER_VAL(value);
     }
 
-    if (parser.previous.start[0] == '0' && parser.previous.start[1] == 'o') {
+    if (token->start[0] == '0' && token->start[1] == 'o') {
         char* end;
-        long  value = strtol(parser.previous.start + 2, &end, 8);
-        emitConstant(NUMBER_VAL(value));
-        return;
+        long  value = strtol(token->start + 2, &end, 8);
+        return NUMBER_VAL(value);
     }
 
-    double value = strtod(parser.previous.start, NULL);
-    emitConstant(NUMBER_VAL(value));
+    double value = strtod(token->start, NULL);
+    return NUMBER_VAL(value);
+}
+
+static void number(bool canAssign)
+{
+    UNUSED(canAssign);
+
+    emitConstant(numberValue(&parser.previous));
 }
 
 static void or_(bool canAssign)
@@ -578,8 +723,67 @@ static void string(bool canAssign)
     }
 }
 
+// Stores the value on top of the stack into a variable.
+static void emitStore(uint8_t setOp, int arg)
+{
+    if (setOp == OP_SET_GLOBAL)
+        tableDelete(&knownGlobals, currentChunk()->constants.values[arg]);
+    emitOpShort(setOp, arg);
+}
+
+// Finds the local a name refers to, looking through the enclosing functions
+// the same way resolveUpvalue() does.
+static Local* findLocal(Compiler* compiler, Token* name)
+{
+    for (; compiler != NULL; compiler = compiler->enclosing) {
+        for (int i = compiler->localCount - 1; i >= 0; i--) {
+            if (identifiersEqual(name, &compiler->locals[i].name))
+                return &compiler->locals[i];
+        }
+    }
+
+    return NULL;
+}
+
+static bool isAssignment(bool canAssign)
+{
+    switch (parser.current.type) {
+    case TOKEN_EQUAL:
+        return canAssign;
+    case TOKEN_PLUS_EQUAL:
+    case TOKEN_MINUS_EQUAL:
+    case TOKEN_STAR_EQUAL:
+    case TOKEN_SLASH_EQUAL:
+    case TOKEN_SHIFT_RIGHT_EQUAL:
+    case TOKEN_SHIFT_LEFT_EQUAL:
+    case TOKEN_PLUS_PLUS:
+    case TOKEN_MINUS_MINUS:
+        return true;
+    default:
+        return false;
+    }
+}
+
 static void namedVariable(Token name, bool canAssign)
 {
+    bool   isConst = false;
+    Value  value   = EMPTY_VAL;
+    Local* local   = findLocal(current, &name);
+    if (local != NULL) {
+        isConst = local->isConst;
+        value   = local->value;
+    } else {
+        isConst = tableGet(&constGlobals, OBJ_VAL(copyString(name.start, name.length)), &value);
+    }
+
+    if (isConst && isAssignment(canAssign)) {
+        error("Can't assign to a constant.");
+    } else if (!IS_EMPTY(value)) {
+        // a constant with a known value never reaches its slot or global
+        emitConstant(value);
+        return;
+    }
+
     uint8_t getOp, setOp;
     int     arg = resolveLocal(current, &name);
     if (arg != -1) {
@@ -598,52 +802,52 @@ static void namedVariable(Token name, bool canAssign)
 
     if (canAssign && match(TOKEN_EQUAL)) {
         expression();
-        emitOpShort(setOp, arg);
+        emitStore(setOp, arg);
         return;
     } else if (match(TOKEN_PLUS_EQUAL)) {
         emitOpShort(getOp, arg);
         expression();
         emitByte(OP_ADD);
-        emitOpShort(setOp, arg);
+        emitStore(setOp, arg);
         return;
     } else if (match(TOKEN_MINUS_EQUAL)) {
         emitOpShort(getOp, arg);
         expression();
         emitByte(OP_SUBTRACT);
-        emitOpShort(setOp, arg);
+        emitStore(setOp, arg);
         return;
     } else if (match(TOKEN_STAR_EQUAL)) {
         emitOpShort(getOp, arg);
         expression();
         emitByte(OP_MULTIPLY);
-        emitOpShort(setOp, arg);
+        emitStore(setOp, arg);
         return;
     } else if (match(TOKEN_SLASH_EQUAL)) {
         emitOpShort(getOp, arg);
         expression();
         emitByte(OP_DIVIDE);
-        emitOpShort(setOp, arg);
+        emitStore(setOp, arg);
         return;
     } else if (match(TOKEN_SHIFT_RIGHT_EQUAL)) {
         emitOpShort(getOp, arg);
         expression();
         emitByte(OP_SHIFT_RIGHT);
-        emitOpShort(setOp, arg);
+        emitStore(setOp, arg);
         return;
     } else if (match(TOKEN_SHIFT_LEFT_EQUAL)) {
         emitOpShort(getOp, arg);
         expression();
         emitByte(OP_SHIFT_LEFT);
-        emitOpShort(setOp, arg);
+        emitStore(setOp, arg);
         return;
     } else if (match(TOKEN_PLUS_PLUS)) {
         namedVariable(name, false);
         emitByte(OP_INCREMENT);
-        emitOpShort(setOp, arg);
+        emitStore(setOp, arg);
     } else if (match(TOKEN_MINUS_MINUS)) {
         namedVariable(name, false);
         emitByte(OP_DECREMENT);
-        emitOpShort(setOp, arg);
+        emitStore(setOp, arg);
     } else {
         emitOpShort(getOp, arg);
     }
@@ -817,6 +1021,7 @@ ParseRule rules[] = {
     [TOKEN_NUMBER]            = { number, NULL, PREC_NONE },
     [TOKEN_AND]               = { NULL, and_, PREC_AND },
     [TOKEN_CLASS]             = { NULL, NULL, PREC_NONE },
+    [TOKEN_CONST]             = { NULL, NULL, PREC_NONE },
     [TOKEN_ELSE]              = { NULL, NULL, PREC_NONE },
     [TOKEN_FALSE]             = { literal, NULL, PREC_NONE },
     [TOKEN_FOR]               = { NULL, NULL, PREC_NONE },
@@ -906,6 +1111,12 @@ static int addUpvalue(Compiler* compiler, uint16_t index,
         return 0;
     }
 
+    if (compiler->upvalueCapacity < upvalueCount + 1) {
+        int oldCapacity           = compiler->upvalueCapacity;
+        compiler->upvalueCapacity = GROW_CAPACITY(oldCapacity);
+        compiler->upvalues        = GROW_ARRAY(Upvalue, compiler->upvalues, oldCapacity, compiler->upvalueCapacity);
+    }
+
     compiler->upvalues[upvalueCount].isLocal = isLocal;
     compiler->upvalues[upvalueCount].index   = index;
     return compiler->function->upvalueCount++;
@@ -938,18 +1149,29 @@ static void addLocal(Token name)
         return;
     }
 
+    if (current->localCapacity < current->localCount + 1) {
+        int oldCapacity        = current->localCapacity;
+        current->localCapacity = GROW_CAPACITY(oldCapacity);
+        current->locals        = GROW_ARRAY(Local, current->locals, oldCapacity, current->localCapacity);
+    }
+
     Local* local      = &current->locals[current->localCount++];
     local->name       = name;
     local->depth      = -1;
     local->isCaptured = false;
+    local->isConst    = false;
+    local->value      = EMPTY_VAL;
 }
 
 static void declareVariable(void)
 {
-    if (current->scopeDepth == 0)
+    Token* name = &parser.previous;
+    if (current->scopeDepth == 0) {
+        if (tableGet(&constGlobals, OBJ_VAL(copyString(name->start, name->length)), NULL))
+            error("Already a constant with this name.");
         return;
+    }
 
-    Token* name = &parser.previous;
     for (int i = current->localCount - 1; i >= 0; i--) {
         Local* local = &current->locals[i];
         if (local->depth != -1 && local->depth < current->scopeDepth) {
@@ -983,6 +1205,15 @@ static void markInitialized(void)
     current->locals[current->localCount - 1].depth = current->scopeDepth;
 }
 
+// A stack slot the compiler keeps for itself. No name resolves to it,
+// whoever adds it pops it again and drops it from the locals.
+static void addHiddenLocal(void)
+{
+    Token name = { .type = TOKEN_IDENTIFIER, .start = "", .length = 0, .line = parser.previous.line };
+    addLocal(name);
+    current->locals[current->localCount - 1].depth = current->scopeDepth;
+}
+
 static void defineVariable(uint16_t global)
 {
     if (current->scopeDepth > 0) {
@@ -990,6 +1221,7 @@ static void defineVariable(uint16_t global)
         return;
     }
 
+    tableDelete(&knownGlobals, currentChunk()->constants.values[global]);
     emitOpShort(OP_DEFINE_GLOBAL, global);
 }
 
@@ -1030,10 +1262,8 @@ static void block(void)
     consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
-static void function(FunctionType type, int line)
+static void functionBody(void)
 {
-    Compiler compiler;
-    initCompiler(&compiler, type);
     beginScope();
 
     consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
@@ -1060,16 +1290,95 @@ static void function(FunctionType type, int line)
         }
         emitByte(OP_RETURN);
     }
+}
 
-    ObjFunction* function = endCompiler();
-    function->source      = parser.source;
-    function->line        = line;
+// With lazy compilation the body of a top level function or method is only
+// scanned over here and kept as source, compileLazy() compiles it on the
+// first call. Nothing can be captured from the script's scope at depth 0,
+// so names resolve the same way later. Anything that doesn't scan cleanly
+// is left for the eager path to report.
+static bool deferBody(FunctionType type)
+{
+    if (!lazyCompilation || type == TYPE_ANONYMOUS || current->enclosing->type != TYPE_SCRIPT
+        || current->enclosing->scopeDepth > 0 || !check(TOKEN_LEFT_PAREN)) {
+        return false;
+    }
+
+    Scanner start = saveScanner();
+    Token   open  = parser.current;
+    int     arity = 0;
+
+    Token token = scanToken();
+    while (token.type != TOKEN_RIGHT_PAREN) {
+        if (token.type != TOKEN_IDENTIFIER || ++arity > 255) {
+            restoreScanner(start);
+            return false;
+        }
+        token = scanToken();
+        if (token.type == TOKEN_COMMA) {
+            token = scanToken();
+        } else if (token.type != TOKEN_RIGHT_PAREN) {
+            restoreScanner(start);
+            return false;
+        }
+    }
+
+    if (scanToken().type != TOKEN_LEFT_BRACE) {
+        restoreScanner(start);
+        return false;
+    }
+
+    for (int depth = 1; depth > 0;) {
+        token = scanToken();
+        if (token.type == TOKEN_EOF || token.type == TOKEN_ERROR) {
+            restoreScanner(start);
+            return false;
+        }
+        if (token.type == TOKEN_LEFT_BRACE) {
+            depth++;
+        } else if (token.type == TOKEN_RIGHT_BRACE) {
+            depth--;
+        }
+    }
+
+    size_t       length   = (size_t)(token.start + token.length - open.start);
+    ObjFunction* function = current->function;
+    function->arity       = arity;
+    function->lazyBody    = malloc(length + 1);
+    function->lazyLine    = open.line;
+    function->lazyType    = type;
+    memcpy(function->lazyBody, open.start, length);
+    function->lazyBody[length] = '\0';
+
+    parser.previous = token;
+    advance();
+    return true;
+}
+
+static ObjFunction* function(FunctionType type, int line)
+{
+    Compiler compiler;
+    initCompiler(&compiler, type);
+
+    ObjFunction* function;
+    if (deferBody(type)) {
+        function = leaveCompiler();
+    } else {
+        functionBody();
+        function = endCompiler();
+    }
+
+    function->source = parser.source;
+    function->line   = line;
     emitOpShort(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
 
     for (int i = 0; i < function->upvalueCount; i++) {
         emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
         emitShort(compiler.upvalues[i].index);
     }
+
+    FREE_ARRAY(Upvalue, compiler.upvalues, compiler.upvalueCapacity);
+    return function;
 }
 
 static void classDeclaration(void)
@@ -1149,8 +1458,28 @@ static void funDeclaration(void)
 {
     uint16_t global = parseVariable("Expect function name.");
     markInitialized();
-    function(TYPE_FUNCTION, parser.previous.line);
+    ObjFunction* declared = function(TYPE_FUNCTION, parser.previous.line);
     defineVariable(global);
+
+    if (current->type == TYPE_SCRIPT && current->scopeDepth == 0 && canInline(declared))
+        tableSet(&knownGlobals, currentChunk()->constants.values[global], OBJ_VAL(declared));
+}
+
+// The name of the native module the code from `start` on loads, if it is
+// a plain module("name") call.
+static ObjString* loadedModule(int start)
+{
+    Chunk*   chunk = currentChunk();
+    uint8_t* code  = &chunk->code[start];
+    if (chunk->count - start != 9 || code[0] != OP_GET_GLOBAL || code[3] != OP_CONSTANT || code[6] != OP_CALL
+        || ((code[7] << 8) | code[8]) != 1)
+        return NULL;
+
+    Value callee = chunk->constants.values[(code[1] << 8) | code[2]];
+    Value name   = chunk->constants.values[(code[4] << 8) | code[5]];
+    if (!IS_STRING(callee) || strcmp(AS_CSTRING(callee), "module") != 0 || !IS_STRING(name))
+        return NULL;
+    return AS_STRING(name);
 }
 
 static void varDeclaration(void)
@@ -1172,8 +1501,14 @@ static void varDeclaration(void)
                 error("Too many expressions in variable declaration.");
             }
 
+            int start = currentChunk()->count;
             expression();
-            defineVariable(globals[expressionIndex++]);
+            ObjString* module = loadedModule(start);
+            defineVariable(globals[expressionIndex]);
+
+            if (module != NULL && current->type == TYPE_SCRIPT && current->scopeDepth == 0)
+                tableSet(&knownGlobals, currentChunk()->constants.values[globals[expressionIndex]], OBJ_VAL(module));
+            expressionIndex++;
         } while (match(TOKEN_COMMA));
 
         if (expressionIndex < globalCount) {
@@ -1190,6 +1525,41 @@ static void varDeclaration(void)
     consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
 }
 
+static void constDeclaration(void)
+{
+    uint16_t global = parseVariable("Expect constant name.");
+    consume(TOKEN_EQUAL, "Expect '=' after constant name.");
+
+    int start = currentChunk()->count;
+    expression();
+    consume(TOKEN_SEMICOLON, "Expect ';' after constant declaration.");
+
+    // an initializer that folds is replaced by the value it folds to, which
+    // also keeps that value reachable from the pool
+    Chunk* chunk = currentChunk();
+    Value  value = EMPTY_VAL;
+    if (!parser.hadError && evaluateConstant(chunk, start, &value)) {
+        chunk->count = start;
+        while (chunk->lineCount > 0 && chunk->lines[chunk->lineCount - 1].offset >= start)
+            chunk->lineCount--;
+        emitConstant(value);
+    }
+
+    if (current->scopeDepth > 0) {
+        markInitialized();
+        Local* local   = &current->locals[current->localCount - 1];
+        local->isConst = true;
+        local->value   = value;
+        return;
+    }
+
+    // the VM keeps top level constants from being defined or assigned
+    // again by code compiled separately, imports or later REPL lines
+    tableDelete(&knownGlobals, chunk->constants.values[global]);
+    tableSet(&constGlobals, chunk->constants.values[global], value);
+    emitOpShort(OP_DEFINE_CONSTANT, global);
+}
+
 static void expressionStatement(void)
 {
     expression();
@@ -1197,6 +1567,208 @@ static void expressionStatement(void)
     emitByte(OP_POP);
 }
 
+static void patchSwitch(int slot, int base)
+{
+    int jump = currentChunk()->count - base;
+
+    if (jump > UINT16_MAX) {
+        jumpsOverflowed = true;
+    }
+
+    currentChunk()->code[slot]     = (jump >> 8) & 0xff;
+    currentChunk()->code[slot + 1] = jump & 0xff;
+}
+
+// Whether a case value can index a dense jump array. -0 is left out, it
+// only equals itself.
+static bool isCaseIndex(double value)
+{
+    return value >= INT16_MIN && value <= INT16_MAX && value == (int)value && !(value == 0 && signbit(value));
+}
+
+// Switches whose cases are all number or string literals jump straight to
+// the matching case with OP_SWITCH_TABLE instead of comparing the value
+// against each case in turn. Small integer ranges use a dense jump array
+// indexed by value, anything else maps each value to its jump through a
+// table. Returns false without consuming anything when a case label is
+// not a literal.
+static bool switchTable(void)
+{
+    // the jump array only holds 16 bit offsets
+    if (longJumps)
+        return false;
+
+    Scanner saved = saveScanner();
+    Token   token = parser.current;
+
+    // the ordinal of each case among the distinct case values
+    Value  caseValues[MAX_CASES];
+    int    caseOrdinals[MAX_CASES];
+    int    caseCount = 0;
+    int    distinct  = 0;
+    bool   literal   = true;
+    bool   integers  = true;
+    double low       = 0;
+    double high      = 0;
+    int    depth     = 0;
+
+    for (; literal; token = scanToken()) {
+        if (token.type == TOKEN_EOF || token.type == TOKEN_ERROR) {
+            literal = false;
+        } else if (token.type == TOKEN_LEFT_BRACE) {
+            depth++;
+        } else if (token.type == TOKEN_RIGHT_BRACE) {
+            if (depth-- == 0)
+                break;
+        } else if (token.type == TOKEN_CASE && depth == 0) {
+            token       = scanToken();
+            bool negate = token.type == TOKEN_MINUS;
+            if (negate)
+                token = scanToken();
+
+            Value value;
+            if (token.type == TOKEN_NUMBER) {
+                value = numberValue(&token);
+                if (negate)
+                    value = NUMBER_VAL(-AS_NUMBER(value));
+            } else if (token.type == TOKEN_STRING && !negate) {
+                // the constant keeps the string alive, and is shared with
+                // the compare chain if it is compiled after all
+                value = OBJ_VAL(copyString(token.start + 1, token.length - 2));
+                makeConstant(value);
+            } else {
+                literal = false;
+                break;
+            }
+
+            token = scanToken();
+            if (token.type != TOKEN_COLON || caseCount == MAX_CASES) {
+                literal = false;
+                break;
+            }
+
+            // the first of two equal cases wins, like the compare chain
+            caseValues[caseCount]   = value;
+            caseOrdinals[caseCount] = -1;
+            for (int i = 0; i < caseCount; i++) {
+                if (valuesEqual(caseValues[i], value)) {
+                    caseOrdinals[caseCount] = caseOrdinals[i];
+                    break;
+                }
+            }
+            if (caseOrdinals[caseCount++] != -1)
+                continue;
+            caseOrdinals[caseCount - 1] = distinct;
+
+            if (IS_NUMBER(value) && isCaseIndex(AS_NUMBER(value))) {
+                low  = distinct == 0 || AS_NUMBER(value) < low ? AS_NUMBER(value) : low;
+                high = distinct == 0 || AS_NUMBER(value) > high ? AS_NUMBER(value) : high;
+            } else {
+                integers = false;
+            }
+            distinct++;
+        }
+    }
+
+    restoreScanner(saved);
+
+    if (!literal || distinct < SWITCH_TABLE_MIN_CASES)
+        return false;
+
+    bool     dense = integers && high - low < distinct * 2;
+    int      count = dense ? (int)(high - low) + 1 : distinct;
+    uint16_t operand;
+
+    if (dense) {
+        operand = makeConstant(NUMBER_VAL(low));
+    } else {
+        ObjTable* cases = newTable();
+        operand         = makeConstant(OBJ_VAL(cases));
+        for (int i = 0; i < caseCount; i++) {
+            tableSet(&cases->table, caseValues[i], NUMBER_VAL(caseOrdinals[i]));
+        }
+    }
+
+    emitOpShort(OP_SWITCH_TABLE, operand);
+    emitShort(count);
+    int jumps = currentChunk()->count;
+    for (int i = 0; i <= count; i++) {
+        emitShort(0xffff);
+    }
+    int base = currentChunk()->count;
+
+    int  state = 0; // 0: before all cases, 1: before default, 2: after default.
+    int  caseEnds[MAX_CASES];
+    int  caseEndCount  = 0;
+    int  caseIndex     = 0;
+    int  defaultTarget = -1;
+    bool filled[MAX_CASES * 2];
+    memset(filled, 0, sizeof(filled));
+
+    while (!match(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
+        if (match(TOKEN_CASE) || match(TOKEN_DEFAULT)) {
+            TokenType caseType = parser.previous.type;
+
+            if (state == 2) {
+                error("Can't have another case or default after the default case.");
+            }
+
+            if (state == 1) {
+                // At the end of the previous case, jump over the others.
+                caseEnds[caseEndCount++] = emitJump(OP_JUMP);
+            }
+
+            if (caseType == TOKEN_CASE) {
+                state = 1;
+
+                // the literal was read by the scan above
+                match(TOKEN_MINUS);
+                advance();
+                consume(TOKEN_COLON, "Expect ':' after case value.");
+
+                int slot = dense ? (int)(AS_NUMBER(caseValues[caseIndex]) - low) : caseOrdinals[caseIndex];
+                caseIndex++;
+
+                if (!filled[slot]) {
+                    filled[slot] = true;
+                    patchSwitch(jumps + 2 + slot * 2, base);
+                }
+            } else {
+                state = 2;
+                consume(TOKEN_COLON, "Expect ':' after default.");
+                defaultTarget = currentChunk()->count;
+                patchSwitch(jumps, base);
+            }
+        } else {
+            // Otherwise, it's a statement inside the current case.
+            if (state == 0) {
+                error("Can't have statements before any case.");
+            }
+            statement();
+        }
+    }
+
+    // Values without a case, and gaps in a dense range, go to the default
+    // case or straight past the switch.
+    if (defaultTarget == -1)
+        patchSwitch(jumps, base);
+
+    for (int i = 0; i < count; i++) {
+        if (!filled[i]) {
+            currentChunk()->code[jumps + 2 + i * 2]     = currentChunk()->code[jumps];
+            currentChunk()->code[jumps + 2 + i * 2 + 1] = currentChunk()->code[jumps + 1];
+        }
+    }
+
+    for (int i = 0; i < caseEndCount; i++) {
+        patchJump(caseEnds[i]);
+    }
+
+    emitByte(OP_POP); // The switch value.
+    current->localCount--;
+    return true;
+}
+
 static void switchStatement(void)
 {
     consume(TOKEN_LEFT_PAREN, "Expect '(' after 'switch'.");
@@ -1204,6 +1776,12 @@ static void switchStatement(void)
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after value.");
     consume(TOKEN_LEFT_BRACE, "Expect '{' before switch cases.");
 
+    // the value stays on the stack below the locals of the cases
+    addHiddenLocal();
+
+    if (switchTable())
+        return;
+
     int state = 0; // 0: before all cases, 1: before default, 2: after default.
     int caseEnds[MAX_CASES];
     int caseCount        = 0;
@@ -1266,6 +1844,16 @@ static void switchStatement(void)
     }
 
     emitByte(OP_POP); // The switch value.
+    current->localCount--;
+}
+
+// Pops the locals declared inside the loop body, for a break or
+// continue that leaves their scopes early.
+static void popLoopLocals(void)
+{
+    for (int i = current->localCount - 1; i >= current->loopLocals; i--) {
+        emitByte(current->locals[i].isCaptured ? OP_CLOSE_UPVALUE : OP_POP);
+    }
 }
 
 static void breakStatement(void)
@@ -1273,6 +1861,7 @@ static void breakStatement(void)
     if (!current->isInLoop)
         error("Break must in a loop.");
 
+    popLoopLocals();
     JumpNode* node      = ALLOCATE(JumpNode, 1);
     node->jumpPatch     = emitJump(OP_JUMP);
     node->next          = current->breakNodes;
@@ -1286,6 +1875,7 @@ static void continueStatement(void)
     if (!current->isInLoop)
         error("Continue must in a loop.");
 
+    popLoopLocals();
     emitLoop(current->loopStart);
 
     consume(TOKEN_SEMICOLON, "Expect ';' after 'continue'");
@@ -1294,15 +1884,46 @@ static void continueStatement(void)
 static void patchBreak(void)
 {
     while (current->breakNodes != NULL) {
-        patchJump(current->breakNodes->jumpPatch);
-        current->breakNodes = current->breakNodes->next;
+        JumpNode* node = current->breakNodes;
+        patchJump(node->jumpPatch);
+        current->breakNodes = node->next;
+        FREE(JumpNode, node);
     }
 }
 
+// Starts a loop just before its condition. Every loop gets a hidden local
+// the optimizer may keep a loop-invariant value in, see hoistInvariants();
+// it starts out empty each time the loop is entered.
+static LoopState beginLoop(void)
+{
+    LoopState enclosing = { current->isInLoop, current->breakNodes, current->loopStart, current->loopLocals };
+
+    addHiddenLocal();
+    emitByte(OP_HOIST_SLOT);
+
+    current->breakNodes = NULL;
+    current->loopLocals = current->localCount;
+    return enclosing;
+}
+
+static void endLoop(LoopState enclosing)
+{
+    // breaks land after the condition is popped
+    patchBreak();
+    emitByte(OP_POP);
+    current->localCount--;
+
+    current->isInLoop   = enclosing.isInLoop;
+    current->breakNodes = enclosing.breakNodes;
+    current->loopStart  = enclosing.loopStart;
+    current->loopLocals = enclosing.loopLocals;
+}
+
 static void whileStatement(void)
 {
-    int loopStart      = currentChunk()->count;
-    current->loopStart = loopStart;
+    LoopState enclosing = beginLoop();
+    int       loopStart = currentChunk()->count;
+    current->loopStart  = loopStart;
     consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
@@ -1316,15 +1937,15 @@ static void whileStatement(void)
     patchJump(exitJump);
     emitByte(OP_POP);
 
-    // patch break jump
-    patchBreak();
+    endLoop(enclosing);
 }
 
 static void doWhileStatement(void)
 {
-    int loopStart      = currentChunk()->count;
-    current->loopStart = loopStart;
-    current->isInLoop  = true;
+    LoopState enclosing = beginLoop();
+    int       loopStart = currentChunk()->count;
+    current->loopStart  = loopStart;
+    current->isInLoop   = true;
     statement();
 
     consume(TOKEN_WHILE, "Expect 'while' after loop body.");
@@ -1339,8 +1960,7 @@ static void doWhileStatement(void)
     patchJump(exitJump);
     emitByte(OP_POP);
 
-    // patch break jump
-    patchBreak();
+    endLoop(enclosing);
 }
 
 static void forStatement(void)
@@ -1355,9 +1975,10 @@ static void forStatement(void)
         expressionStatement();
     }
 
-    int loopStart      = currentChunk()->count;
-    current->loopStart = loopStart;
-    int exitJump       = -1;
+    LoopState enclosing = beginLoop();
+    int       loopStart = currentChunk()->count;
+    current->loopStart  = loopStart;
+    int exitJump        = -1;
     if (!match(TOKEN_SEMICOLON)) {
         expression();
         consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
@@ -1389,9 +2010,7 @@ static void forStatement(void)
         emitByte(OP_POP); // Condition.
     }
 
-    // patch break jump
-    patchBreak();
-
+    endLoop(enclosing);
     endScope();
 }
 
@@ -1425,7 +2044,7 @@ static void importStatement(void)
 {
     expression();
     consume(TOKEN_SEMICOLON, "Expect ';' after value.");
-    emitByte(OP_IMPORT);
+    emitBytes(OP_IMPORT, OP_POP);
 }
 
 static void returnStatement(void)
@@ -1458,6 +2077,7 @@ static void synchronize(void)
         case TOKEN_CLASS:
         case TOKEN_FUN:
         case TOKEN_LET:
+        case TOKEN_CONST:
         case TOKEN_FOR:
         case TOKEN_IF:
         case TOKEN_WHILE:
@@ -1480,6 +2100,8 @@ static void declaration(void)
         funDeclaration();
     } else if (match(TOKEN_LET)) {
         varDeclaration();
+    } else if (match(TOKEN_CONST)) {
+        constDeclaration();
     } else {
         statement();
     }
@@ -1519,502 +2141,94 @@ static void statement(void)
     }
 }
 
-static void optimizeBinaryConst(Chunk* chunk, int* index)
+static ObjFunction* compileScript(const char* sourcePath, utf8_int8_t* source)
 {
-    Value*   constants = chunk->constants.values;
-    uint8_t* code      = chunk->code;
-
-    uint16_t arg1 = (code[*index + 1] << 8) | code[*index + 2];
-    uint16_t arg2 = (code[*index + 4] << 8) | code[*index + 5];
-
-#define BINARY_OP(op)                                 \
-    {                                                 \
-        double b        = AS_NUMBER(constants[arg2]); \
-        double a        = AS_NUMBER(constants[arg1]); \
-        constants[arg1] = NUMBER_VAL(a op b);         \
-    }
-
-#define BINARY_OP_INT(op)                                  \
-    {                                                      \
-        int b           = (int)AS_NUMBER(constants[arg2]); \
-        int a           = (int)AS_NUMBER(constants[arg1]); \
-        constants[arg1] = NUMBER_VAL(a op b);              \
-    }
+    initScanner(source);
+    Compiler compiler;
+    initCompiler(&compiler, TYPE_SCRIPT);
 
-#define BINARY_OP_BOOL(op)                            \
-    {                                                 \
-        double b        = AS_NUMBER(constants[arg2]); \
-        double a        = AS_NUMBER(constants[arg1]); \
-        constants[arg1] = BOOL_VAL(a op b);           \
-    }
+    parser.hadError  = false;
+    parser.panicMode = false;
+    parser.source    = sourcePath;
+    jumpsOverflowed  = false;
+    initTable(&knownGlobals);
+    initTable(&constGlobals);
 
-    switch (chunk->code[*index + 6]) {
-    case OP_ADD:
-        BINARY_OP(+);
-        break;
-    case OP_MULTIPLY:
-        BINARY_OP(*);
-        break;
-    case OP_DIVIDE:
-        BINARY_OP(/);
-        break;
-    case OP_SUBTRACT:
-        BINARY_OP(-);
-        break;
-    case OP_MODULO:
-        BINARY_OP_INT(%);
-        break;
-    case OP_BITWISE_AND:
-        BINARY_OP_INT(&);
-        break;
-    case OP_BITWISE_OR:
-        BINARY_OP_INT(|);
-        break;
-    case OP_BITWISE_XOR:
-        BINARY_OP_INT(^);
-        break;
-    case OP_SHIFT_LEFT:
-        BINARY_OP_INT(<<);
-        break;
-    case OP_SHIFT_RIGHT:
-        BINARY_OP_INT(>>);
-        break;
-    case OP_LESS:
-        BINARY_OP_BOOL(<);
-        break;
-    case OP_GREATER:
-        BINARY_OP_BOOL(>);
-        break;
-    default:
-        break;
+    advance();
+    while (!match(TOKEN_EOF)) {
+        declaration();
     }
 
-    remiteBytes(chunk, *index + 3, 4);
+    ObjFunction* function = endCompiler();
+    function->source = sourcePath;
+    freeTable(&knownGlobals);
+    freeTable(&constGlobals);
+    return parser.hadError ? NULL : function;
 }
 
-void optimizeChunk(Chunk* chunk)
+ObjFunction* compile(const char* sourcePath, utf8_int8_t* source)
 {
-    Value*   constants = chunk->constants.values;
-    uint8_t* code      = chunk->code;
-
-    int passes = 0;
-    int folds  = 0;
+    int firstAnonymous = anonymousCount;
 
-    // calculate the number of jumps
-    int jumpCount = 0;
-    for (int i = 0; i < chunk->count;) {
-        uint8_t instruction = code[i];
-        int     movement    = moveForward(chunk, i);
-        switch (instruction) {
-        case OP_JUMP:
-        case OP_JUMP_IF_FALSE:
-        case OP_LOOP:
-            jumpCount++;
-        default:
-            i = movement;
-            break;
-        }
-    }
-
-    // array of jump instruction offsets
-    int jumps[jumpCount];
-    memset(jumps, 0, sizeof(jumps));
-
-    // store jump offsets and targets
-    int jumpIndex = 0;
-    for (int j = 0; j < chunk->count;) {
-        uint8_t instruction = code[j];
-        int     movement    = moveForward(chunk, j);
-        switch (instruction) {
-        case OP_JUMP:
-        case OP_JUMP_IF_FALSE:
-        case OP_LOOP:
-            jumps[jumpIndex++] = j;
-        default:
-            j = movement;
-            break;
-        }
+    longJumps             = false;
+    ObjFunction* function = compileScript(sourcePath, source);
+    if (jumpsOverflowed && !parser.hadError) {
+        longJumps      = true;
+        anonymousCount = firstAnonymous;
+        function       = compileScript(sourcePath, source);
+        longJumps      = false;
     }
 
-    for (int i = 0; i < chunk->count;) {
-        uint8_t instruction       = code[i];
-        int     movement          = moveForward(chunk, i);
-        int     currentAdjustment = 0;
-
-        switch (instruction) {
-        case OP_CONSTANT: {
-            uint8_t nextInstruction = code[i + 3];
-            if (nextInstruction == OP_CONSTANT) {
-                uint8_t  operation = code[i + 6];
-                uint16_t arg1      = (code[i + 1] << 8) | code[i + 2];
-                uint16_t arg2      = (code[i + 4] << 8) | code[i + 5];
-
-                switch (operation) {
-                case OP_ADD:
-                case OP_MULTIPLY:
-                case OP_DIVIDE:
-                case OP_SUBTRACT:
-                case OP_MODULO:
-                case OP_BITWISE_AND:
-                case OP_BITWISE_OR:
-                case OP_BITWISE_XOR:
-                case OP_SHIFT_LEFT:
-                case OP_SHIFT_RIGHT:
-                case OP_LESS:
-                case OP_GREATER:
-                    if (IS_NUMBER(constants[arg1]) && IS_NUMBER(constants[arg2])) {
-                        optimizeBinaryConst(chunk, &i);
-                        folds++;
-                        currentAdjustment += 4;
-                    }
-                    break;
-                default:
-                    i = movement;
-                    break;
-                }
-            } else {
-                i = movement;
-            }
-            break;
-        }
-        case OP_GET_GLOBAL: {
-            uint8_t nextInstruction = code[i + 3];
-            if (nextInstruction == OP_GET_GLOBAL) {
-                uint16_t arg1 = (code[i + 1] << 8) | code[i + 2];
-                uint16_t arg2 = (code[i + 4] << 8) | code[i + 5];
-
-                code[i]     = OP_GET_GLOBAL_2;
-                code[i + 1] = arg1 >> 8;
-                code[i + 2] = arg1 & 0xff;
-                code[i + 3] = arg2 >> 8;
-                code[i + 4] = arg2 & 0xff;
-                remiteBytes(chunk, i + 5, 1);
-                folds++;
-                currentAdjustment += 1;
-            } else {
-                i = movement;
-            }
-            break;
-        }
-        case OP_GET_GLOBAL_2: {
-            uint8_t nextInstruction = code[i + 5];
-            if (nextInstruction == OP_GET_GLOBAL) {
-                uint16_t arg1 = (code[i + 1] << 8) | code[i + 2];
-                uint16_t arg2 = (code[i + 3] << 8) | code[i + 4];
-                uint16_t arg3 = (code[i + 6] << 8) | code[i + 7];
-
-                code[i]     = OP_GET_GLOBAL_3;
-                code[i + 1] = arg1 >> 8;
-                code[i + 2] = arg1 & 0xff;
-                code[i + 3] = arg2 >> 8;
-                code[i + 4] = arg2 & 0xff;
-                code[i + 5] = arg3 >> 8;
-                code[i + 6] = arg3 & 0xff;
-                remiteBytes(chunk, i + 7, 1);
-                folds++;
-                currentAdjustment += 1;
-            } else {
-                i = movement;
-            }
-            break;
-        }
-        case OP_GET_GLOBAL_3: {
-            uint8_t nextInstruction = code[i + 7];
-            if (nextInstruction == OP_GET_GLOBAL) {
-                uint16_t arg1 = (code[i + 1] << 8) | code[i + 2];
-                uint16_t arg2 = (code[i + 3] << 8) | code[i + 4];
-                uint16_t arg3 = (code[i + 5] << 8) | code[i + 6];
-                uint16_t arg4 = (code[i + 8] << 8) | code[i + 9];
-
-                code[i]     = OP_GET_GLOBAL_4;
-                code[i + 1] = arg1 >> 8;
-                code[i + 2] = arg1 & 0xff;
-                code[i + 3] = arg2 >> 8;
-                code[i + 4] = arg2 & 0xff;
-                code[i + 5] = arg3 >> 8;
-                code[i + 6] = arg3 & 0xff;
-                code[i + 7] = arg4 >> 8;
-                code[i + 8] = arg4 & 0xff;
-                remiteBytes(chunk, i + 9, 1);
-                folds++;
-                currentAdjustment += 1;
-            } else {
-                i = movement;
-            }
-            break;
-        }
-        case OP_GET_LOCAL: {
-            uint8_t nextInstruction = code[i + 3];
-            if (nextInstruction == OP_GET_LOCAL) {
-                uint16_t arg1 = (code[i + 1] << 8) | code[i + 2];
-                uint16_t arg2 = (code[i + 4] << 8) | code[i + 5];
-
-                code[i]     = OP_GET_LOCAL_2;
-                code[i + 1] = arg1 >> 8;
-                code[i + 2] = arg1 & 0xff;
-                code[i + 3] = arg2 >> 8;
-                code[i + 4] = arg2 & 0xff;
-                remiteBytes(chunk, i + 5, 1);
-                folds++;
-                currentAdjustment += 1;
-            } else {
-                i = movement;
-            }
-            break;
-        }
-        case OP_GET_LOCAL_2: {
-            uint8_t nextInstruction = code[i + 5];
-            if (nextInstruction == OP_GET_LOCAL) {
-                uint16_t arg1 = (code[i + 1] << 8) | code[i + 2];
-                uint16_t arg2 = (code[i + 3] << 8) | code[i + 4];
-                uint16_t arg3 = (code[i + 6] << 8) | code[i + 7];
-
-                code[i]     = OP_GET_LOCAL_3;
-                code[i + 1] = arg1 >> 8;
-                code[i + 2] = arg1 & 0xff;
-                code[i + 3] = arg2 >> 8;
-                code[i + 4] = arg2 & 0xff;
-                code[i + 5] = arg3 >> 8;
-                code[i + 6] = arg3 & 0xff;
-                remiteBytes(chunk, i + 7, 1);
-                folds++;
-                currentAdjustment += 1;
-            } else {
-                i = movement;
-            }
-            break;
-        }
-        case OP_GET_LOCAL_3: {
-            uint8_t nextInstruction = code[i + 7];
-            if (nextInstruction == OP_GET_LOCAL) {
-                uint16_t arg1 = (code[i + 1] << 8) | code[i + 2];
-                uint16_t arg2 = (code[i + 3] << 8) | code[i + 4];
-                uint16_t arg3 = (code[i + 5] << 8) | code[i + 6];
-                uint16_t arg4 = (code[i + 8] << 8) | code[i + 9];
-
-                code[i]     = OP_GET_LOCAL_4;
-                code[i + 1] = arg1 >> 8;
-                code[i + 2] = arg1 & 0xff;
-                code[i + 3] = arg2 >> 8;
-                code[i + 4] = arg2 & 0xff;
-                code[i + 5] = arg3 >> 8;
-                code[i + 6] = arg3 & 0xff;
-                code[i + 7] = arg4 >> 8;
-                code[i + 8] = arg4 & 0xff;
-                remiteBytes(chunk, i + 9, 1);
-                folds++;
-                currentAdjustment += 1;
-            } else {
-                i = movement;
-            }
-            break;
-        }
-
-        case OP_SET_LOCAL: {
-            uint8_t nextInstruction = code[i + 3];
-            if (nextInstruction == OP_SET_LOCAL) {
-                uint16_t arg1 = (code[i + 1] << 8) | code[i + 2];
-                uint16_t arg2 = (code[i + 4] << 8) | code[i + 5];
-
-                code[i]     = OP_SET_LOCAL_2;
-                code[i + 1] = arg1 >> 8;
-                code[i + 2] = arg1 & 0xff;
-                code[i + 3] = arg2 >> 8;
-                code[i + 4] = arg2 & 0xff;
-                remiteBytes(chunk, i + 5, 1);
-                folds++;
-                currentAdjustment += 1;
-            } else {
-                i = movement;
-            }
-            break;
-        }
-        case OP_SET_LOCAL_2: {
-            uint8_t nextInstruction = code[i + 5];
-            if (nextInstruction == OP_SET_LOCAL) {
-                uint16_t arg1 = (code[i + 1] << 8) | code[i + 2];
-                uint16_t arg2 = (code[i + 3] << 8) | code[i + 4];
-                uint16_t arg3 = (code[i + 6] << 8) | code[i + 7];
-
-                code[i]     = OP_SET_LOCAL_3;
-                code[i + 1] = arg1 >> 8;
-                code[i + 2] = arg1 & 0xff;
-                code[i + 3] = arg2 >> 8;
-                code[i + 4] = arg2 & 0xff;
-                code[i + 5] = arg3 >> 8;
-                code[i + 6] = arg3 & 0xff;
-                remiteBytes(chunk, i + 7, 1);
-                folds++;
-                currentAdjustment += 1;
-            } else {
-                i = movement;
-            }
-            break;
-        }
-        case OP_SET_LOCAL_3: {
-            uint8_t nextInstruction = code[i + 7];
-            if (nextInstruction == OP_SET_LOCAL) {
-                uint16_t arg1 = (code[i + 1] << 8) | code[i + 2];
-                uint16_t arg2 = (code[i + 3] << 8) | code[i + 4];
-                uint16_t arg3 = (code[i + 5] << 8) | code[i + 6];
-                uint16_t arg4 = (code[i + 8] << 8) | code[i + 9];
-
-                code[i]     = OP_SET_LOCAL_4;
-                code[i + 1] = arg1 >> 8;
-                code[i + 2] = arg1 & 0xff;
-                code[i + 3] = arg2 >> 8;
-                code[i + 4] = arg2 & 0xff;
-                code[i + 5] = arg3 >> 8;
-                code[i + 6] = arg3 & 0xff;
-                code[i + 7] = arg4 >> 8;
-                code[i + 8] = arg4 & 0xff;
-                remiteBytes(chunk, i + 9, 1);
-                folds++;
-                currentAdjustment += 1;
-            } else {
-                i = movement;
-            }
-            break;
-        }
-
-        case OP_POP: {
-            uint8_t nextInstruction = code[i + 1];
-            if (nextInstruction == OP_POP) {
-                bool isJumpTarget = false;
-
-                for (int* offset = jumps; offset < jumps + jumpCount; offset++) {
-                    uint8_t  instruction       = code[*offset];
-                    uint16_t target            = (uint16_t)(code[*offset + 1] << 8) | code[*offset + 2];
-                    uint8_t  dir               = instruction == OP_JUMP || instruction == OP_JUMP_IF_FALSE ? 1 : -1;
-                    int      targetIndex       = *offset + 3 + dir * (target);
-                    uint8_t  targetInstruction = code[targetIndex];
-                    if ((i + 1) == targetIndex && (targetInstruction == OP_POP_N || targetInstruction == OP_POP)) {
-                        isJumpTarget = true;
-                    }
-                }
-
-                if (!isJumpTarget) {
-                    code[i]     = OP_POP_N;
-                    code[i + 1] = 2;
-                } else {
-                    i = movement;
-                }
-            } else {
-                i = movement;
-            }
-            break;
-        }
-
-        case OP_POP_N: {
-            uint8_t nextInstruction = code[i + 2];
-
-            if (nextInstruction == OP_POP) {
-                bool isJumpTarget = false;
-
-                for (int* offset = jumps; offset < jumps + jumpCount; offset++) {
-                    uint8_t  instruction       = code[*offset];
-                    uint16_t target            = (uint16_t)(code[*offset + 1] << 8) | code[*offset + 2];
-                    uint8_t  dir               = instruction == OP_JUMP || instruction == OP_JUMP_IF_FALSE ? 1 : -1;
-                    int      targetIndex       = *offset + 3 + dir * (target);
-                    uint8_t  targetInstruction = code[targetIndex];
-                    if ((i + 1) == targetIndex && (targetInstruction == OP_POP_N || targetInstruction == OP_POP)) {
-                        isJumpTarget = true;
-                    }
-                }
-
-                if (!isJumpTarget) {
-                    uint8_t count = code[i + 1];
-                    code[i + 1]   = count + 1;
-                    remiteBytes(chunk, i + 2, 1);
-                    currentAdjustment += 1;
-                } else {
-                    i = movement;
-                }
-            } else {
-                i = movement;
-            }
-
-            break;
-        }
-
-            // case OP_CALL: {
-            //     uint8_t nextInstruction = code[i + 3];
-            //     if (nextInstruction == OP_POP) {
-            //         code[i] = OP_CALL_BLIND;
-            //         remiteBytes(chunk, i + 3, 1);
-            //         currentAdjustment += 1;
-            //     } else {
-            //         i = movement;
-            //     }
-            // }
-
-        default:
-            i = movement;
-            break;
-        }
+    return function;
+}
 
-        if (currentAdjustment > 0) {
-            // fix jump offsets post-fold
-            for (int* offset = jumps; offset < jumps + jumpCount; offset++) {
-                if (*offset >= i) {
-                    *offset = *offset - currentAdjustment;
-                }
-            }
+static ObjFunction* compileBody(ObjFunction* lazy)
+{
+    ClassCompiler classCompiler;
+    classCompiler.enclosing     = NULL;
+    classCompiler.hasSuperclass = false;
+    currentClass                = lazy->lazyType == TYPE_FUNCTION ? NULL : &classCompiler;
 
-            // fix jump targets post-fold
-            for (int* offset = jumps; offset < jumps + jumpCount; offset++) {
-                uint8_t  instruction = code[*offset];
-                uint16_t target      = (uint16_t)(code[*offset + 1] << 8) | code[*offset + 2];
-                if (instruction == OP_JUMP || instruction == OP_JUMP_IF_FALSE) {
-                    int targetIndex = *offset + (target - currentAdjustment) + 3;
-                    if (i <= targetIndex && (*offset <= i)) {
-                        target -= currentAdjustment;
-                        code[*offset + 1] = target >> 8;
-                        code[*offset + 2] = target & 0xff;
-                    }
-                } else if (instruction == OP_LOOP) {
-                    int targetIndex = *offset + -(target - currentAdjustment) + 3;
-                    if (i >= targetIndex && (i <= *offset)) {
-                        target -= currentAdjustment;
-                        code[*offset + 1] = target >> 8;
-                        code[*offset + 2] = target & 0xff;
-                    }
-                }
-            }
-        }
+    initScannerAt((utf8_int8_t*)lazy->lazyBody, lazy->lazyLine);
+    parser.hadError  = false;
+    parser.panicMode = false;
+    parser.source    = lazy->source;
+    parser.previous  = syntheticToken(lazy->name->chars);
+    jumpsOverflowed  = false;
+    advance();
 
-        passes++;
-        // printf("\n");
-    }
+    Compiler compiler;
+    initCompiler(&compiler, (FunctionType)lazy->lazyType);
+    functionBody();
+    ObjFunction* function = endCompiler();
 
-    UNUSED(passes);
-    UNUSED(folds);
-    // printf("Optimization Passes: %d\n", passes);
-    // printf("Constant Folds: %d\n", folds);
+    FREE_ARRAY(Upvalue, compiler.upvalues, compiler.upvalueCapacity);
+    currentClass = NULL;
+    return function;
 }
 
-ObjFunction* compile(const char* sourcePath, utf8_int8_t* source)
+bool compileLazy(ObjFunction* lazy)
 {
-    initScanner(source);
-    Compiler compiler;
-    initCompiler(&compiler, TYPE_SCRIPT);
-
-    parser.hadError  = false;
-    parser.panicMode = false;
-    parser.source    = sourcePath;
+    longJumps             = false;
+    ObjFunction* function = compileBody(lazy);
+    if (jumpsOverflowed && !parser.hadError) {
+        longJumps = true;
+        function  = compileBody(lazy);
+        longJumps = false;
+    }
 
-    advance();
-    while (!match(TOKEN_EOF)) {
-        declaration();
+    if (parser.hadError) {
+        return false;
     }
 
-    ObjFunction* function = endCompiler();
-#ifdef CHUNK_OPTIMIZATION
-    optimizeChunk(&function->chunk);
-#endif
-    // exit(1);
-    function->source = sourcePath;
-    return parser.hadError ? NULL : function;
+    freeChunk(&lazy->chunk);
+    lazy->chunk = function->chunk;
+    initChunk(&function->chunk);
+
+    free(lazy->lazyBody);
+    lazy->lazyBody = NULL;
+    classifyAccessor(lazy);
+    return true;
 }
 
 void markCompilerRoots(void)
@@ -2022,6 +2236,10 @@ void markCompilerRoots(void)
     Compiler* compiler = current;
     while (compiler != NULL) {
         markObject((Obj*)compiler->function);
+        for (int i = 0; i < compiler->localCount; i++)
+            markValue(compiler->locals[i].value);
         compiler = compiler->enclosing;
     }
+    markTable(&knownGlobals);
+    markTable(&constGlobals);
 }
@@ -15,6 +15,12 @@ int loop_depth = 0;
 
 int moveForward(Chunk* chunk, int offset);
 
+static uint32_t readLong(Chunk* chunk, int offset)
+{
+    return ((uint32_t)chunk->code[offset] << 24) | ((uint32_t)chunk->code[offset + 1] << 16)
+        | ((uint32_t)chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+}
+
 void disassembleChunk(Chunk* chunk, const char* name, bool flow)
 {
     in_loop       = 0;
@@ -39,6 +45,20 @@ void disassembleChunk(Chunk* chunk, const char* name, bool flow)
             in_loop++;
         }
 
+        if (instruction == OP_LOOP_LONG) {
+            loop_starts[in_loop] = offset + 5 - (int)readLong(chunk, offset + 1);
+            loop_ends[in_loop]   = offset;
+            in_loop++;
+        }
+
+        if (instruction == OP_FOR_STEP || instruction == OP_FOR_STEP_CONST) {
+            uint16_t jump = (uint16_t)(chunk->code[offset + 5] << 8);
+            jump |= chunk->code[offset + 6];
+            loop_starts[in_loop] = offset + 7 + -1 * jump;
+            loop_ends[in_loop]   = offset;
+            in_loop++;
+        }
+
         offset = moveForward(chunk, offset);
     }
 
@@ -57,6 +77,23 @@ static int constantInstruction(const char* name, Chunk* chunk, int offset)
     return offset + 3;
 }
 
+static int constantByteInstruction(const char* name, Chunk* chunk, int offset)
+{
+    uint8_t constant = chunk->code[offset + 1];
+    printf("%-16s %4d '", name, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 2;
+}
+
+static int implicitConstantInstruction(const char* name, Chunk* chunk, int offset, int constant)
+{
+    printf("%-16s %4d '", name, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 1;
+}
+
 static int constantInstructionCompound(const char* name, Chunk* chunk, int offset, int length)
 {
     printf("%-16s ", name);
@@ -130,6 +167,88 @@ static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset)
     return offset + 3;
 }
 
+static int longJumpInstruction(const char* name, int sign, Chunk* chunk, int offset)
+{
+    uint32_t jump = readLong(chunk, offset + 1);
+    printf("%-16s %4d -> %d\n", name, offset, offset + 5 + sign * (int)jump);
+    return offset + 5;
+}
+
+static int constantLongInstruction(const char* name, Chunk* chunk, int offset)
+{
+    uint32_t constant = readLong(chunk, offset + 1);
+    printf("%-16s %4u '", name, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 5;
+}
+
+static int switchInstruction(const char* name, Chunk* chunk, int offset)
+{
+    uint16_t constant = (uint16_t)(chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+    uint16_t count    = (uint16_t)(chunk->code[offset + 3] << 8) | chunk->code[offset + 4];
+    int      base     = offset + 7 + count * 2;
+    printf("%-16s %4d '", name, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("'\n");
+
+    for (int i = 0; i <= count; i++) {
+        uint16_t jump = (uint16_t)(chunk->code[offset + 5 + i * 2] << 8) | chunk->code[offset + 6 + i * 2];
+        if (i == 0) {
+            printf("%04d      |                     default -> %d\n", offset + 5, base + jump);
+        } else {
+            printf("%04d      |                     case %d -> %d\n", offset + 5 + i * 2, i - 1, base + jump);
+        }
+    }
+
+    return base;
+}
+
+static int inlineInstruction(const char* name, Chunk* chunk, int offset)
+{
+    uint16_t argCount = (uint16_t)(chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+    uint16_t constant = (uint16_t)(chunk->code[offset + 3] << 8) | chunk->code[offset + 4];
+    uint16_t jump     = (uint16_t)(chunk->code[offset + 5] << 8) | chunk->code[offset + 6];
+    printf("%-16s (%d args) %4d '", name, argCount, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("' -> %d\n", offset + 7 + jump);
+    return offset + 7;
+}
+
+static int nativeConstantInstruction(const char* name, Chunk* chunk, int offset)
+{
+    uint16_t module   = (uint16_t)(chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+    uint16_t constant = (uint16_t)(chunk->code[offset + 3] << 8) | chunk->code[offset + 4];
+    uint16_t jump     = (uint16_t)(chunk->code[offset + 5] << 8) | chunk->code[offset + 6];
+    printf("%-16s %4d %4d '", name, module, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("' -> %d\n", offset + 7 + jump);
+    return offset + 7;
+}
+
+static int hoistedInstruction(const char* name, Chunk* chunk, int offset)
+{
+    uint16_t slot = (uint16_t)(chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+    uint16_t jump = (uint16_t)(chunk->code[offset + 3] << 8) | chunk->code[offset + 4];
+    printf("%-16s %4d -> %d\n", name, slot, offset + 5 + jump);
+    return offset + 5;
+}
+
+static int forStepInstruction(const char* name, Chunk* chunk, int offset, bool constant)
+{
+    uint16_t slot  = (uint16_t)(chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+    uint16_t limit = (uint16_t)(chunk->code[offset + 3] << 8) | chunk->code[offset + 4];
+    uint16_t jump  = (uint16_t)(chunk->code[offset + 5] << 8) | chunk->code[offset + 6];
+    printf("%-16s %4d %4d ", name, slot, limit);
+    if (constant) {
+        printf("'");
+        printValue(chunk->constants.values[limit]);
+        printf("' ");
+    }
+    printf("-> %d\n", offset + 7 - jump);
+    return offset + 7;
+}
+
 int disassembleInstruction(Chunk* chunk, int offset, bool flow)
 {
     OpCode instruction   = chunk->code[offset];
@@ -153,6 +272,18 @@ int disassembleInstruction(Chunk* chunk, int offset, bool flow)
             is_op_jump = true;
         }
 
+        if (instruction == OP_JUMP_IF_FALSE_LONG) {
+            false_jumps[in_false_jump] = offset + 5 + (int)readLong(chunk, offset + 1);
+            in_false_jump++;
+            is_false_jump = true;
+        }
+
+        if (instruction == OP_JUMP_LONG) {
+            jumps[in_jump] = offset + 5 + (int)readLong(chunk, offset + 1);
+            in_jump++;
+            is_op_jump = true;
+        }
+
         if (is_false_jump) {
             if (in_false_jump > 1) {
                 if (in_false_jump == 1) {
@@ -304,10 +435,9 @@ int disassembleInstruction(Chunk* chunk, int offset, bool flow)
         }
     }
 
-    int line = AS_NUMBER(chunk->lines.values[offset]);
-    int prev = AS_NUMBER(chunk->lines.values[offset - 1]);
+    int line = getLine(chunk, offset);
 
-    if (offset > 0 && line == prev) {
+    if (offset > 0 && line == getLine(chunk, offset - 1)) {
         printf("   | ");
     } else {
         printf("%4d ", line);
@@ -316,6 +446,8 @@ int disassembleInstruction(Chunk* chunk, int offset, bool flow)
     switch (instruction) {
     case OP_CONSTANT:
         return constantInstruction("OP_CONSTANT", chunk, offset);
+    case OP_CONSTANT_LONG:
+        return constantLongInstruction("OP_CONSTANT_LONG", chunk, offset);
     case OP_NIL:
         return simpleInstruction("OP_NIL", offset);
     case OP_TRUE:
@@ -368,6 +500,8 @@ int disassembleInstruction(Chunk* chunk, int offset, bool flow)
         return byteInstruction("OP_POP_N", chunk, offset);
     case OP_DUP:
         return simpleInstruction("OP_DUP", offset);
+    case OP_PEEK:
+        return byteInstruction("OP_PEEK", chunk, offset);
     case OP_GET_LOCAL:
         return shortInstruction("OP_GET_LOCAL", chunk, offset);
     case OP_GET_LOCAL_2:
@@ -394,6 +528,8 @@ int disassembleInstruction(Chunk* chunk, int offset, bool flow)
         return constantInstructionCompound("OP_GET_GLOBAL_4", chunk, offset, 4);
     case OP_DEFINE_GLOBAL:
         return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+    case OP_DEFINE_CONSTANT:
+        return constantInstruction("OP_DEFINE_CONSTANT", chunk, offset);
     case OP_SET_GLOBAL:
         return constantInstruction("OP_SET_GLOBAL", chunk, offset);
     case OP_GET_UPVALUE:
@@ -418,6 +554,12 @@ int disassembleInstruction(Chunk* chunk, int offset, bool flow)
         return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
     case OP_LOOP:
         return jumpInstruction("OP_LOOP", -1, chunk, offset);
+    case OP_JUMP_LONG:
+        return longJumpInstruction("OP_JUMP_LONG", 1, chunk, offset);
+    case OP_JUMP_IF_FALSE_LONG:
+        return longJumpInstruction("OP_JUMP_IF_FALSE_LONG", 1, chunk, offset);
+    case OP_LOOP_LONG:
+        return longJumpInstruction("OP_LOOP_LONG", -1, chunk, offset);
     case OP_DUMP:
         return simpleInstruction("OP_DUMP", offset);
     case OP_CALL:
@@ -434,7 +576,8 @@ int disassembleInstruction(Chunk* chunk, int offset, bool flow)
         return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
     case OP_CLOSURE: {
         offset++;
-        uint8_t constant = chunk->code[offset++];
+        uint16_t constant = (uint16_t)(chunk->code[offset] << 8) | chunk->code[offset + 1];
+        offset += 2;
         printf("%-16s %4d ", "OP_CLOSURE", constant);
         printValue(chunk->constants.values[constant]);
         printf("\n");
@@ -442,9 +585,10 @@ int disassembleInstruction(Chunk* chunk, int offset, bool flow)
         ObjFunction* function = AS_FUNCTION(chunk->constants.values[constant]);
         for (int j = 0; j < function->upvalueCount; j++) {
             int isLocal = chunk->code[offset++];
-            int index   = chunk->code[offset++];
+            int index   = (chunk->code[offset] << 8) | chunk->code[offset + 1];
+            offset += 2;
             printf("%04d      |                     %s %d\n",
-                offset - 2, isLocal ? "local" : "upvalue", index);
+                offset - 3, isLocal ? "local" : "upvalue", index);
         }
 
         return offset;
@@ -465,6 +609,71 @@ int disassembleInstruction(Chunk* chunk, int offset, bool flow)
         return simpleInstruction("OP_IMPORT", offset);
     case OP_SLICE:
         return simpleInstruction("OP_SLICE", offset);
+    case OP_SWITCH_TABLE:
+        return switchInstruction("OP_SWITCH_TABLE", chunk, offset);
+    case OP_LESS_LOCAL:
+        return shortInstructionCompound("OP_LESS_LOCAL", chunk, offset, 2);
+    case OP_LESS_LOCAL_CONST: {
+        uint16_t slot     = (uint16_t)(chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+        uint16_t constant = (uint16_t)(chunk->code[offset + 3] << 8) | chunk->code[offset + 4];
+        printf("%-16s %4d %4d '", "OP_LESS_LOCAL_CONST", slot, constant);
+        printValue(chunk->constants.values[constant]);
+        printf("'\n");
+        return offset + 5;
+    }
+    case OP_INCREMENT_LOCAL:
+        return shortInstruction("OP_INCREMENT_LOCAL", chunk, offset);
+    case OP_FOR_STEP:
+        return forStepInstruction("OP_FOR_STEP", chunk, offset, false);
+    case OP_FOR_STEP_CONST:
+        return forStepInstruction("OP_FOR_STEP_CONST", chunk, offset, true);
+    case OP_INLINE:
+        return inlineInstruction("OP_INLINE", chunk, offset);
+    case OP_NATIVE_CONSTANT:
+        return nativeConstantInstruction("OP_NATIVE_CONSTANT", chunk, offset);
+    case OP_HOIST_SLOT:
+        return simpleInstruction("OP_HOIST_SLOT", offset);
+    case OP_GET_HOISTED:
+        return hoistedInstruction("OP_GET_HOISTED", chunk, offset);
+    case OP_CONSTANT_BYTE:
+        return constantByteInstruction("OP_CONSTANT_BYTE", chunk, offset);
+    case OP_GET_LOCAL_BYTE:
+        return byteInstruction("OP_GET_LOCAL_BYTE", chunk, offset);
+    case OP_SET_LOCAL_BYTE:
+        return byteInstruction("OP_SET_LOCAL_BYTE", chunk, offset);
+    case OP_GET_GLOBAL_BYTE:
+        return constantByteInstruction("OP_GET_GLOBAL_BYTE", chunk, offset);
+    case OP_SET_GLOBAL_BYTE:
+        return constantByteInstruction("OP_SET_GLOBAL_BYTE", chunk, offset);
+    case OP_GET_UPVALUE_BYTE:
+        return byteInstruction("OP_GET_UPVALUE_BYTE", chunk, offset);
+    case OP_SET_UPVALUE_BYTE:
+        return byteInstruction("OP_SET_UPVALUE_BYTE", chunk, offset);
+    case OP_CALL_BYTE:
+        return byteInstruction("OP_CALL_BYTE", chunk, offset);
+    case OP_PUSH_BYTE:
+        return byteInstruction("OP_PUSH_BYTE", chunk, offset);
+    case OP_LOAD_LOCAL_0:
+        return simpleInstruction("OP_LOAD_LOCAL_0", offset);
+    case OP_LOAD_LOCAL_1:
+        return simpleInstruction("OP_LOAD_LOCAL_1", offset);
+    case OP_LOAD_LOCAL_2:
+        return simpleInstruction("OP_LOAD_LOCAL_2", offset);
+    case OP_LOAD_LOCAL_3:
+        return simpleInstruction("OP_LOAD_LOCAL_3", offset);
+    case OP_LOAD_CONSTANT_0:
+        return implicitConstantInstruction("OP_LOAD_CONSTANT_0", chunk, offset, 0);
+    case OP_LOAD_CONSTANT_1:
+        return implicitConstantInstruction("OP_LOAD_CONSTANT_1", chunk, offset, 1);
+    case OP_LOAD_CONSTANT_2:
+        return implicitConstantInstruction("OP_LOAD_CONSTANT_2", chunk, offset, 2);
+    case OP_LOAD_CONSTANT_3:
+        return implicitConstantInstruction("OP_LOAD_CONSTANT_3", chunk, offset, 3);
+#define SUPERINSTRUCTION(first, second, operands) \
+    case OP_##first##__##second:                  \
+        return shortInstructionCompound("OP_" #first "__" #second, chunk, offset, operands);
+#include "superinstructions.def"
+#undef SUPERINSTRUCTION
     default:
         printf("Unknown opcode %d\n", instruction);
         return offset + 1;
@@ -478,6 +687,8 @@ int moveForward(Chunk* chunk, int offset)
     switch (instruction) {
     case OP_CONSTANT:
         return offset + 3;
+    case OP_CONSTANT_LONG:
+        return offset + 5;
     case OP_NIL:
         return offset + 1;
     case OP_TRUE:
@@ -526,8 +737,12 @@ int moveForward(Chunk* chunk, int offset)
         return offset + 1;
     case OP_POP:
         return offset + 1;
+    case OP_POP_N:
+        return offset + 2;
     case OP_DUP:
         return offset + 1;
+    case OP_PEEK:
+        return offset + 2;
     case OP_GET_LOCAL:
         return offset + 3;
     case OP_GET_LOCAL_2:
@@ -553,6 +768,7 @@ int moveForward(Chunk* chunk, int offset)
     case OP_GET_GLOBAL_4:
         return offset + 9;
     case OP_DEFINE_GLOBAL:
+    case OP_DEFINE_CONSTANT:
         return offset + 3;
     case OP_SET_GLOBAL:
         return offset + 3;
@@ -578,6 +794,12 @@ int moveForward(Chunk* chunk, int offset)
         return offset + 3;
     case OP_LOOP:
         return offset + 3;
+    case OP_JUMP_LONG:
+        return offset + 5;
+    case OP_JUMP_IF_FALSE_LONG:
+        return offset + 5;
+    case OP_LOOP_LONG:
+        return offset + 5;
     case OP_DUMP:
         return offset + 1;
     case OP_CALL:
@@ -594,11 +816,12 @@ int moveForward(Chunk* chunk, int offset)
         return offset + 5;
     case OP_CLOSURE: {
         offset++;
-        uint8_t      constant = chunk->code[offset++];
+        uint16_t     constant = (uint16_t)(chunk->code[offset] << 8) | chunk->code[offset + 1];
         ObjFunction* function = AS_FUNCTION(chunk->constants.values[constant]);
+        offset += 2;
         for (int j = 0; j < function->upvalueCount; j++) {
-            offset++; // isLocal
-            offset++; // index
+            offset++;    // isLocal
+            offset += 2; // index
         }
         return offset;
     }
@@ -618,6 +841,52 @@ int moveForward(Chunk* chunk, int offset)
         return offset + 1;
     case OP_SLICE:
         return offset + 1;
+    case OP_SWITCH_TABLE: {
+        uint16_t count = (uint16_t)(chunk->code[offset + 3] << 8) | chunk->code[offset + 4];
+        return offset + 7 + count * 2;
+    }
+    case OP_LESS_LOCAL:
+        return offset + 5;
+    case OP_LESS_LOCAL_CONST:
+        return offset + 5;
+    case OP_INCREMENT_LOCAL:
+        return offset + 3;
+    case OP_FOR_STEP:
+        return offset + 7;
+    case OP_FOR_STEP_CONST:
+        return offset + 7;
+    case OP_INLINE:
+        return offset + 7;
+    case OP_NATIVE_CONSTANT:
+        return offset + 7;
+    case OP_HOIST_SLOT:
+        return offset + 1;
+    case OP_GET_HOISTED:
+        return offset + 5;
+    case OP_CONSTANT_BYTE:
+    case OP_GET_LOCAL_BYTE:
+    case OP_SET_LOCAL_BYTE:
+    case OP_GET_GLOBAL_BYTE:
+    case OP_SET_GLOBAL_BYTE:
+    case OP_GET_UPVALUE_BYTE:
+    case OP_SET_UPVALUE_BYTE:
+    case OP_CALL_BYTE:
+    case OP_PUSH_BYTE:
+        return offset + 2;
+    case OP_LOAD_LOCAL_0:
+    case OP_LOAD_LOCAL_1:
+    case OP_LOAD_LOCAL_2:
+    case OP_LOAD_LOCAL_3:
+    case OP_LOAD_CONSTANT_0:
+    case OP_LOAD_CONSTANT_1:
+    case OP_LOAD_CONSTANT_2:
+    case OP_LOAD_CONSTANT_3:
+        return offset + 1;
+#define SUPERINSTRUCTION(first, second, operands) \
+    case OP_##first##__##second:                  \
+        return offset + 1 + operands * 2;
+#include "superinstructions.def"
+#undef SUPERINSTRUCTION
     default:
         return offset + 1;
     }
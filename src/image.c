@@ -0,0 +1,836 @@
+#include "image.h"
+
+#include "cache.h"
+#include "debug.h"
+#include "memory.h"
+#include "native/native.h"
+#include "optimizer.h"
+#include "vm.h"
+#include <sys/mman.h>
+
+// A heap image is the state of the VM at a system.checkpoint() call: every
+// live object, the value stack, the call frames, the open upvalues, the
+// globals and the module caches. Objects are numbered in the order they are written and refer to
+// each other by number. Loading creates every object first and then fills
+// in their references, which relocates every pointer, and resumes the
+// script as if the checkpoint call had just returned true.
+
+typedef enum {
+    IMAGE_NIL,
+    IMAGE_FALSE,
+    IMAGE_TRUE,
+    IMAGE_NUMBER,
+    IMAGE_OBJECT,
+    IMAGE_EMPTY,
+    IMAGE_STDIN,
+    IMAGE_STDOUT,
+    IMAGE_STDERR,
+} ImageValue;
+
+// Objects are written in this order, so each is created after the
+// objects its constructor needs.
+static const ObjType creationOrder[] = {
+    OBJ_STRING,
+    OBJ_NATIVE,
+    OBJ_FUNCTION,
+    OBJ_UPVALUE,
+    OBJ_TABLE,
+    OBJ_ARRAY,
+    OBJ_CLASS,
+    OBJ_CLOSURE,
+    OBJ_INSTANCE,
+    OBJ_BOUND_METHOD,
+};
+
+typedef struct {
+    Obj*     object;
+    uint32_t id;
+} ObjectId;
+
+typedef struct {
+    Buffer      buffer;
+    Obj**       objects; // in id order
+    ObjectId*   ids;     // sorted by address
+    uint32_t    count;
+    const char* error;
+} ImageWriter;
+
+static int compareIds(const void* a, const void* b)
+{
+    Obj* left  = ((const ObjectId*)a)->object;
+    Obj* right = ((const ObjectId*)b)->object;
+    return (left > right) - (left < right);
+}
+
+static void addObjects(ImageWriter* writer, Obj* list, ObjType type)
+{
+    for (Obj* object = list; object != NULL; object = object->next) {
+        if (object->type != type)
+            continue;
+        writer->objects[writer->count] = object;
+        writer->ids[writer->count]     = (ObjectId) { object, writer->count };
+        writer->count++;
+    }
+}
+
+// Numbers every object, straight after a collection so only live ones
+// are written.
+static void collectObjects(ImageWriter* writer)
+{
+    collectGarbage();
+
+    size_t total = 0;
+    for (Obj* object = vm.objects; object != NULL; object = object->next)
+        total++;
+    for (Obj* object = vm.immortals; object != NULL; object = object->next)
+        total++;
+
+    writer->objects = malloc(sizeof(Obj*) * (total + 1));
+    writer->ids     = malloc(sizeof(ObjectId) * (total + 1));
+    writer->count   = 0;
+    for (size_t i = 0; i < sizeof(creationOrder) / sizeof(ObjType); i++) {
+        addObjects(writer, vm.objects, creationOrder[i]);
+        addObjects(writer, vm.immortals, creationOrder[i]);
+    }
+
+    qsort(writer->ids, writer->count, sizeof(ObjectId), compareIds);
+}
+
+static bool findId(ImageWriter* writer, Obj* object, uint32_t* id)
+{
+    ObjectId  key   = { object, 0 };
+    ObjectId* found = bsearch(&key, writer->ids, writer->count, sizeof(ObjectId), compareIds);
+    if (found == NULL)
+        return false;
+    *id = found->id;
+    return true;
+}
+
+static void writeString(Buffer* buffer, const char* chars)
+{
+    uint32_t length = (uint32_t)strlen(chars);
+    writeU32(buffer, length);
+    writeBytes(buffer, chars, length);
+}
+
+static void writeImageValue(ImageWriter* writer, Value value)
+{
+    Buffer*  buffer = &writer->buffer;
+    uint32_t id;
+
+    if (IS_NIL(value)) {
+        writeU8(buffer, IMAGE_NIL);
+    } else if (IS_BOOL(value)) {
+        writeU8(buffer, AS_BOOL(value) ? IMAGE_TRUE : IMAGE_FALSE);
+    } else if (IS_EMPTY(value)) {
+        writeU8(buffer, IMAGE_EMPTY);
+    } else if (IS_NUMBER(value)) {
+        double number = AS_NUMBER(value);
+        writeU8(buffer, IMAGE_NUMBER);
+        writeBytes(buffer, &number, sizeof(number));
+    } else if (IS_OBJ(value) && findId(writer, AS_OBJ(value), &id)) {
+        writeU8(buffer, IMAGE_OBJECT);
+        writeU32(buffer, id);
+    } else if (IS_POINTER(value) && AS_POINTER(value) == (void*)stdin) {
+        writeU8(buffer, IMAGE_STDIN);
+    } else if (IS_POINTER(value) && AS_POINTER(value) == (void*)stdout) {
+        writeU8(buffer, IMAGE_STDOUT);
+    } else if (IS_POINTER(value) && AS_POINTER(value) == (void*)stderr) {
+        writeU8(buffer, IMAGE_STDERR);
+    } else {
+        writer->error = "Can't checkpoint open files or other native handles.";
+        writeU8(buffer, IMAGE_NIL);
+    }
+}
+
+static void writeTable(ImageWriter* writer, Table* table)
+{
+    uint32_t count = 0;
+    for (unsigned int i = 0; i < table->capacity; i++) {
+        if (!IS_EMPTY(table->entries[i].key))
+            count++;
+    }
+
+    writeU32(&writer->buffer, count);
+    for (unsigned int i = 0; i < table->capacity; i++) {
+        Entry* entry = &table->entries[i];
+        if (IS_EMPTY(entry->key))
+            continue;
+        writeImageValue(writer, entry->key);
+        writeImageValue(writer, entry->value);
+    }
+}
+
+static bool nativeName(NativeFn function, const char** module, const char** name)
+{
+    for (NativeFnEntry* entry = globalFns; entry->name != NULL; entry++) {
+        if (entry->function == function) {
+            *module = "";
+            *name   = entry->name;
+            return true;
+        }
+    }
+
+    for (NativeModuleEntry* entry = nativeModules; entry->name != NULL; entry++) {
+        for (NativeFnEntry* fn = entry->fns; fn->name != NULL; fn++) {
+            if (fn->function == function) {
+                *module = entry->name;
+                *name   = fn->name;
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+// What is needed to create an object, references to objects that may not
+// exist yet wait for writeContents().
+static void writeCreation(ImageWriter* writer, Obj* object, const char** source)
+{
+    Buffer*  buffer = &writer->buffer;
+    uint32_t id     = 0;
+    writeU8(buffer, (uint8_t)object->type);
+
+    switch (object->type) {
+    case OBJ_STRING: {
+        ObjString* string = (ObjString*)object;
+        writeU32(buffer, (uint32_t)string->length);
+        writeBytes(buffer, string->chars, string->length);
+        break;
+    }
+    case OBJ_NATIVE: {
+        const char* module;
+        const char* name;
+        if (!nativeName(((ObjNative*)object)->function, &module, &name)) {
+            writer->error = "Can't checkpoint native functions from outside the standard library.";
+            module = name = "";
+        }
+        writeString(buffer, module);
+        writeString(buffer, name);
+        break;
+    }
+    case OBJ_FUNCTION: {
+        ObjFunction* function  = (ObjFunction*)object;
+        Chunk*       chunk     = &function->chunk;
+        int32_t      fields[5] = { function->arity, function->upvalueCount, function->line, function->lazyLine, function->lazyType };
+        writeBytes(buffer, fields, sizeof(fields));
+
+        // functions from one file are written together, so a path is
+        // only stored when it changes
+        if (function->source == NULL) {
+            writeU8(buffer, 0);
+        } else if (*source != NULL && strcmp(*source, function->source) == 0) {
+            writeU8(buffer, 1);
+        } else {
+            writeU8(buffer, 2);
+            writeString(buffer, function->source);
+            *source = function->source;
+        }
+
+        writeU32(buffer, (uint32_t)chunk->lineCount);
+        writeBytes(buffer, chunk->lines, sizeof(LineStart) * chunk->lineCount);
+        writeU32(buffer, (uint32_t)chunk->count);
+        writeBytes(buffer, chunk->code, chunk->count);
+
+        writeU8(buffer, function->lazyBody != NULL);
+        if (function->lazyBody != NULL)
+            writeString(buffer, function->lazyBody);
+        break;
+    }
+    case OBJ_CLOSURE:
+        findId(writer, (Obj*)((ObjClosure*)object)->function, &id);
+        writeU32(buffer, id);
+        break;
+    case OBJ_INSTANCE:
+        findId(writer, (Obj*)((ObjInstance*)object)->klass, &id);
+        writeU32(buffer, id);
+        break;
+    default:
+        break;
+    }
+}
+
+static void writeObjectValue(ImageWriter* writer, Obj* object)
+{
+    writeImageValue(writer, object != NULL ? OBJ_VAL(object) : NIL_VAL);
+}
+
+static void writeContents(ImageWriter* writer, Obj* object)
+{
+    Buffer* buffer = &writer->buffer;
+
+    switch (object->type) {
+    case OBJ_FUNCTION: {
+        ObjFunction* function = (ObjFunction*)object;
+        writeObjectValue(writer, (Obj*)function->name);
+        writeU32(buffer, function->chunk.constants.count);
+        for (unsigned int i = 0; i < function->chunk.constants.count; i++)
+            writeImageValue(writer, function->chunk.constants.values[i]);
+        break;
+    }
+    case OBJ_UPVALUE: {
+        ObjUpvalue* upvalue = (ObjUpvalue*)object;
+        bool        open    = upvalue->location != &upvalue->closed;
+        writeU8(buffer, open);
+        if (open)
+            writeU32(buffer, (uint32_t)(upvalue->location - vm.stack));
+        else
+            writeImageValue(writer, upvalue->closed);
+        break;
+    }
+    case OBJ_TABLE:
+        writeU32(buffer, (uint32_t)((ObjTable*)object)->module);
+        writeTable(writer, &((ObjTable*)object)->table);
+        break;
+    case OBJ_ARRAY: {
+        ValueArray* array = &((ObjArray*)object)->array;
+        writeU32(buffer, array->count);
+        for (unsigned int i = 0; i < array->count; i++)
+            writeImageValue(writer, array->values[i]);
+        break;
+    }
+    case OBJ_CLASS: {
+        ObjClass* klass = (ObjClass*)object;
+        writeObjectValue(writer, (Obj*)klass->name);
+        writeTable(writer, &klass->methods);
+        writeTable(writer, &klass->fields);
+        break;
+    }
+    case OBJ_CLOSURE: {
+        ObjClosure* closure = (ObjClosure*)object;
+        writeU32(buffer, (uint32_t)closure->upvalueCount);
+        for (int i = 0; i < closure->upvalueCount; i++)
+            writeObjectValue(writer, (Obj*)closure->upvalues[i]);
+        break;
+    }
+    case OBJ_INSTANCE:
+        writeTable(writer, &((ObjInstance*)object)->fields);
+        break;
+    case OBJ_BOUND_METHOD: {
+        ObjBoundMethod* bound = (ObjBoundMethod*)object;
+        writeImageValue(writer, bound->receiver);
+        writeObjectValue(writer, (Obj*)bound->method);
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+// Whether the instruction that ends at `ip` drops the result of its call.
+static bool discardsResult(Chunk* chunk, uint8_t* ip)
+{
+    int target = (int)(ip - chunk->code);
+    int offset = 0;
+    while (offset < target) {
+        int next = moveForward(chunk, offset);
+        if (next == target) {
+            switch (chunk->code[offset]) {
+            case OP_CALL_BLIND:
+                return true;
+#define SUPERINSTRUCTION(first, second, operands) \
+    case OP_##first##__##second:                  \
+        return OP_##second == OP_CALL_BLIND;
+#include "superinstructions.def"
+#undef SUPERINSTRUCTION
+            default:
+                return false;
+            }
+        }
+        offset = next;
+    }
+
+    return false;
+}
+
+static void writeState(ImageWriter* writer, Value* result)
+{
+    Buffer*    buffer = &writer->buffer;
+    CallFrame* caller = &vm.frames[vm.frameCount - 1];
+    uint32_t   count  = (uint32_t)(result - vm.stack);
+    bool       blind  = discardsResult(&caller->closure->function->chunk, caller->ip);
+
+    writeU32(buffer, blind ? count : count + 1);
+    for (uint32_t i = 0; i < count; i++)
+        writeImageValue(writer, vm.stack[i]);
+    if (!blind)
+        writeImageValue(writer, BOOL_VAL(true));
+
+    writeU32(buffer, (uint32_t)vm.frameCount);
+    for (int i = 0; i < vm.frameCount; i++) {
+        CallFrame* frame = &vm.frames[i];
+        uint32_t   id    = 0;
+        findId(writer, (Obj*)frame->closure, &id);
+        writeU32(buffer, id);
+        writeU32(buffer, (uint32_t)(frame->ip - frame->closure->function->chunk.code));
+        writeU32(buffer, (uint32_t)(frame->slots - vm.stack));
+    }
+
+    uint32_t upvalues = 0;
+    for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL; upvalue = upvalue->next)
+        upvalues++;
+    writeU32(buffer, upvalues);
+    for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL; upvalue = upvalue->next)
+        writeObjectValue(writer, (Obj*)upvalue);
+
+    writeTable(writer, &vm.globals);
+    writeTable(writer, &vm.bundle);
+    writeTable(writer, &vm.imports);
+    writeTable(writer, &vm.modules);
+    writeTable(writer, &vm.constGlobals);
+}
+
+// Called from the native system.checkpoint(), `result` is the slot its
+// return value goes in. Returns an error message, or NULL once written.
+const char* writeImage(const char* path, Value* result)
+{
+    ImageWriter writer = { { NULL, 0, 0, { 0, 0, NULL } }, NULL, NULL, 0, NULL };
+    const char* source = NULL;
+    collectObjects(&writer);
+
+    CacheHeader header;
+    initHeader(&header, IMAGE_MAGIC);
+    writeBytes(&writer.buffer, &header, sizeof(CacheHeader));
+
+    writeU32(&writer.buffer, writer.count);
+    for (uint32_t i = 0; i < writer.count; i++)
+        writeCreation(&writer, writer.objects[i], &source);
+    for (uint32_t i = 0; i < writer.count; i++)
+        writeContents(&writer, writer.objects[i]);
+    writeState(&writer, result);
+
+    if (writer.error == NULL && !writeFile(path, &writer.buffer))
+        writer.error = "Could not write the image.";
+
+    free(writer.buffer.bytes);
+    free(writer.objects);
+    free(writer.ids);
+    return writer.error;
+}
+
+typedef struct {
+    Reader    reader;
+    ObjArray* objects; // every loaded object in id order, keeps them reachable
+    char*     source;
+    Value*    stack;
+} ImageReader;
+
+static bool readString(ImageReader* image, const char** chars, uint32_t* length)
+{
+    Reader* reader = &image->reader;
+    if (!readU32(reader, length) || (size_t)(reader->end - reader->current) < *length)
+        return false;
+    *chars = (const char*)reader->current;
+    reader->current += *length;
+    return true;
+}
+
+static bool readImageValue(ImageReader* image, Value* value)
+{
+    uint8_t type;
+    if (!readBytes(&image->reader, &type, 1))
+        return false;
+
+    switch (type) {
+    case IMAGE_NIL:
+        *value = NIL_VAL;
+        return true;
+    case IMAGE_FALSE:
+        *value = BOOL_VAL(false);
+        return true;
+    case IMAGE_TRUE:
+        *value = BOOL_VAL(true);
+        return true;
+    case IMAGE_EMPTY:
+        *value = EMPTY_VAL;
+        return true;
+    case IMAGE_NUMBER: {
+        double number;
+        if (!readBytes(&image->reader, &number, sizeof(number)))
+            return false;
+        *value = NUMBER_VAL(number);
+        return true;
+    }
+    case IMAGE_OBJECT: {
+        uint32_t id;
+        if (!readU32(&image->reader, &id) || id >= image->objects->array.count)
+            return false;
+        *value = image->objects->array.values[id];
+        return true;
+    }
+    case IMAGE_STDIN:
+        *value = POINTER_VAL((uintptr_t)stdin);
+        return true;
+    case IMAGE_STDOUT:
+        *value = POINTER_VAL((uintptr_t)stdout);
+        return true;
+    case IMAGE_STDERR:
+        *value = POINTER_VAL((uintptr_t)stderr);
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool readObject(ImageReader* image, ObjType type, Obj** object)
+{
+    Value value;
+    if (!readImageValue(image, &value))
+        return false;
+    if (IS_NIL(value)) {
+        *object = NULL;
+        return true;
+    }
+    if (!isObjType(value, type))
+        return false;
+    *object = AS_OBJ(value);
+    return true;
+}
+
+static bool readObjectId(ImageReader* image, ObjType type, Obj** object)
+{
+    uint32_t id;
+    if (!readU32(&image->reader, &id) || id >= image->objects->array.count
+        || !isObjType(image->objects->array.values[id], type))
+        return false;
+    *object = AS_OBJ(image->objects->array.values[id]);
+    return true;
+}
+
+static bool readTable(ImageReader* image, Table* table)
+{
+    uint32_t count;
+    if (!readU32(&image->reader, &count))
+        return false;
+
+    for (uint32_t i = 0; i < count; i++) {
+        Value key;
+        Value value;
+        if (!readImageValue(image, &key) || !readImageValue(image, &value) || IS_EMPTY(key))
+            return false;
+        tableSet(table, key, value);
+    }
+
+    return true;
+}
+
+static NativeFn findNativeFn(const char* module, uint32_t moduleLength, const char* name, uint32_t nameLength)
+{
+    NativeFnEntry* fns = globalFns;
+    if (moduleLength > 0) {
+        fns = NULL;
+        for (NativeModuleEntry* entry = nativeModules; entry->name != NULL; entry++) {
+            if (strlen(entry->name) == moduleLength && memcmp(entry->name, module, moduleLength) == 0)
+                fns = entry->fns;
+        }
+        if (fns == NULL)
+            return NULL;
+    }
+
+    for (NativeFnEntry* entry = fns; entry->name != NULL; entry++) {
+        if (strlen(entry->name) == nameLength && memcmp(entry->name, name, nameLength) == 0)
+            return entry->function;
+    }
+
+    return NULL;
+}
+
+static bool readFunction(ImageReader* image, ObjFunction* function)
+{
+    Reader*  reader = &image->reader;
+    Chunk*   chunk  = &function->chunk;
+    int32_t  fields[5];
+    uint8_t  source;
+    uint32_t count;
+
+    if (!readBytes(reader, fields, sizeof(fields)) || !readBytes(reader, &source, 1))
+        return false;
+    function->arity        = fields[0];
+    function->upvalueCount = fields[1];
+    function->line         = fields[2];
+    function->lazyLine     = fields[3];
+    function->lazyType     = fields[4];
+
+    if (source == 2) {
+        const char* chars;
+        uint32_t    length;
+        if (!readString(image, &chars, &length))
+            return false;
+        image->source = malloc(length + 1);
+        memcpy(image->source, chars, length);
+        image->source[length] = '\0';
+    } else if (source == 0) {
+        function->source = NULL;
+    }
+    if (source != 0)
+        function->source = image->source;
+
+    if (!readU32(reader, &count) || count > (size_t)(reader->end - reader->current) / sizeof(LineStart))
+        return false;
+    chunk->lines        = ALLOCATE(LineStart, count);
+    chunk->lineCapacity = (int)count;
+    chunk->lineCount    = (int)count;
+    if (!readBytes(reader, chunk->lines, sizeof(LineStart) * count))
+        return false;
+
+    // the code stays in the mapping, copy-on-write like the bytecode cache
+    if (!readU32(reader, &count) || count > (size_t)(reader->end - reader->current))
+        return false;
+    chunk->code     = reader->current;
+    chunk->count    = (int)count;
+    chunk->isMapped = true;
+    reader->current += count;
+
+    uint8_t lazy;
+    if (!readBytes(reader, &lazy, 1))
+        return false;
+    if (lazy) {
+        const char* chars;
+        uint32_t    length;
+        if (!readString(image, &chars, &length))
+            return false;
+        function->lazyBody = malloc(length + 1);
+        memcpy(function->lazyBody, chars, length);
+        function->lazyBody[length] = '\0';
+    }
+    return true;
+}
+
+static bool createObject(ImageReader* image)
+{
+    uint8_t type;
+    Obj*    object = NULL;
+    Obj*    other  = NULL;
+    if (!readBytes(&image->reader, &type, 1))
+        return false;
+
+    switch (type) {
+    case OBJ_STRING: {
+        const char* chars;
+        uint32_t    length;
+        if (!readString(image, &chars, &length))
+            return false;
+        object = (Obj*)copyString(chars, (int)length);
+        break;
+    }
+    case OBJ_NATIVE: {
+        const char* module;
+        const char* name;
+        uint32_t    moduleLength;
+        uint32_t    nameLength;
+        if (!readString(image, &module, &moduleLength) || !readString(image, &name, &nameLength))
+            return false;
+        NativeFn function = findNativeFn(module, moduleLength, name, nameLength);
+        if (function == NULL)
+            return false;
+        object = (Obj*)newNative(function);
+        break;
+    }
+    case OBJ_FUNCTION:
+        object = (Obj*)newFunction();
+        break;
+    case OBJ_UPVALUE:
+        object = (Obj*)newUpvalue(NULL);
+        break;
+    case OBJ_TABLE:
+        object = (Obj*)newTable();
+        break;
+    case OBJ_ARRAY:
+        object = (Obj*)newArray();
+        break;
+    case OBJ_CLASS:
+        object = (Obj*)newClass(NULL);
+        break;
+    case OBJ_CLOSURE:
+        if (!readObjectId(image, OBJ_FUNCTION, &other))
+            return false;
+        object = (Obj*)newClosure((ObjFunction*)other);
+        break;
+    case OBJ_INSTANCE:
+        if (!readObjectId(image, OBJ_CLASS, &other))
+            return false;
+        object = (Obj*)newInstance((ObjClass*)other);
+        break;
+    case OBJ_BOUND_METHOD:
+        object = (Obj*)newBoundMethod(NIL_VAL, NULL);
+        break;
+    default:
+        return false;
+    }
+
+    push(OBJ_VAL(object));
+    writeValueArray(&image->objects->array, OBJ_VAL(object));
+    pop();
+
+    return object->type != OBJ_FUNCTION || readFunction(image, (ObjFunction*)object);
+}
+
+static bool fillObject(ImageReader* image, Obj* object)
+{
+    Obj*     other;
+    uint32_t count;
+    Value    value;
+
+    switch (object->type) {
+    case OBJ_FUNCTION: {
+        ObjFunction* function = (ObjFunction*)object;
+        if (!readObject(image, OBJ_STRING, &other) || !readU32(&image->reader, &count))
+            return false;
+        function->name = (ObjString*)other;
+        for (uint32_t i = 0; i < count; i++) {
+            if (!readImageValue(image, &value))
+                return false;
+            writeValueArray(&function->chunk.constants, value);
+        }
+        classifyAccessor(function);
+        return true;
+    }
+    case OBJ_UPVALUE: {
+        ObjUpvalue* upvalue = (ObjUpvalue*)object;
+        uint8_t     open;
+        if (!readBytes(&image->reader, &open, 1))
+            return false;
+        if (!open) {
+            upvalue->location = &upvalue->closed;
+            return readImageValue(image, &upvalue->closed);
+        }
+        if (!readU32(&image->reader, &count) || count >= STACK_MAX)
+            return false;
+        upvalue->location = vm.stack + count;
+        return true;
+    }
+    case OBJ_TABLE:
+        if (!readU32(&image->reader, &count))
+            return false;
+        ((ObjTable*)object)->module = (int)count;
+        return readTable(image, &((ObjTable*)object)->table);
+    case OBJ_ARRAY:
+        if (!readU32(&image->reader, &count))
+            return false;
+        for (uint32_t i = 0; i < count; i++) {
+            if (!readImageValue(image, &value))
+                return false;
+            writeValueArray(&((ObjArray*)object)->array, value);
+        }
+        return true;
+    case OBJ_CLASS: {
+        ObjClass* klass = (ObjClass*)object;
+        if (!readObject(image, OBJ_STRING, &other))
+            return false;
+        klass->name = (ObjString*)other;
+        return readTable(image, &klass->methods) && readTable(image, &klass->fields);
+    }
+    case OBJ_CLOSURE: {
+        ObjClosure* closure = (ObjClosure*)object;
+        if (!readU32(&image->reader, &count) || count != (uint32_t)closure->upvalueCount)
+            return false;
+        for (uint32_t i = 0; i < count; i++) {
+            if (!readObject(image, OBJ_UPVALUE, &other))
+                return false;
+            closure->upvalues[i] = (ObjUpvalue*)other;
+        }
+        return true;
+    }
+    case OBJ_INSTANCE:
+        return readTable(image, &((ObjInstance*)object)->fields);
+    case OBJ_BOUND_METHOD: {
+        ObjBoundMethod* bound = (ObjBoundMethod*)object;
+        if (!readImageValue(image, &bound->receiver) || !readObject(image, OBJ_CLOSURE, &other))
+            return false;
+        bound->method = (ObjClosure*)other;
+        return true;
+    }
+    default:
+        return true;
+    }
+}
+
+static bool readState(ImageReader* image)
+{
+    Reader*  reader = &image->reader;
+    uint32_t stackCount;
+    uint32_t frameCount;
+    uint32_t count;
+
+    // the stack still holds the loaded objects, it is replaced at the end
+    if (!readU32(reader, &stackCount) || stackCount > STACK_MAX)
+        return false;
+    Value* stack = image->stack = malloc(sizeof(Value) * (stackCount + 1));
+    for (uint32_t i = 0; i < stackCount; i++) {
+        if (!readImageValue(image, &stack[i]))
+            return false;
+    }
+
+    if (!readU32(reader, &frameCount) || frameCount == 0 || frameCount > FRAMES_MAX)
+        return false;
+    for (uint32_t i = 0; i < frameCount; i++) {
+        Obj*     closure;
+        uint32_t ip;
+        uint32_t slots;
+        if (!readObjectId(image, OBJ_CLOSURE, &closure) || !readU32(reader, &ip) || !readU32(reader, &slots))
+            return false;
+
+        Chunk* chunk = &((ObjClosure*)closure)->function->chunk;
+        if (ip > (uint32_t)chunk->count || slots > stackCount)
+            return false;
+        vm.frames[i].closure = (ObjClosure*)closure;
+        vm.frames[i].ip      = chunk->code + ip;
+        vm.frames[i].slots   = vm.stack + slots;
+    }
+
+    ObjUpvalue** link = &vm.openUpvalues;
+    if (!readU32(reader, &count))
+        return false;
+    for (uint32_t i = 0; i < count; i++) {
+        Obj* upvalue;
+        if (!readObject(image, OBJ_UPVALUE, &upvalue) || upvalue == NULL)
+            return false;
+        *link = (ObjUpvalue*)upvalue;
+        link  = &(*link)->next;
+    }
+    *link = NULL;
+
+    freeTable(&vm.globals);
+    freeTable(&vm.bundle);
+    if (!readTable(image, &vm.globals) || !readTable(image, &vm.bundle) || !readTable(image, &vm.imports)
+        || !readTable(image, &vm.modules) || !readTable(image, &vm.constGlobals))
+        return false;
+
+    // the loaded objects are reachable from the restored state from here on
+    vm.stackTop = vm.stack;
+    memcpy(vm.stack, stack, sizeof(Value) * stackCount);
+    vm.stackTop   = vm.stack + stackCount;
+    vm.frameCount = (int)frameCount;
+    return true;
+}
+
+bool loadImage(const char* path)
+{
+    CacheHeader header;
+    initHeader(&header, IMAGE_MAGIC);
+
+    size_t   size;
+    uint8_t* map = mapFile(path, &header, &size);
+    if (map == NULL)
+        return false;
+
+    ImageReader image = { { map + sizeof(CacheHeader), map + size, NULL, { 0, 0, NULL } }, newArray(), NULL, NULL };
+    uint32_t    count;
+    push(OBJ_VAL(image.objects));
+
+    bool valid = readU32(&image.reader, &count);
+    for (uint32_t i = 0; valid && i < count; i++)
+        valid = createObject(&image);
+    for (uint32_t i = 0; valid && i < count; i++)
+        valid = fillObject(&image, AS_OBJ(image.objects->array.values[i]));
+    valid = valid && readState(&image);
+    free(image.stack);
+
+    if (!valid) {
+        pop();
+        vm.openUpvalues = NULL;
+        munmap(map, size);
+    }
+    return valid;
+}
@@ -0,0 +1,64 @@
+#ifndef phelt_cache_h
+#define phelt_cache_h
+
+#include "common.h"
+#include "object.h"
+
+#define CACHE_FORMAT 7
+
+#define CACHE_MAGIC 0x54484c50 // "PLHT"
+#define BUNDLE_MAGIC 0x42484c50 // "PLHB"
+#define IMAGE_MAGIC 0x49484c50 // "PLHI"
+
+// Leads every cache file, bundle and heap image. Files written by a build
+// with a different opcode table never match.
+typedef struct {
+    uint32_t magic;
+    uint32_t format;
+    uint32_t opcodeCount;
+    uint32_t padding;
+    uint64_t opcodeHash;
+    uint64_t sourceHash;
+    uint64_t sourceLength;
+} CacheHeader;
+
+// `functions` lists the functions written or read so far, in order. A
+// function that appears in more than one constant pool, an inlined one,
+// is written once and referred to by its index after that.
+typedef struct {
+    uint8_t*   bytes;
+    size_t     count;
+    size_t     capacity;
+    ValueArray functions;
+} Buffer;
+
+typedef struct {
+    uint8_t*    current;
+    uint8_t*    end;
+    const char* sourcePath;
+    ValueArray  functions;
+} Reader;
+
+void     initHeader(CacheHeader* header, uint32_t magic);
+void     writeBytes(Buffer* buffer, const void* bytes, size_t length);
+void     writeU8(Buffer* buffer, uint8_t value);
+void     writeU32(Buffer* buffer, uint32_t value);
+bool     writeFile(const char* path, Buffer* buffer);
+bool     readBytes(Reader* reader, void* bytes, size_t length);
+bool     readU32(Reader* reader, uint32_t* value);
+uint8_t* mapFile(const char* path, CacheHeader* header, size_t* size);
+uint32_t fileMagic(const char* path);
+
+// Called for every import of a string literal in `function` and the
+// functions nested in it, with the function that does the import.
+typedef void (*ImportFn)(const char* name, ObjFunction* importer, void* context);
+
+void findImports(ObjFunction* function, ImportFn found, void* context);
+
+ObjFunction* compileCached(const char* sourcePath, utf8_int8_t* source);
+
+bool         writeBundle(const char* entryPath, const char* outputPath);
+ObjFunction* loadBundle(const char* path);
+ObjFunction* findBundled(const char* path, const char* currentFile);
+
+#endif
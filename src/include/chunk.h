@@ -8,19 +8,38 @@ typedef enum {
 #define OPCODE(op) OP_##op,
 #include "opcodes.h"
 #undef OPCODE
+    OPCODE_COUNT
 } OpCode;
 
+// One entry per run of bytes that share a source line, in code order.
+// Bytes the optimizer inlined from another function keep that function's
+// lines, and follow the OP_INLINE that stands for the call. The table is
+// written to caches and images as is, so it has no padding.
+typedef struct
+{
+    int offset;
+    int line;
+    int inlined;
+} LineStart;
+
 typedef struct
 {
     int        count;
     int        capacity;
     uint8_t*   code;
-    ValueArray lines;
+    int        lineCount;
+    int        lineCapacity;
+    LineStart* lines;
     ValueArray constants;
+    bool       isMapped;
 } Chunk;
 
 void initChunk(Chunk* chunk);
 void writeChunk(Chunk* chunk, uint8_t byte, int line);
+void writeInlinedChunk(Chunk* chunk, uint8_t byte, int line, bool inlined);
+int  getLine(Chunk* chunk, int offset);
+bool isInlinedCode(Chunk* chunk, int offset);
+int  getInlineSite(Chunk* chunk, int offset);
 void remiteBytes(Chunk* chunk, int index, int amount);
 int  addConstant(Chunk* chunk, Value value);
 void freeChunk(Chunk* chunk);
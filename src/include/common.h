@@ -5,12 +5,15 @@
 // #define DEBUG_TRACE_EXECUTION
 // #define DEBUG_STRESS_GC
 // #define DEBUG_LOG_GC
+// #define OPCODE_PROFILING
 
 #define NAN_BOXING
 #define UINT8_COUNT (UINT8_MAX + 1)
 #define UINT16_COUNT (UINT16_MAX + 1)
 #define COMPUTED_GOTO
+#ifndef NO_CHUNK_OPTIMIZATION
 #define CHUNK_OPTIMIZATION
+#endif
 
 #define TEMPLATE_BUFFER 1024
 
@@ -28,6 +31,7 @@ bool         fileExists(const char* path);
 const char*  resolvePath(const char* path);
 const char*  getFilePath(const char* path);
 const char*  resolveRelativePath(const char* path, const char* currentFile);
+char*        resolveBundlePath(const char* path, const char* currentFile);
 
 #define UNUSED(x) (void)(x)
 
@@ -7,8 +7,16 @@
 #include "utf8.h"
 
 #define MAX_CASES 256
+#define SWITCH_TABLE_MIN_CASES 4
+#define RESERVED_CONSTANTS 16384
+
+extern bool lazyCompilation;
+
+// Compile errors are not printed on this thread, only reported as failure.
+extern _Thread_local bool silentErrors;
 
 ObjFunction* compile(const char* sourcePath, utf8_int8_t* source);
+bool         compileLazy(ObjFunction* function);
 void         markCompilerRoots(void);
 
 #endif
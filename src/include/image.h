@@ -0,0 +1,10 @@
+#ifndef phelt_image_h
+#define phelt_image_h
+
+#include "common.h"
+#include "value.h"
+
+const char* writeImage(const char* path, Value* result);
+bool        loadImage(const char* path);
+
+#endif
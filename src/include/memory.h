@@ -19,10 +19,18 @@
 #define FREE_ARRAY(type, pointer, oldCount) \
     reallocate(pointer, sizeof(type) * (oldCount), 0)
 
-void* reallocate(void* pointer, size_t oldSize, size_t newSize);
-void  markObject(Obj* object);
-void  markValue(Value value);
-void  collectGarbage(void);
-void  freeObjects(void);
+typedef void (*HeapEdgeFn)(Obj* from, Obj* to, void* context);
+
+void*  reallocate(void* pointer, size_t oldSize, size_t newSize);
+void   markObject(Obj* object);
+void   markValue(Value value);
+void   collectGarbage(void);
+void   freeObjects(void);
+size_t objectSize(Obj* object);
+void   walkHeap(HeapEdgeFn visit, void* context);
+void   freezeHeap(void);
+void   shareHeap(bool shared);
+void   lockHeap(void);
+void   unlockHeap(void);
 
 #endif
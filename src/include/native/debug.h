@@ -4,5 +4,7 @@
 #include "native.h"
 
 bool debug_frame(int argCount, Value* args);
+bool debug_heapCensus(int argCount, Value* args);
+bool debug_heapSnapshot(int argCount, Value* args);
 
 #endif
@@ -16,9 +16,12 @@
 #include "native/system.h"
 #include "native/table.h"
 
+// A pure function returns the same result for the same arguments and
+// changes nothing, so the compiler may call it on constant arguments.
 typedef struct {
     const char* name;
     NativeFn    function;
+    bool        pure;
 } NativeFnEntry;
 
 typedef struct {
@@ -38,6 +41,8 @@ extern NativeModuleCallback nativeModuleCallbacks[];
 NativeModuleEntry*    findNativeModule(NativeModuleEntry* modules, const char* name);
 NativeModuleCallback* findNativeModuleCallback(NativeModuleCallback* callbacks, const char* name);
 ObjTable*             defineNativeModule(NativeModuleEntry* module);
+ObjTable*             loadNativeModule(NativeModuleEntry* module);
+NativeFnEntry*        findModuleFn(NativeModuleEntry* module, ObjString* name);
 
 #define phelt_value(pos) (args[pos])
 
@@ -151,9 +156,11 @@ ObjTable*             defineNativeModule(NativeModuleEntry* module);
 
 #define phelt_callClosure(closure, args)                        \
     do {                                                        \
-        Chunk chunk                 = closure->function->chunk; \
-        chunk.code[chunk.count - 1] = OP_REENTER;               \
         call(closure, args);                                    \
+        Chunk chunk = closure->function->chunk;                 \
+        if (chunk.count > 0) {                                  \
+            chunk.code[chunk.count - 1] = OP_REENTER;           \
+        }                                                       \
         run();                                                  \
         *(vm.stackTop - 1 - args) = *(vm.stackTop - 1);         \
     } while (false)
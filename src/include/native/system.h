@@ -10,6 +10,8 @@ extern bool system_mtime(int argCount, Value* args);
 extern bool system_clock(int argCount, Value* args);
 extern bool system_sleep(int argCount, Value* args);
 extern bool system_usleep(int argCount, Value* args);
+extern bool system_fork(int argCount, Value* args);
+extern bool system_checkpoint(int argCount, Value* args);
 extern bool system_print(int argCount, Value* args);
 extern bool system_println(int argCount, Value* args);
 extern bool system_sprint(int argCount, Value* args);
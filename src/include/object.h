@@ -45,6 +45,7 @@ typedef enum {
 struct Obj {
     ObjType     type;
     bool        isMarked;
+    bool        isImmortal;
     struct Obj* next;
 };
 
@@ -62,21 +63,36 @@ typedef struct ObjUpvalue {
     struct ObjUpvalue* next;
 } ObjUpvalue;
 
+// Methods simple enough to run without a call frame, see classifyAccessor().
+typedef enum {
+    ACCESSOR_NONE,
+    ACCESSOR_GETTER,     // this.name
+    ACCESSOR_SETTER,     // this.name = value, returns the value
+    ACCESSOR_SETTER_NIL, // { this.name = value; }
+    ACCESSOR_CONSTANT,   // returns a constant
+} AccessorKind;
+
 typedef struct {
-    Obj         obj;
-    int         arity;
-    int         upvalueCount;
-    int         line;
-    Chunk       chunk;
-    ObjString*  name;
-    const char* source;
+    Obj                obj;
+    int                arity;
+    int                upvalueCount;
+    int                line;
+    Chunk              chunk;
+    ObjString*         name;
+    const char*        source;
+    char*              lazyBody; // parameters and body, compiled on the first call
+    int                lazyLine;
+    int                lazyType;
+    AccessorKind       accessor;
+    Value              accessorValue; // the property name or the constant
+    struct ObjClosure* cachedClosure; // shared by every closure over a function with no upvalues
 } ObjFunction;
 
-typedef struct {
+typedef struct ObjClosure {
     Obj          obj;
     ObjFunction* function;
-    ObjUpvalue** upvalues;
     int          upvalueCount;
+    ObjUpvalue*  upvalues[];
 } ObjClosure;
 
 typedef struct {
@@ -98,9 +114,12 @@ typedef struct {
     ObjClosure* method;
 } ObjBoundMethod;
 
+// `module` is the index in nativeModules of the native module the table
+// was made for, as long as nothing has changed it since, -1 otherwise.
 typedef struct {
     Obj   obj;
     Table table;
+    int   module;
 } ObjTable;
 
 typedef struct {
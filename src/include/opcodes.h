@@ -1,5 +1,6 @@
 // Constants
 OPCODE(CONSTANT)
+OPCODE(CONSTANT_LONG)
 OPCODE(NIL)
 OPCODE(TRUE)
 OPCODE(FALSE)
@@ -34,6 +35,7 @@ OPCODE(DECREMENT)
 OPCODE(POP)
 OPCODE(POP_N)
 OPCODE(DUP)
+OPCODE(PEEK)
 OPCODE(GET_LOCAL)
 OPCODE(GET_LOCAL_2)
 OPCODE(GET_LOCAL_3)
@@ -49,6 +51,7 @@ OPCODE(GET_GLOBAL_4)
 OPCODE(GET_UPVALUE)
 OPCODE(SET_UPVALUE)
 OPCODE(DEFINE_GLOBAL)
+OPCODE(DEFINE_CONSTANT)
 OPCODE(SET_GLOBAL)
 OPCODE(GET_PROPERTY)
 OPCODE(SET_PROPERTY)
@@ -64,6 +67,10 @@ OPCODE(DUMP)
 OPCODE(JUMP)
 OPCODE(JUMP_IF_FALSE)
 OPCODE(LOOP)
+OPCODE(JUMP_LONG)
+OPCODE(JUMP_IF_FALSE_LONG)
+OPCODE(LOOP_LONG)
+OPCODE(SWITCH_TABLE)
 OPCODE(CALL)
 OPCODE(CALL_BLIND)
 OPCODE(INDEX)
@@ -79,3 +86,42 @@ OPCODE(REENTER)
 OPCODE(CLASS)
 OPCODE(INHERIT)
 OPCODE(METHOD)
+
+// Fused loops
+OPCODE(LESS_LOCAL)
+OPCODE(LESS_LOCAL_CONST)
+OPCODE(INCREMENT_LOCAL)
+OPCODE(FOR_STEP)
+OPCODE(FOR_STEP_CONST)
+
+// Inlined and folded calls
+OPCODE(INLINE)
+OPCODE(NATIVE_CONSTANT)
+
+// Hoisted loop invariants
+OPCODE(HOIST_SLOT)
+OPCODE(GET_HOISTED)
+
+// Compact operands
+OPCODE(CONSTANT_BYTE)
+OPCODE(GET_LOCAL_BYTE)
+OPCODE(SET_LOCAL_BYTE)
+OPCODE(GET_GLOBAL_BYTE)
+OPCODE(SET_GLOBAL_BYTE)
+OPCODE(GET_UPVALUE_BYTE)
+OPCODE(SET_UPVALUE_BYTE)
+OPCODE(CALL_BYTE)
+OPCODE(PUSH_BYTE)
+OPCODE(LOAD_LOCAL_0)
+OPCODE(LOAD_LOCAL_1)
+OPCODE(LOAD_LOCAL_2)
+OPCODE(LOAD_LOCAL_3)
+OPCODE(LOAD_CONSTANT_0)
+OPCODE(LOAD_CONSTANT_1)
+OPCODE(LOAD_CONSTANT_2)
+OPCODE(LOAD_CONSTANT_3)
+
+// Superinstructions
+#define SUPERINSTRUCTION(first, second, operands) OPCODE(first##__##second)
+#include "superinstructions.def"
+#undef SUPERINSTRUCTION
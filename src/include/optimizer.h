@@ -0,0 +1,20 @@
+#ifndef phelt_optimizer_h
+#define phelt_optimizer_h
+
+#include "chunk.h"
+#include "common.h"
+#include "object.h"
+#include "table.h"
+
+// `arity` is the number of parameters of the function the chunk belongs
+// to, its frame starts with them and the callee. `knownGlobals` maps
+// global names to the functions calls to them may be inlined from, see
+// canInline(), or to the name of the native module they hold. It may be
+// NULL.
+void optimizeChunk(Chunk* chunk, int arity, Table* knownGlobals);
+bool canInline(ObjFunction* function);
+void classifyAccessor(ObjFunction* function);
+bool evaluateConstant(Chunk* chunk, int start, Value* value);
+void markOptimizerRoots(void);
+
+#endif
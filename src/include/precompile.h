@@ -0,0 +1,10 @@
+#ifndef phelt_precompile_h
+#define phelt_precompile_h
+
+#include "common.h"
+#include "object.h"
+
+void         precompileImports(ObjFunction* script);
+ObjFunction* takePrecompiled(const char* path);
+
+#endif
@@ -0,0 +1,10 @@
+#ifndef phelt_profile_h
+#define phelt_profile_h
+
+#include "common.h"
+
+#ifdef OPCODE_PROFILING
+void startPairProfile(const char* path);
+#endif
+
+#endif
@@ -53,6 +53,7 @@ typedef enum {
     // Keywords.
     TOKEN_AND,
     TOKEN_CLASS,
+    TOKEN_CONST,
     TOKEN_ELSE,
     TOKEN_FALSE,
     TOKEN_FOR,
@@ -88,7 +89,18 @@ typedef struct
     int          line;
 } Token;
 
-void  initScanner(utf8_int8_t* source);
-Token scanToken(void);
+typedef struct
+{
+    utf8_int8_t* start;
+    utf8_int8_t* current;
+    utf8_int8_t* end;
+    int          line;
+} Scanner;
+
+void    initScanner(utf8_int8_t* source);
+void    initScannerAt(utf8_int8_t* source, int line);
+Token   scanToken(void);
+Scanner saveScanner(void);
+void    restoreScanner(Scanner state);
 
 #endif
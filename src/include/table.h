@@ -13,6 +13,7 @@ typedef struct
 typedef struct
 {
     unsigned int count;
+    unsigned int tombstones;
     unsigned int capacity;
     Entry*       entries;
 } Table;
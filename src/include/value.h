@@ -17,12 +17,17 @@ typedef struct ObjString ObjString;
 #define TAG_TRUE 3  // 011.
 #define TAG_EMPTY 4 // 100.
 
+// Native handles keep the sign bit clear so the collector never takes
+// them for objects.
+#define POINTER_BIT ((uint64_t)0x0002000000000000)
+
 typedef uint64_t Value;
 
 #define IS_BOOL(value) (((value) | 1) == TRUE_VAL)
 #define IS_NIL(value) ((value) == NIL_VAL)
 #define IS_EMPTY(value) ((value) == EMPTY_VAL)
-#define IS_POINTER(value) (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+#define IS_POINTER(value) \
+    (((value) & (QNAN | SIGN_BIT | POINTER_BIT)) == (QNAN | POINTER_BIT))
 #define IS_NUMBER(value) (((value)&QNAN) != QNAN)
 #define IS_OBJ(value) \
     (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
@@ -32,7 +37,7 @@ typedef uint64_t Value;
 #define AS_OBJ(value) \
     ((Obj*)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
 #define AS_POINTER(value) \
-    ((void*)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
+    ((void*)(uintptr_t)((value) & ~(QNAN | POINTER_BIT)))
 
 static inline double valueToNum(Value value)
 {
@@ -47,7 +52,7 @@ static inline double valueToNum(Value value)
 #define NIL_VAL ((Value)(uint64_t)(QNAN | TAG_NIL))
 #define EMPTY_VAL ((Value)(uint64_t)(QNAN | TAG_EMPTY))
 #define POINTER_VAL(obj) \
-    (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
+    (Value)(QNAN | POINTER_BIT | (uint64_t)(uintptr_t)(obj))
 #define NUMBER_VAL(num) numToValue(num)
 #define OBJ_VAL(obj) \
     (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
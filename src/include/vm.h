@@ -28,6 +28,11 @@ typedef struct
     Value*      stackTop;
     Table       globals;
     Table       strings;
+    Table       bundle;
+    Table       imports;
+    Table       modules;
+    Table       precompiled;
+    Table       constGlobals; // names of the globals declared with const
     ObjUpvalue* openUpvalues;
 
     ObjString* initString;
@@ -55,6 +60,17 @@ typedef struct
 
     Obj* objects;
 
+    Obj*     immortals;
+    Obj**    immortalIndex;
+    int      immortalCount;
+    uint8_t* immortalMarks;
+    int      preforkWorkers;
+    int      runDepth;
+
+#ifdef OPCODE_PROFILING
+    uint64_t* pairCounts;
+#endif
+
     int   grayCount;
     int   grayCapacity;
     Obj** grayStack;
@@ -71,6 +87,8 @@ extern VM vm;
 void            initVM(void);
 void            freeVM(void);
 InterpretResult interpret(const char* sourcePath, utf8_int8_t* source);
+InterpretResult interpretBundle(const char* path);
+InterpretResult interpretImage(const char* path);
 void            push(Value value);
 Value           pop(void);
 bool            call(ObjClosure* closure, int argCount);
@@ -1,6 +1,9 @@
+#include "cache.h"
 #include "chunk.h"
 #include "common.h"
+#include "compiler.h"
 #include "debug.h"
+#include "profile.h"
 #include "vm.h"
 #include <readline/history.h>
 #include <readline/readline.h>
@@ -18,9 +21,17 @@ static void repl(void)
 
 static void runFile(const char* path)
 {
-    utf8_int8_t*    source = readFile(path);
-    InterpretResult result = interpret(path, source);
-    free(source);
+    InterpretResult result;
+    uint32_t        magic = fileMagic(path);
+    if (magic == BUNDLE_MAGIC) {
+        result = interpretBundle(path);
+    } else if (magic == IMAGE_MAGIC) {
+        result = interpretImage(path);
+    } else {
+        utf8_int8_t* source = readFile(path);
+        result              = interpret(path, source);
+        free(source);
+    }
 
     if (result == INTERPRET_COMPILE_ERROR)
         exit(65);
@@ -28,17 +39,60 @@ static void runFile(const char* path)
         exit(70);
 }
 
+static void usage(void)
+{
+    fprintf(stderr, "Usage: phelt [--lazy] [--prefork N] [--profile-pairs file] [--bundle path -o file] [path]\n");
+    exit(64);
+}
+
 int main(int argc, const char* argv[])
 {
     initVM();
 
-    if (argc == 1) {
+    const char* bundleEntry  = NULL;
+    const char* bundleOutput = NULL;
+
+    int arg = 1;
+    while (arg < argc && argv[arg][0] == '-') {
+        if (strcmp(argv[arg], "--lazy") == 0) {
+            lazyCompilation = true;
+            arg++;
+        } else if (strcmp(argv[arg], "--prefork") == 0 && arg + 1 < argc) {
+            vm.preforkWorkers = atoi(argv[arg + 1]);
+            if (vm.preforkWorkers < 1)
+                usage();
+            arg += 2;
+        } else if (strcmp(argv[arg], "--profile-pairs") == 0 && arg + 1 < argc) {
+#ifdef OPCODE_PROFILING
+            startPairProfile(argv[arg + 1]);
+            arg += 2;
+#else
+            fprintf(stderr, "phelt was built without OPCODE_PROFILING.\n");
+            exit(64);
+#endif
+        } else if (strcmp(argv[arg], "--bundle") == 0 && arg + 1 < argc) {
+            bundleEntry = argv[arg + 1];
+            arg += 2;
+        } else if (strcmp(argv[arg], "-o") == 0 && arg + 1 < argc) {
+            bundleOutput = argv[arg + 1];
+            arg += 2;
+        } else {
+            usage();
+        }
+    }
+
+    if (bundleEntry != NULL || bundleOutput != NULL) {
+        if (bundleEntry == NULL || bundleOutput == NULL || argc != arg)
+            usage();
+        exit(writeBundle(bundleEntry, bundleOutput) ? 0 : 65);
+    }
+
+    if (argc == arg) {
         repl();
-    } else if (argc == 2) {
-        runFile(argv[1]);
+    } else if (argc == arg + 1) {
+        runFile(argv[arg]);
     } else {
-        fprintf(stderr, "Usage: phelt [path]\n");
-        exit(64);
+        usage();
     }
 
     freeVM();
@@ -1,6 +1,8 @@
 #include "memory.h"
 #include "compiler.h"
+#include "optimizer.h"
 #include "vm.h"
+#include <pthread.h>
 
 #ifdef DEBUG_LOG_GC
 #include "debug.h"
@@ -8,11 +10,49 @@
 
 #define GC_HEAP_GROW_FACTOR 2
 
+static HeapEdgeFn heapVisitor = NULL;
+static void*      heapContext = NULL;
+static Obj*       heapParent  = NULL;
+
+// While imports compile on several threads, every change to the heap and
+// the string table goes through one recursive lock, and collection waits
+// until the heap is private again. Objects made meanwhile don't need to be
+// reachable until then.
+static pthread_mutex_t heapLock;
+static bool            heapLockReady = false;
+static bool            heapShared    = false;
+
+void shareHeap(bool shared)
+{
+    if (shared && !heapLockReady) {
+        pthread_mutexattr_t attributes;
+        pthread_mutexattr_init(&attributes);
+        pthread_mutexattr_settype(&attributes, PTHREAD_MUTEX_RECURSIVE);
+        pthread_mutex_init(&heapLock, &attributes);
+        pthread_mutexattr_destroy(&attributes);
+        heapLockReady = true;
+    }
+    heapShared = shared;
+}
+
+void lockHeap(void)
+{
+    if (heapShared)
+        pthread_mutex_lock(&heapLock);
+}
+
+void unlockHeap(void)
+{
+    if (heapShared)
+        pthread_mutex_unlock(&heapLock);
+}
+
 void* reallocate(void* pointer, size_t oldSize, size_t newSize)
 {
+    lockHeap();
     vm.bytesAllocated += newSize - oldSize;
 
-    if (newSize > oldSize) {
+    if (newSize > oldSize && !heapShared) {
 #ifdef DEBUG_STRESS_GC
         collectGarbage();
 #endif
@@ -21,16 +61,14 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize)
         }
     }
 
+    void* result = NULL;
     if (newSize == 0) {
         free(pointer);
-        return NULL;
-    }
-
-    void* result = realloc(pointer, newSize);
-
-    if (result == NULL)
+    } else if ((result = realloc(pointer, newSize)) == NULL) {
         exit(1);
+    }
 
+    unlockHeap();
     return result;
 }
 
@@ -59,13 +97,13 @@ static void freeObject(Obj* object)
     }
     case OBJ_CLOSURE: {
         ObjClosure* closure = (ObjClosure*)object;
-        FREE_ARRAY(ObjUpvalue*, closure->upvalues, closure->upvalueCount);
-        FREE(ObjClosure, object);
+        reallocate(object, sizeof(ObjClosure) + sizeof(ObjUpvalue*) * closure->upvalueCount, 0);
         break;
     }
     case OBJ_FUNCTION: {
         ObjFunction* function = (ObjFunction*)object;
         freeChunk(&function->chunk);
+        free(function->lazyBody);
         FREE(ObjFunction, object);
         break;
     }
@@ -99,7 +137,34 @@ void freeObjects(void)
         object = next;
     }
 
+    object = vm.immortals;
+    while (object != NULL) {
+        Obj* next = object->next;
+        freeObject(object);
+        object = next;
+    }
+
     free(vm.grayStack);
+    free(vm.immortalIndex);
+    free(vm.immortalMarks);
+}
+
+static int immortalSlot(Obj* object)
+{
+    int low  = 0;
+    int high = vm.immortalCount - 1;
+    while (low <= high) {
+        int middle = low + (high - low) / 2;
+        if (vm.immortalIndex[middle] == object)
+            return middle;
+        if (vm.immortalIndex[middle] < object)
+            low = middle + 1;
+        else
+            high = middle - 1;
+    }
+
+    // unreachable, every immortal object is indexed
+    return -1;
 }
 
 void markObject(Obj* object)
@@ -107,8 +172,22 @@ void markObject(Obj* object)
     if (object == NULL)
         return;
 
-    if (object->isMarked)
-        return;
+    if (heapVisitor != NULL)
+        heapVisitor(heapParent, object, heapContext);
+
+    // Immortal objects keep their mark in a side bitmap, so a collection
+    // never writes to pages shared with a pre-fork parent.
+    if (object->isImmortal) {
+        int     slot = immortalSlot(object);
+        uint8_t bit  = (uint8_t)(1 << (slot & 7));
+        if (vm.immortalMarks[slot >> 3] & bit)
+            return;
+        vm.immortalMarks[slot >> 3] |= bit;
+    } else {
+        if (object->isMarked)
+            return;
+        object->isMarked = true;
+    }
 
 #ifdef DEBUG_LOG_GC
     printf("%p mark ", (void*)object);
@@ -116,8 +195,6 @@ void markObject(Obj* object)
     printf("\n");
 #endif
 
-    object->isMarked = true;
-
     if (vm.grayCapacity < vm.grayCount + 1) {
         vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
         vm.grayStack    = (Obj**)realloc(vm.grayStack, sizeof(Obj*) * vm.grayCapacity);
@@ -181,6 +258,8 @@ static void blackenObject(Obj* object)
     case OBJ_FUNCTION: {
         ObjFunction* function = (ObjFunction*)object;
         markObject((Obj*)function->name);
+        markValue(function->accessorValue);
+        markObject((Obj*)function->cachedClosure);
         markArray(&function->chunk.constants);
         break;
     }
@@ -203,8 +282,16 @@ static void blackenObject(Obj* object)
     }
 }
 
+static void clearImmortalMarks(void)
+{
+    if (vm.immortalCount > 0)
+        memset(vm.immortalMarks, 0, (vm.immortalCount + 7) / 8);
+}
+
 static void markRoots(void)
 {
+    heapParent = NULL;
+
     for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
         markValue(*slot);
     }
@@ -220,7 +307,13 @@ static void markRoots(void)
     }
 
     markTable(&vm.globals);
+    markTable(&vm.bundle);
+    markTable(&vm.imports);
+    markTable(&vm.modules);
+    markTable(&vm.precompiled);
+    markTable(&vm.constGlobals);
     markCompilerRoots();
+    markOptimizerRoots();
     markObject((Obj*)vm.initString);
     markObject((Obj*)vm.strString);
     markObject((Obj*)vm.addString);
@@ -243,6 +336,7 @@ static void traceReferences(void)
 {
     while (vm.grayCount > 0) {
         Obj* object = vm.grayStack[--vm.grayCount];
+        heapParent  = object;
         blackenObject(object);
     }
 }
@@ -270,6 +364,68 @@ static void sweep(void)
     }
 }
 
+size_t objectSize(Obj* object)
+{
+    switch (object->type) {
+    case OBJ_BOUND_METHOD:
+        return sizeof(ObjBoundMethod);
+    case OBJ_CLASS: {
+        ObjClass* klass = (ObjClass*)object;
+        return sizeof(ObjClass) + sizeof(Entry) * (klass->methods.capacity + klass->fields.capacity);
+    }
+    case OBJ_INSTANCE: {
+        ObjInstance* instance = (ObjInstance*)object;
+        return sizeof(ObjInstance) + sizeof(Entry) * instance->fields.capacity;
+    }
+    case OBJ_CLOSURE: {
+        ObjClosure* closure = (ObjClosure*)object;
+        return sizeof(ObjClosure) + sizeof(ObjUpvalue*) * closure->upvalueCount;
+    }
+    case OBJ_FUNCTION: {
+        ObjFunction* function = (ObjFunction*)object;
+        return sizeof(ObjFunction)
+            + sizeof(uint8_t) * function->chunk.capacity
+            + sizeof(LineStart) * function->chunk.lineCapacity
+            + sizeof(Value) * function->chunk.constants.capacity;
+    }
+    case OBJ_NATIVE:
+        return sizeof(ObjNative);
+    case OBJ_STRING:
+        return sizeof(ObjString) + ((ObjString*)object)->length + 1;
+    case OBJ_UPVALUE:
+        return sizeof(ObjUpvalue);
+    case OBJ_TABLE:
+        return sizeof(ObjTable) + sizeof(Entry) * ((ObjTable*)object)->table.capacity;
+    case OBJ_ARRAY:
+        return sizeof(ObjArray) + sizeof(Value) * ((ObjArray*)object)->array.capacity;
+    }
+
+    return 0;
+}
+
+// Reports every reference in the live object graph to `visit`, using the
+// same root set and tracing as the collector. Edges from the root set are
+// reported with a NULL `from`. The visitor must not allocate. It doesn't
+// collect first, garbage is simply never reached.
+void walkHeap(HeapEdgeFn visit, void* context)
+{
+    heapVisitor = visit;
+    heapContext = context;
+    heapParent  = NULL;
+
+    clearImmortalMarks();
+    markRoots();
+    traceReferences();
+
+    heapVisitor = NULL;
+    heapContext = NULL;
+    heapParent  = NULL;
+
+    for (Obj* object = vm.objects; object != NULL; object = object->next) {
+        object->isMarked = false;
+    }
+}
+
 void collectGarbage(void)
 {
 #ifdef DEBUG_LOG_GC
@@ -277,6 +433,7 @@ void collectGarbage(void)
     size_t before = vm.bytesAllocated;
 #endif
 
+    clearImmortalMarks();
     markRoots();
     traceReferences();
     tableRemoveWhite(&vm.strings);
@@ -291,3 +448,48 @@ void collectGarbage(void)
         vm.nextGC);
 #endif
 }
+
+static int compareObjects(const void* a, const void* b)
+{
+    Obj* left  = *(Obj* const*)a;
+    Obj* right = *(Obj* const*)b;
+    return (left > right) - (left < right);
+}
+
+// Moves every live object into the immortal generation. Immortal objects
+// are traced but never swept, and their mark bits live in
+// vm.immortalMarks instead of the object header. Called before fork() so
+// the children can collect without dirtying the pages they share.
+void freezeHeap(void)
+{
+    collectGarbage();
+
+    if (vm.objects == NULL)
+        return;
+
+    int  count = vm.immortalCount;
+    Obj* tail  = NULL;
+    for (Obj* object = vm.objects; object != NULL; object = object->next) {
+        object->isImmortal = true;
+        tail               = object;
+        count++;
+    }
+
+    tail->next   = vm.immortals;
+    vm.immortals = vm.objects;
+    vm.objects   = NULL;
+
+    vm.immortalIndex = (Obj**)realloc(vm.immortalIndex, sizeof(Obj*) * count);
+    vm.immortalMarks = (uint8_t*)realloc(vm.immortalMarks, (count + 7) / 8);
+    if (vm.immortalIndex == NULL || vm.immortalMarks == NULL)
+        exit(1);
+
+    int slot = 0;
+    for (Obj* object = vm.immortals; object != NULL; object = object->next) {
+        vm.immortalIndex[slot++] = object;
+    }
+
+    qsort(vm.immortalIndex, count, sizeof(Obj*), compareObjects);
+    vm.immortalCount = count;
+    clearImmortalMarks();
+}
@@ -1,4 +1,5 @@
 #include "native/debug.h"
+#include "memory.h"
 
 bool debug_frame(int argCount, Value* args)
 {
@@ -28,10 +29,14 @@ bool debug_frame(int argCount, Value* args)
         OBJ_VAL(copyString("source", 6)),
         OBJ_VAL(copyString(function->source, (int)strlen(function->source))));
 
+    // a frame running inlined code is on the line of the call it replaced
+    int instruction = (int)(frame->ip - function->chunk.code - 1);
+    int site        = getInlineSite(&function->chunk, instruction);
+
     tableSet(
         &table->table,
         OBJ_VAL(copyString("line", 4)),
-        function->chunk.lines.values[frame->ip - function->chunk.code - 1]);
+        NUMBER_VAL(getLine(&function->chunk, site != -1 ? site : instruction)));
 
     ObjTable* funTable = newTable();
 
@@ -60,3 +65,217 @@ bool debug_frame(int argCount, Value* args)
     phelt_pushObject(-1, table);
     return true;
 }
+
+#define OBJ_TYPE_COUNT (OBJ_ARRAY + 1)
+
+typedef struct {
+    ObjClass* klass;
+    size_t    count;
+    size_t    bytes;
+} ClassCensus;
+
+// Keeps the key and the value on the stack while tableSet() may collect.
+static void censusField(Table* dest, const char* name, Value value)
+{
+    push(value);
+    push(OBJ_VAL(copyString(name, (int)strlen(name))));
+    tableSet(dest, vm.stackTop[-1], vm.stackTop[-2]);
+    pop();
+    pop();
+}
+
+static void censusEntry(Table* dest, Value key, size_t count, size_t bytes)
+{
+    push(key);
+
+    Value existing;
+    if (tableGet(dest, key, &existing)) {
+        Table* entry = &AS_TABLE(existing)->table;
+        Value  value;
+        tableGet(entry, OBJ_VAL(copyString("count", 5)), &value);
+        count += (size_t)AS_NUMBER(value);
+        tableGet(entry, OBJ_VAL(copyString("bytes", 5)), &value);
+        bytes += (size_t)AS_NUMBER(value);
+    }
+
+    ObjTable* entry = newTable();
+    push(OBJ_VAL(entry));
+    censusField(&entry->table, "count", NUMBER_VAL(count));
+    censusField(&entry->table, "bytes", NUMBER_VAL(bytes));
+    tableSet(dest, key, OBJ_VAL(entry));
+    pop();
+    pop();
+}
+
+bool debug_heapCensus(int argCount, Value* args)
+{
+    phelt_checkArgs(0);
+
+    collectGarbage();
+
+    const char* names[OBJ_TYPE_COUNT]  = { NULL };
+    size_t      counts[OBJ_TYPE_COUNT] = { 0 };
+    size_t      bytes[OBJ_TYPE_COUNT]  = { 0 };
+
+    ClassCensus* classes       = NULL;
+    int          classCount    = 0;
+    int          classCapacity = 0;
+
+    Obj* generations[] = { vm.objects, vm.immortals };
+    for (int i = 0; i < 2; i++) {
+        for (Obj* object = generations[i]; object != NULL; object = object->next) {
+            size_t size = objectSize(object);
+
+            names[object->type] = objectType(OBJ_VAL(object));
+            counts[object->type]++;
+            bytes[object->type] += size;
+
+            if (object->type != OBJ_INSTANCE)
+                continue;
+
+            ObjClass* klass = ((ObjInstance*)object)->klass;
+            int       index = 0;
+            while (index < classCount && classes[index].klass != klass)
+                index++;
+
+            if (index == classCount) {
+                if (classCapacity < classCount + 1) {
+                    classCapacity = GROW_CAPACITY(classCapacity);
+                    classes       = realloc(classes, sizeof(ClassCensus) * classCapacity);
+                    if (classes == NULL)
+                        exit(1);
+                }
+                classes[classCount++] = (ClassCensus) { klass, 0, 0 };
+            }
+
+            classes[index].count++;
+            classes[index].bytes += size;
+        }
+    }
+
+    size_t totalCount = 0;
+    size_t totalBytes = 0;
+
+    ObjTable* census = newTable();
+    phelt_pushObject(-1, census);
+
+    ObjTable* types = newTable();
+    censusField(&census->table, "types", OBJ_VAL(types));
+
+    for (int type = 0; type < OBJ_TYPE_COUNT; type++) {
+        if (counts[type] == 0)
+            continue;
+
+        totalCount += counts[type];
+        totalBytes += bytes[type];
+        censusEntry(&types->table, OBJ_VAL(copyString(names[type], strlen(names[type]))), counts[type], bytes[type]);
+    }
+
+    ObjTable* instances = newTable();
+    censusField(&census->table, "classes", OBJ_VAL(instances));
+
+    for (int i = 0; i < classCount; i++) {
+        censusEntry(&instances->table, OBJ_VAL(classes[i].klass->name), classes[i].count, classes[i].bytes);
+    }
+
+    free(classes);
+
+    censusField(&census->table, "count", NUMBER_VAL(totalCount));
+    censusField(&census->table, "bytes", NUMBER_VAL(totalBytes));
+
+    return true;
+}
+
+static void writeLabel(FILE* file, const char* chars, int length)
+{
+    fputc('"', file);
+    for (int i = 0; i < length && i < 64; i++) {
+        unsigned char c = (unsigned char)chars[i];
+        if (c == '"' || c == '\\')
+            fprintf(file, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(file, "\\x%02x", c);
+        else
+            fputc(c, file);
+    }
+    fputc('"', file);
+}
+
+static void writeNode(FILE* file, Obj* object)
+{
+    fprintf(file, "node %p %s %zu ", (void*)object, objectType(OBJ_VAL(object)), objectSize(object));
+
+    ObjString* name = NULL;
+    switch (object->type) {
+    case OBJ_STRING: {
+        ObjString* string = (ObjString*)object;
+        writeLabel(file, string->chars, string->length);
+        fputc('\n', file);
+        return;
+    }
+    case OBJ_CLASS:
+        name = ((ObjClass*)object)->name;
+        break;
+    case OBJ_INSTANCE:
+        name = ((ObjInstance*)object)->klass->name;
+        break;
+    case OBJ_FUNCTION:
+        name = ((ObjFunction*)object)->name;
+        break;
+    case OBJ_CLOSURE:
+        name = ((ObjClosure*)object)->function->name;
+        break;
+    case OBJ_BOUND_METHOD:
+        name = ((ObjBoundMethod*)object)->method->function->name;
+        break;
+    default:
+        break;
+    }
+
+    if (name != NULL)
+        writeLabel(file, name->chars, name->length);
+    else
+        writeLabel(file, "", 0);
+    fputc('\n', file);
+}
+
+static void writeEdge(Obj* from, Obj* to, void* context)
+{
+    FILE* file = (FILE*)context;
+    if (from == NULL)
+        fprintf(file, "root %p\n", (void*)to);
+    else
+        fprintf(file, "edge %p %p\n", (void*)from, (void*)to);
+}
+
+bool debug_heapSnapshot(int argCount, Value* args)
+{
+    phelt_checkArgs(1);
+    phelt_checkString(0);
+
+    const char* path = phelt_toCString(0);
+
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+        phelt_error("Failed to open snapshot file '%s'.", path);
+        return false;
+    }
+
+    collectGarbage();
+
+    int nodes = 0;
+    fprintf(file, "phelt-heap-snapshot 1\n");
+    Obj* generations[] = { vm.objects, vm.immortals };
+    for (int i = 0; i < 2; i++) {
+        for (Obj* object = generations[i]; object != NULL; object = object->next) {
+            writeNode(file, object);
+            nodes++;
+        }
+    }
+
+    walkHeap(writeEdge, file);
+    fclose(file);
+
+    phelt_pushNumber(-1, nodes);
+    return true;
+}
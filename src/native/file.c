@@ -324,15 +324,19 @@ bool file_rename(int argCount, Value* args)
 
 void fileCallback(Table* table)
 {
-#define SET_CONST(name, value)                     \
-    push(NUMBER_VAL(value));                       \
-    push(OBJ_VAL(copyString(name, strlen(name)))); \
-    tableSet(table, pop(), pop());
-
-#define SET_CONST_PTR(name, value)                 \
-    push(POINTER_VAL(value));                      \
-    push(OBJ_VAL(copyString(name, strlen(name)))); \
-    tableSet(table, pop(), pop());
+#define SET_CONST(name, value)                         \
+    push(NUMBER_VAL(value));                           \
+    push(OBJ_VAL(copyString(name, strlen(name))));     \
+    tableSet(table, vm.stackTop[-1], vm.stackTop[-2]); \
+    pop();                                             \
+    pop();
+
+#define SET_CONST_PTR(name, value)                     \
+    push(POINTER_VAL(value));                          \
+    push(OBJ_VAL(copyString(name, strlen(name))));     \
+    tableSet(table, vm.stackTop[-1], vm.stackTop[-2]); \
+    pop();                                             \
+    pop();
 
     SET_CONST_PTR("stdin", (uintptr_t)stdin);
     SET_CONST_PTR("stdout", (uintptr_t)stdout);
@@ -195,10 +195,12 @@ bool math_rand(int argCount, Value* args)
 
 void mathCallback(Table* table)
 {
-#define SET_CONST(name, value)                     \
-    push(NUMBER_VAL(value));                       \
-    push(OBJ_VAL(copyString(name, strlen(name)))); \
-    tableSet(table, pop(), pop());
+#define SET_CONST(name, value)                         \
+    push(NUMBER_VAL(value));                           \
+    push(OBJ_VAL(copyString(name, strlen(name))));     \
+    tableSet(table, vm.stackTop[-1], vm.stackTop[-2]); \
+    pop();                                             \
+    pop();
 
     SET_CONST("E", M_E);
     SET_CONST("LOG2E", M_LOG2E);
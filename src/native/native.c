@@ -27,142 +27,179 @@ NativeModuleCallback* findNativeModuleCallback(NativeModuleCallback* callbacks,
 ObjTable* defineNativeModule(NativeModuleEntry* module)
 {
     ObjTable* table = newTable();
+    push(OBJ_VAL(table));
 
     for (NativeFnEntry* entry = module->fns; entry->name != NULL; entry++) {
-        tableSet(&table->table, OBJ_VAL(copyString(entry->name, (int)strlen(entry->name))), OBJ_VAL(newNative(entry->function)));
+        push(OBJ_VAL(copyString(entry->name, (int)strlen(entry->name))));
+        push(OBJ_VAL(newNative(entry->function)));
+        tableSet(&table->table, vm.stackTop[-2], vm.stackTop[-1]);
+        pop();
+        pop();
     }
 
     NativeModuleCallback* callback = findNativeModuleCallback(nativeModuleCallbacks, module->name);
     if (callback != NULL)
         callback->callback(&table->table);
 
+    table->module = (int)(module - nativeModules);
+    pop();
     return table;
 }
 
+// The table module() returns for `module`, every call gets the same one.
+ObjTable* loadNativeModule(NativeModuleEntry* module)
+{
+    Value name = OBJ_VAL(copyString(module->name, (int)strlen(module->name)));
+    Value table;
+    if (tableGet(&vm.modules, name, &table))
+        return AS_TABLE(table);
+
+    push(name);
+    table = OBJ_VAL(defineNativeModule(module));
+    push(table);
+    tableSet(&vm.modules, name, table);
+    pop();
+    pop();
+    return AS_TABLE(table);
+}
+
+NativeFnEntry* findModuleFn(NativeModuleEntry* module, ObjString* name)
+{
+    for (NativeFnEntry* entry = module->fns; entry->name != NULL; entry++) {
+        if (strcmp(entry->name, name->chars) == 0)
+            return entry;
+    }
+    return NULL;
+}
+
 NativeFnEntry globalFns[] = {
-    { "print", system_print },
-    { "sprint", system_sprint },
-    { "println", system_println },
-    { "module", system_module },
-    { "typeof", system_typeof },
-    { NULL, NULL },
+    { "print", system_print, false },
+    { "sprint", system_sprint, false },
+    { "println", system_println, false },
+    { "module", system_module, false },
+    { "typeof", system_typeof, false },
+    { NULL, NULL, false },
 };
 
 NativeFnEntry systemFns[] = {
-    { "env", system_env },
-    { "exit", system_exit },
-    { "time", system_time },
-    { "mtime", system_mtime },
-    { "clock", system_clock },
-    { "sleep", system_sleep },
-    { "usleep", system_usleep },
-    { NULL, NULL },
+    { "env", system_env, false },
+    { "exit", system_exit, false },
+    { "time", system_time, false },
+    { "mtime", system_mtime, false },
+    { "clock", system_clock, false },
+    { "sleep", system_sleep, false },
+    { "usleep", system_usleep, false },
+    { "fork", system_fork, false },
+    { "checkpoint", system_checkpoint, false },
+    { NULL, NULL, false },
 };
 
 NativeFnEntry mathFns[] = {
-    { "ceil", math_ceil },
-    { "floor", math_floor },
-    { "abs", math_fabs },
-    { "exp", math_exp },
-    { "sqrt", math_sqrt },
-    { "sin", math_sin },
-    { "cos", math_cos },
-    { "tan", math_tan },
-    { "atan", math_atan },
-    { "pow", math_pow },
-    { "atan2", math_atan2 },
-    { "deg", math_deg },
-    { "rad", math_rad },
-    { "clamp", math_clamp },
-    { "lerp", math_lerp },
-    { "map", math_map },
-    { "norm", math_norm },
-    { "seed", math_seed },
-    { "rand", math_rand },
-    { "round", math_round },
-    { NULL, NULL },
+    { "ceil", math_ceil, true },
+    { "floor", math_floor, true },
+    { "abs", math_fabs, true },
+    { "exp", math_exp, true },
+    { "sqrt", math_sqrt, true },
+    { "sin", math_sin, true },
+    { "cos", math_cos, true },
+    { "tan", math_tan, true },
+    { "atan", math_atan, true },
+    { "pow", math_pow, true },
+    { "atan2", math_atan2, true },
+    { "deg", math_deg, true },
+    { "rad", math_rad, true },
+    { "clamp", math_clamp, true },
+    { "lerp", math_lerp, true },
+    { "map", math_map, true },
+    { "norm", math_norm, true },
+    { "seed", math_seed, false },
+    { "rand", math_rand, false },
+    { "round", math_round, true },
+    { NULL, NULL, false },
 };
 
 NativeFnEntry fileFns[] = {
-    { "open", file_open },
-    { "tmpfile", file_tmpfile },
-    { "mkstemps", file_mkstemps },
-    { "close", file_close },
-    { "write", file_write },
-    { "read", file_read },
-    { "seek", file_seek },
-    { "tell", file_tell },
-    { "flush", file_flush },
-    { "getc", file_getc },
-    { "gets", file_gets },
-    { "puts", file_puts },
-    { "putc", file_putc },
-    { "remove", file_remove },
-    { "rename", file_rename },
-    { NULL, NULL },
+    { "open", file_open, false },
+    { "tmpfile", file_tmpfile, false },
+    { "mkstemps", file_mkstemps, false },
+    { "close", file_close, false },
+    { "write", file_write, false },
+    { "read", file_read, false },
+    { "seek", file_seek, false },
+    { "tell", file_tell, false },
+    { "flush", file_flush, false },
+    { "getc", file_getc, false },
+    { "gets", file_gets, false },
+    { "puts", file_puts, false },
+    { "putc", file_putc, false },
+    { "remove", file_remove, false },
+    { "rename", file_rename, false },
+    { NULL, NULL, false },
 };
 
 NativeFnEntry httpFns[] = {
-    { "get", http_get },
-    { "post", http_post },
-    { "put", http_put },
-    { "patch", http_patch },
-    { "delete", http_delete },
-    { "head", http_head },
-    { "options", http_options },
-    { NULL, NULL },
+    { "get", http_get, false },
+    { "post", http_post, false },
+    { "put", http_put, false },
+    { "patch", http_patch, false },
+    { "delete", http_delete, false },
+    { "head", http_head, false },
+    { "options", http_options, false },
+    { NULL, NULL, false },
 };
 
 NativeFnEntry arrayFns[] = {
-    { "length", array_length },
-    { "push", array_push },
-    { "pop", array_pop },
-    { "insert", array_insert },
-    { "remove", array_remove },
-    { "sort", array_sort },
-    { "reverse", array_reverse },
-    { "find", array_find },
-    { "findLast", array_findLast },
-    { "map", array_map },
-    { "filter", array_filter },
-    { "reduce", array_reduce },
-    { "flatten", array_flatten },
-    { NULL, NULL },
+    { "length", array_length, false },
+    { "push", array_push, false },
+    { "pop", array_pop, false },
+    { "insert", array_insert, false },
+    { "remove", array_remove, false },
+    { "sort", array_sort, false },
+    { "reverse", array_reverse, false },
+    { "find", array_find, false },
+    { "findLast", array_findLast, false },
+    { "map", array_map, false },
+    { "filter", array_filter, false },
+    { "reduce", array_reduce, false },
+    { "flatten", array_flatten, false },
+    { NULL, NULL, false },
 };
 
 NativeFnEntry tableFns[] = {
-    { "length", table_length },
-    { "keys", table_keys },
-    { "values", table_values },
-    { "hasKey", table_hasKey },
-    { "remove", table_remove },
-    { "insert", table_insert },
-    { NULL, NULL },
+    { "length", table_length, false },
+    { "keys", table_keys, false },
+    { "values", table_values, false },
+    { "hasKey", table_hasKey, false },
+    { "remove", table_remove, false },
+    { "insert", table_insert, false },
+    { NULL, NULL, false },
 };
 
 NativeFnEntry stringFns[] = {
-    { "length", string_length },
-    { "sub", string_sub },
-    { "find", string_find },
-    { "replace", string_replace },
-    { "split", string_split },
-    { "trim", string_trim },
-    { "upper", string_upper },
-    { "lower", string_lower },
-    { "reverse", string_reverse },
-    { "repeat", string_repeat },
-    { NULL, NULL },
+    { "length", string_length, true },
+    { "sub", string_sub, true },
+    { "find", string_find, true },
+    { "replace", string_replace, true },
+    { "split", string_split, false },
+    { "trim", string_trim, true },
+    { "upper", string_upper, true },
+    { "lower", string_lower, true },
+    { "reverse", string_reverse, true },
+    { "repeat", string_repeat, false },
+    { NULL, NULL, false },
 };
 
 NativeFnEntry jsonFns[] = {
-    { "decode", json_decode },
-    { "encode", json_encode },
-    { NULL, NULL },
+    { "decode", json_decode, false },
+    { "encode", json_encode, false },
+    { NULL, NULL, false },
 };
 
 NativeFnEntry debugFns[] = {
-    { "frame", debug_frame },
-    { NULL, NULL },
+    { "frame", debug_frame, false },
+    { "heapCensus", debug_heapCensus, false },
+    { "heapSnapshot", debug_heapSnapshot, false },
+    { NULL, NULL, false },
 };
 
 // modules
@@ -1,10 +1,13 @@
 #include "native/system.h"
+#include "image.h"
+#include "memory.h"
 #include "object.h"
 #include "ph_string.h"
 #include "value.h"
 #include "vm.h"
 
 #include <sys/time.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -84,6 +87,85 @@ bool system_usleep(int argCount, Value* args)
     return true;
 }
 
+// pid_t fork(void);
+// let pid = system.fork()
+bool system_fork(int argCount, Value* args)
+{
+    phelt_checkArgs(0);
+
+    // everything allocated before the first fork is shared with the
+    // children, later forks leave the parent's heap collectable
+    static bool frozen = false;
+    if (!frozen) {
+        freezeHeap();
+        frozen = true;
+    }
+    fflush(stdout);
+    fflush(stderr);
+
+    if (vm.preforkWorkers == 0) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            phelt_error("Failed to fork.");
+            return false;
+        }
+
+        phelt_pushNumber(-1, pid);
+        return true;
+    }
+
+    // --prefork N: start the workers, then supervise them until they exit
+    int workers       = vm.preforkWorkers;
+    vm.preforkWorkers = 0;
+
+    int started = 0;
+    for (int worker = 1; worker <= workers; worker++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            phelt_pushNumber(-1, worker);
+            return true;
+        }
+        if (pid < 0)
+            break;
+        started++;
+    }
+
+    int status = started == workers ? 0 : 1;
+    for (int i = 0; i < started; i++) {
+        int workerStatus;
+        if (wait(&workerStatus) < 0)
+            break;
+        if (!WIFEXITED(workerStatus) || WEXITSTATUS(workerStatus) != 0)
+            status = 1;
+    }
+
+    exit(status);
+    return true;
+}
+
+// let resumed = system.checkpoint("tool.phi")
+// Writes the whole VM to an image and returns false. Running the image
+// with `phelt tool.phi` resumes here, with checkpoint() returning true.
+bool system_checkpoint(int argCount, Value* args)
+{
+    phelt_checkArgs(1);
+    phelt_checkString(0);
+
+    if (vm.runDepth > 1) {
+        phelt_error("Can't checkpoint inside a call from native code.");
+        return false;
+    }
+
+    const char* error = writeImage(phelt_toCString(0), &args[-1]);
+    if (error != NULL) {
+        phelt_error("%s", error);
+        return false;
+    }
+
+    phelt_pushBool(-1, false);
+    return true;
+}
+
 void escape(char* str)
 {
     int write_index = 0;
@@ -240,8 +322,6 @@ bool system_module(int argCount, Value* args)
         return false;
     }
 
-    ObjTable* table = defineNativeModule(entry);
-
-    phelt_pushObject(-1, table);
+    phelt_pushObject(-1, loadNativeModule(entry));
     return true;
 }
@@ -60,6 +60,7 @@ bool table_remove(int argCount, Value* args)
     phelt_checkTable(0);
 
     ObjTable* table = phelt_toTable(0);
+    table->module   = -1;
     phelt_pushBool(-1, tableDelete(&table->table, phelt_value(1)));
     return true;
 }
@@ -70,6 +71,7 @@ bool table_insert(int argCount, Value* args)
     phelt_checkTable(0);
 
     ObjTable* table = phelt_toTable(0);
+    table->module   = -1;
     tableSet(&table->table, phelt_value(1), phelt_value(2));
     return true;
 }
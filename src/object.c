@@ -11,11 +11,14 @@
 
 static Obj* allocateObject(size_t size, ObjType type)
 {
+    lockHeap();
     Obj* object      = (Obj*)reallocate(NULL, 0, size);
-    object->isMarked = false;
-    object->type     = type;
+    object->isMarked   = false;
+    object->isImmortal = false;
+    object->type       = type;
     object->next     = vm.objects;
     vm.objects       = object;
+    unlockHeap();
 
 #ifdef DEBUG_LOG_GC
     printf("%p allocate %zu for %d\n", (void*)object, size, type);
@@ -52,26 +55,31 @@ ObjInstance* newInstance(ObjClass* klass)
 
 ObjClosure* newClosure(ObjFunction* function)
 {
-    ObjClosure* closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
-
-    ObjUpvalue** upvalues = ALLOCATE(ObjUpvalue*,
-        function->upvalueCount);
-    for (int i = 0; i < function->upvalueCount; i++) {
-        upvalues[i] = NULL;
-    }
-
+    // the upvalues are stored inline, right after the closure
+    ObjClosure* closure = (ObjClosure*)allocateObject(
+        sizeof(ObjClosure) + sizeof(ObjUpvalue*) * function->upvalueCount, OBJ_CLOSURE);
     closure->function     = function;
-    closure->upvalues     = upvalues;
     closure->upvalueCount = function->upvalueCount;
+    for (int i = 0; i < function->upvalueCount; i++) {
+        closure->upvalues[i] = NULL;
+    }
     return closure;
 }
 
 ObjFunction* newFunction(void)
 {
-    ObjFunction* function  = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
-    function->arity        = 0;
-    function->upvalueCount = 0;
-    function->name         = NULL;
+    ObjFunction* function   = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
+    function->arity         = 0;
+    function->upvalueCount  = 0;
+    function->name          = NULL;
+    function->source        = NULL;
+    function->line          = 0;
+    function->lazyBody      = NULL;
+    function->lazyLine      = 0;
+    function->lazyType      = 0;
+    function->accessor      = ACCESSOR_NONE;
+    function->accessorValue = NIL_VAL;
+    function->cachedClosure = NULL;
     initChunk(&function->chunk);
     return function;
 }
@@ -107,27 +115,31 @@ static uint32_t hashString(const char* key, int length)
 
 ObjString* takeString(char* chars, int length)
 {
-    uint32_t   hash     = hashString(chars, length);
+    uint32_t hash = hashString(chars, length);
+    lockHeap();
     ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
     if (interned != NULL) {
         FREE_ARRAY(char, chars, length + 1);
-        return interned;
+    } else {
+        interned = allocateString(chars, length, hash);
     }
-
-    return allocateString(chars, length, hash);
+    unlockHeap();
+    return interned;
 }
 
 ObjString* copyString(const char* chars, int length)
 {
-    uint32_t   hash     = hashString(chars, length);
+    uint32_t hash = hashString(chars, length);
+    lockHeap();
     ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
-    if (interned != NULL)
-        return interned;
-
-    char* heapChars = ALLOCATE(char, length + 1);
-    memcpy(heapChars, chars, length);
-    heapChars[length] = '\0';
-    return allocateString(heapChars, length, hash);
+    if (interned == NULL) {
+        char* heapChars = ALLOCATE(char, length + 1);
+        memcpy(heapChars, chars, length);
+        heapChars[length] = '\0';
+        interned = allocateString(heapChars, length, hash);
+    }
+    unlockHeap();
+    return interned;
 }
 
 char* copyStringRaw(const char* chars, int length)
@@ -183,6 +195,7 @@ ObjTable* newTable(void)
 {
     ObjTable* table = ALLOCATE_OBJ(ObjTable, OBJ_TABLE);
     initTable(&table->table);
+    table->module = -1;
     return table;
 }
 
@@ -330,11 +343,16 @@ char* objectString(Value value)
             return instance->klass->name->chars;
         }
 
-        ObjBoundMethod* bound = newBoundMethod(value, AS_CLOSURE(value));
+        ObjClosure*     closure = AS_CLOSURE(value);
+        ObjBoundMethod* bound   = newBoundMethod(value, closure);
 
-        // patch the function to reenter the VM, instead of returning
-        bound->method->function->chunk.code[bound->method->function->chunk.count - 1] = OP_REENTER;
+        // patch the function to reenter the VM, instead of returning, once
+        // call() has compiled it if it was lazy
         call(bound->method, 0);
+        Chunk* chunk = &closure->function->chunk;
+        if (chunk->count > 0) {
+            chunk->code[chunk->count - 1] = OP_REENTER;
+        }
         run();
         return AS_CSTRING(pop());
     }
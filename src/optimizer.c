@@ -0,0 +1,3725 @@
+#include "optimizer.h"
+
+#include "memory.h"
+#include "native/native.h"
+#include "object.h"
+#include "vm.h"
+#include <math.h>
+
+// The optimizer decodes a chunk into a flat list of instructions whose
+// jumps refer to other instructions by index rather than by byte offset.
+// A block starts at every instruction flagged as a leader and runs up to
+// the next one. Passes rewrite or delete instructions in place, the graph
+// is compacted between passes, and the result is encoded back into the
+// chunk with fresh offsets and line information once nothing changes.
+
+#define MAX_ROUNDS 8
+
+typedef struct {
+    uint8_t  op;
+    int      line;
+    int      source;
+    int      length;
+    int      argCount;
+    uint32_t args[4];
+    int      target;
+    int*     cases;
+    int      caseCount;
+    bool     isLong;
+    bool     isTarget;
+    bool     isLeader;
+    bool     isDead;
+    bool     isInlined; // part of a body inlineCalls() copied in
+} Instruction;
+
+typedef struct {
+    Chunk*       chunk;
+    Instruction* code;
+    int          count;
+    int          capacity;
+    bool         shortJumps;
+    Table*       knownGlobals;
+    int          arity;
+} FlowGraph;
+
+typedef bool (*OptimizerPass)(FlowGraph* graph);
+
+static int internConstant(FlowGraph* graph, Value value);
+
+// The two opcodes a superinstruction stands for.
+static bool splitSuperinstruction(uint8_t op, uint8_t* first, uint8_t* second)
+{
+    switch (op) {
+#define SUPERINSTRUCTION(a, b, operands) \
+    case OP_##a##__##b:                  \
+        *first  = OP_##a;                \
+        *second = OP_##b;                \
+        return true;
+#include "superinstructions.def"
+#undef SUPERINSTRUCTION
+    default:
+        return false;
+    }
+}
+
+static int shortOperands(uint8_t op)
+{
+    switch (op) {
+    case OP_CONSTANT:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_DEFINE_CONSTANT:
+    case OP_SET_GLOBAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+    case OP_GET_SUPER:
+    case OP_SET_TABLE:
+    case OP_SET_ARRAY:
+    case OP_FORMAT:
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_LOOP:
+    case OP_CALL:
+    case OP_CALL_BLIND:
+    case OP_CLASS:
+    case OP_METHOD:
+    case OP_INCREMENT_LOCAL:
+        return 1;
+    case OP_GET_LOCAL_2:
+    case OP_SET_LOCAL_2:
+    case OP_GET_GLOBAL_2:
+    case OP_INVOKE:
+    case OP_SUPER_INVOKE:
+    case OP_GET_HOISTED:
+        return 2;
+    case OP_GET_LOCAL_3:
+    case OP_SET_LOCAL_3:
+    case OP_GET_GLOBAL_3:
+    case OP_INLINE:
+    case OP_NATIVE_CONSTANT:
+        return 3;
+    case OP_GET_LOCAL_4:
+    case OP_SET_LOCAL_4:
+    case OP_GET_GLOBAL_4:
+        return 4;
+    default: {
+        uint8_t first, second;
+        if (splitSuperinstruction(op, &first, &second))
+            return shortOperands(first) + shortOperands(second);
+        return 0;
+    }
+    }
+}
+
+// Whether operand `index` of `op` is a constant pool index.
+static bool isConstantOperand(uint8_t op, int index)
+{
+    switch (op) {
+    case OP_CONSTANT:
+    case OP_DEFINE_GLOBAL:
+    case OP_DEFINE_CONSTANT:
+    case OP_SET_GLOBAL:
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+    case OP_GET_SUPER:
+    case OP_INVOKE:
+    case OP_SUPER_INVOKE:
+    case OP_CLOSURE:
+    case OP_CLASS:
+    case OP_METHOD:
+        return index == 0;
+    case OP_GET_GLOBAL:
+    case OP_GET_GLOBAL_2:
+    case OP_GET_GLOBAL_3:
+    case OP_GET_GLOBAL_4:
+        return true;
+    case OP_LESS_LOCAL_CONST:
+    case OP_FOR_STEP_CONST:
+    case OP_INLINE:
+    case OP_NATIVE_CONSTANT:
+        return index == 1;
+    case OP_SWITCH_TABLE:
+        return index == 0;
+    default: {
+        uint8_t first, second;
+        if (!splitSuperinstruction(op, &first, &second))
+            return false;
+        if (index < shortOperands(first))
+            return isConstantOperand(first, index);
+        return isConstantOperand(second, index - shortOperands(first));
+    }
+    }
+}
+
+// Compact operand forms are only picked while encoding, the passes always
+// work on the wide form they stand for.
+static uint8_t wideForm(uint8_t op)
+{
+    switch (op) {
+    case OP_CONSTANT_BYTE:
+        return OP_CONSTANT;
+    case OP_GET_LOCAL_BYTE:
+        return OP_GET_LOCAL;
+    case OP_SET_LOCAL_BYTE:
+        return OP_SET_LOCAL;
+    case OP_GET_GLOBAL_BYTE:
+        return OP_GET_GLOBAL;
+    case OP_SET_GLOBAL_BYTE:
+        return OP_SET_GLOBAL;
+    case OP_GET_UPVALUE_BYTE:
+        return OP_GET_UPVALUE;
+    case OP_SET_UPVALUE_BYTE:
+        return OP_SET_UPVALUE;
+    case OP_CALL_BYTE:
+        return OP_CALL;
+    default:
+        return op;
+    }
+}
+
+static bool isByteForm(uint8_t op)
+{
+    return op == OP_PUSH_BYTE || wideForm(op) != op;
+}
+
+static bool isForStep(uint8_t op)
+{
+    return op == OP_FOR_STEP || op == OP_FOR_STEP_CONST;
+}
+
+static bool isJump(Instruction* instruction)
+{
+    return instruction->target != -1;
+}
+
+static bool endsBlock(Instruction* instruction)
+{
+    return isJump(instruction) || instruction->op == OP_RETURN || instruction->op == OP_REENTER;
+}
+
+// Whether control never falls through to the next instruction.
+static bool isTerminator(uint8_t op)
+{
+    return op == OP_JUMP || op == OP_SWITCH_TABLE || op == OP_RETURN || op == OP_REENTER;
+}
+
+// The jump operand of a jump is kept in `target`, not in `args`.
+static int encodedLength(Instruction* instruction)
+{
+    switch (instruction->op) {
+    case OP_CLOSURE:
+        return instruction->length;
+    case OP_POP_N:
+    case OP_PEEK:
+        return 2;
+    case OP_CONSTANT:
+        return instruction->args[0] > UINT16_MAX ? 5 : 3;
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+        return instruction->isLong ? 5 : 3;
+    case OP_LESS_LOCAL:
+    case OP_LESS_LOCAL_CONST:
+        // followed by the JUMP_IF_FALSE and POP of the condition
+        return 5 + 3 + 1;
+    case OP_FOR_STEP:
+    case OP_FOR_STEP_CONST:
+    case OP_INLINE:
+    case OP_NATIVE_CONSTANT:
+        return 7;
+    case OP_GET_HOISTED:
+        return 5;
+    case OP_SWITCH_TABLE:
+        return 7 + instruction->caseCount * 2;
+    default:
+        if (isByteForm(instruction->op))
+            return 2;
+        return 1 + instruction->argCount * 2;
+    }
+}
+
+static void appendInstruction(FlowGraph* graph, Instruction instruction)
+{
+    if (graph->capacity < graph->count + 1) {
+        int oldCapacity = graph->capacity;
+        graph->capacity = GROW_CAPACITY(oldCapacity);
+        graph->code     = GROW_ARRAY(Instruction, graph->code, oldCapacity, graph->capacity);
+    }
+
+    graph->code[graph->count++] = instruction;
+}
+
+static void freeGraph(FlowGraph* graph)
+{
+    for (int i = 0; i < graph->count; i++) {
+        FREE_ARRAY(int, graph->code[i].cases, graph->code[i].caseCount);
+    }
+    FREE_ARRAY(Instruction, graph->code, graph->capacity);
+    graph->code     = NULL;
+    graph->count    = 0;
+    graph->capacity = 0;
+}
+
+static bool decodeChunk(FlowGraph* graph, Chunk* chunk)
+{
+    graph->chunk        = chunk;
+    graph->code         = NULL;
+    graph->count        = 0;
+    graph->capacity     = 0;
+    graph->knownGlobals = NULL;
+    graph->arity        = 0;
+
+    int* indexAt = ALLOCATE(int, chunk->count + 1);
+    for (int i = 0; i <= chunk->count; i++) {
+        indexAt[i] = -1;
+    }
+
+    uint8_t* code   = chunk->code;
+    bool     valid  = true;
+    int      offset = 0;
+    while (offset < chunk->count) {
+        Instruction instruction = {
+            .op       = code[offset],
+            .line      = getLine(chunk, offset),
+            .source    = offset,
+            .target    = -1,
+            .isLong    = false,
+            .isTarget  = false,
+            .isLeader  = false,
+            .isDead    = false,
+            .isInlined = isInlinedCode(chunk, offset),
+        };
+
+        switch (instruction.op) {
+        case OP_POP_N:
+        case OP_PEEK:
+            instruction.argCount = 1;
+            instruction.length   = 2;
+            if (offset + 1 < chunk->count)
+                instruction.args[0] = code[offset + 1];
+            break;
+        case OP_CONSTANT_BYTE:
+        case OP_GET_LOCAL_BYTE:
+        case OP_SET_LOCAL_BYTE:
+        case OP_GET_GLOBAL_BYTE:
+        case OP_SET_GLOBAL_BYTE:
+        case OP_GET_UPVALUE_BYTE:
+        case OP_SET_UPVALUE_BYTE:
+        case OP_CALL_BYTE:
+        case OP_PUSH_BYTE:
+            instruction.argCount = 1;
+            instruction.length   = 2;
+            if (offset + 1 >= chunk->count) {
+                valid = false;
+                break;
+            }
+            if (instruction.op == OP_PUSH_BYTE) {
+                instruction.args[0] = (uint16_t)internConstant(graph, NUMBER_VAL(code[offset + 1]));
+                instruction.op      = OP_CONSTANT;
+            } else {
+                instruction.args[0] = code[offset + 1];
+                instruction.op      = wideForm(instruction.op);
+            }
+            break;
+        case OP_CONSTANT_LONG:
+        case OP_JUMP_LONG:
+        case OP_JUMP_IF_FALSE_LONG:
+        case OP_LOOP_LONG:
+            if (offset + 4 >= chunk->count) {
+                valid = false;
+                break;
+            }
+            instruction.argCount = 1;
+            instruction.length   = 5;
+            instruction.args[0]  = ((uint32_t)code[offset + 1] << 24) | ((uint32_t)code[offset + 2] << 16)
+                | ((uint32_t)code[offset + 3] << 8) | code[offset + 4];
+            if (instruction.op == OP_CONSTANT_LONG)
+                instruction.op = OP_CONSTANT;
+            break;
+        case OP_LOAD_LOCAL_0:
+        case OP_LOAD_LOCAL_1:
+        case OP_LOAD_LOCAL_2:
+        case OP_LOAD_LOCAL_3:
+            instruction.argCount = 1;
+            instruction.length   = 1;
+            instruction.args[0]  = instruction.op - OP_LOAD_LOCAL_0;
+            instruction.op       = OP_GET_LOCAL;
+            break;
+        case OP_LOAD_CONSTANT_0:
+        case OP_LOAD_CONSTANT_1:
+        case OP_LOAD_CONSTANT_2:
+        case OP_LOAD_CONSTANT_3:
+            instruction.argCount = 1;
+            instruction.length   = 1;
+            instruction.args[0]  = instruction.op - OP_LOAD_CONSTANT_0;
+            instruction.op       = OP_CONSTANT;
+            break;
+        case OP_LESS_LOCAL:
+        case OP_LESS_LOCAL_CONST:
+        case OP_FOR_STEP:
+        case OP_FOR_STEP_CONST:
+            // already optimized code, e.g. a body decoded again for
+            // inlining; the jump offset is the third operand
+            instruction.argCount = 3;
+            instruction.length   = encodedLength(&instruction);
+            if (offset + instruction.length > chunk->count) {
+                valid = false;
+                break;
+            }
+            if (instruction.op == OP_LESS_LOCAL || instruction.op == OP_LESS_LOCAL_CONST) {
+                if (code[offset + 5] != OP_JUMP_IF_FALSE || code[offset + 8] != OP_POP) {
+                    valid = false;
+                    break;
+                }
+                instruction.args[2] = (uint16_t)(code[offset + 6] << 8) | code[offset + 7];
+            } else {
+                instruction.args[2] = (uint16_t)(code[offset + 5] << 8) | code[offset + 6];
+            }
+            instruction.args[0] = (uint16_t)(code[offset + 1] << 8) | code[offset + 2];
+            instruction.args[1] = (uint16_t)(code[offset + 3] << 8) | code[offset + 4];
+            break;
+        case OP_SWITCH_TABLE: {
+            if (offset + 4 >= chunk->count) {
+                valid = false;
+                break;
+            }
+            instruction.argCount  = 1;
+            instruction.args[0]   = (uint16_t)(code[offset + 1] << 8) | code[offset + 2];
+            instruction.caseCount = (code[offset + 3] << 8) | code[offset + 4];
+            instruction.length    = 7 + instruction.caseCount * 2;
+            // checked before allocating, the cases are only freed with the graph
+            if (offset + instruction.length > chunk->count) {
+                valid = false;
+                break;
+            }
+            instruction.cases = ALLOCATE(int, instruction.caseCount);
+            break;
+        }
+        case OP_CLOSURE: {
+            if (offset + 2 >= chunk->count) {
+                valid = false;
+                break;
+            }
+            uint16_t constant = (uint16_t)(code[offset + 1] << 8) | code[offset + 2];
+            if (constant >= chunk->constants.count || !IS_FUNCTION(chunk->constants.values[constant])) {
+                valid = false;
+                break;
+            }
+            ObjFunction* function = AS_FUNCTION(chunk->constants.values[constant]);
+            instruction.argCount  = 1;
+            instruction.args[0]   = constant;
+            instruction.length    = 3 + function->upvalueCount * 3;
+            break;
+        }
+        default:
+            instruction.argCount = shortOperands(instruction.op);
+            instruction.length   = 1 + instruction.argCount * 2;
+            for (int i = 0; i < instruction.argCount && offset + 2 + i * 2 < chunk->count; i++) {
+                instruction.args[i] = (uint16_t)(code[offset + 1 + i * 2] << 8) | code[offset + 2 + i * 2];
+            }
+            break;
+        }
+
+        if (!valid || offset + instruction.length > chunk->count) {
+            valid = false;
+            break;
+        }
+
+        indexAt[offset] = graph->count;
+        appendInstruction(graph, instruction);
+        offset += instruction.length;
+    }
+    indexAt[chunk->count] = graph->count;
+
+    for (int i = 0; valid && i < graph->count; i++) {
+        Instruction* instruction = &graph->code[i];
+        int64_t      target;
+
+        switch (instruction->op) {
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+            target = instruction->source + 3 + instruction->args[0];
+            break;
+        case OP_LOOP:
+            // loops are plain jumps in the graph, the direction is picked
+            // again when the chunk is encoded
+            target          = instruction->source + 3 - instruction->args[0];
+            instruction->op = OP_JUMP;
+            break;
+        case OP_JUMP_LONG:
+        case OP_JUMP_IF_FALSE_LONG:
+        case OP_LOOP_LONG:
+            // so is the width, long forms are only kept where needed
+            if (instruction->op == OP_LOOP_LONG)
+                target = instruction->source + 5 - (int64_t)instruction->args[0];
+            else
+                target = instruction->source + 5 + (int64_t)instruction->args[0];
+            instruction->op = instruction->op == OP_JUMP_IF_FALSE_LONG ? OP_JUMP_IF_FALSE : OP_JUMP;
+            break;
+        case OP_SWITCH_TABLE: {
+            // every offset counts from the end of the jump array, the
+            // first one is the default
+            int      base  = instruction->source + instruction->length;
+            uint8_t* jumps = &code[instruction->source + 5];
+            for (int j = 0; valid && j < instruction->caseCount; j++) {
+                int caseTarget = base + ((jumps[2 + j * 2] << 8) | jumps[3 + j * 2]);
+                if (caseTarget > chunk->count || indexAt[caseTarget] == -1)
+                    valid = false;
+                else
+                    instruction->cases[j] = indexAt[caseTarget];
+            }
+            target = base + ((jumps[0] << 8) | jumps[1]);
+            break;
+        }
+        case OP_INLINE:
+        case OP_NATIVE_CONSTANT:
+            target = instruction->source + 7 + instruction->args[2];
+            break;
+        case OP_GET_HOISTED:
+            target = instruction->source + 5 + instruction->args[1];
+            break;
+        case OP_LESS_LOCAL:
+        case OP_LESS_LOCAL_CONST:
+            target = instruction->source + 8 + instruction->args[2];
+            break;
+        case OP_FOR_STEP:
+        case OP_FOR_STEP_CONST:
+            target = instruction->source + 7 - (int64_t)instruction->args[2];
+            break;
+        default:
+            continue;
+        }
+
+        if (!valid || target < 0 || target > chunk->count || indexAt[target] == -1) {
+            valid = false;
+            break;
+        }
+
+        instruction->target = indexAt[target];
+        if (instruction->op == OP_INLINE || instruction->op == OP_NATIVE_CONSTANT || instruction->op == OP_LESS_LOCAL
+            || instruction->op == OP_LESS_LOCAL_CONST || isForStep(instruction->op))
+            instruction->argCount = 2;
+        else if (instruction->op == OP_GET_HOISTED)
+            instruction->argCount = 1;
+        else if (instruction->op != OP_SWITCH_TABLE)
+            instruction->argCount = 0;
+    }
+
+    FREE_ARRAY(int, indexAt, chunk->count + 1);
+
+    if (!valid)
+        freeGraph(graph);
+
+    return valid;
+}
+
+static void findLeaders(FlowGraph* graph)
+{
+    for (int i = 0; i < graph->count; i++) {
+        graph->code[i].isLeader = i == 0;
+        graph->code[i].isTarget = false;
+    }
+
+    for (int i = 0; i < graph->count; i++) {
+        Instruction* instruction = &graph->code[i];
+        if (isJump(instruction) && instruction->target < graph->count) {
+            graph->code[instruction->target].isLeader = true;
+            graph->code[instruction->target].isTarget = true;
+        }
+        for (int j = 0; j < instruction->caseCount; j++) {
+            if (instruction->cases[j] < graph->count) {
+                graph->code[instruction->cases[j]].isLeader = true;
+                graph->code[instruction->cases[j]].isTarget = true;
+            }
+        }
+        if (endsBlock(instruction) && i + 1 < graph->count)
+            graph->code[i + 1].isLeader = true;
+    }
+}
+
+// Drops dead instructions. A jump to a deleted instruction lands on the
+// next live one, passes only delete jump targets when that is correct.
+static void compact(FlowGraph* graph)
+{
+    int* newIndex = ALLOCATE(int, graph->count + 1);
+
+    int live = 0;
+    for (int i = 0; i < graph->count; i++) {
+        newIndex[i] = live;
+        if (!graph->code[i].isDead)
+            graph->code[live++] = graph->code[i];
+        else
+            FREE_ARRAY(int, graph->code[i].cases, graph->code[i].caseCount);
+    }
+    newIndex[graph->count] = live;
+
+    for (int i = 0; i < live; i++) {
+        Instruction* instruction = &graph->code[i];
+        if (instruction->target != -1)
+            instruction->target = newIndex[instruction->target];
+        for (int j = 0; j < instruction->caseCount; j++) {
+            instruction->cases[j] = newIndex[instruction->cases[j]];
+        }
+    }
+
+    FREE_ARRAY(int, newIndex, graph->count + 1);
+    graph->count = live;
+}
+
+// Inserts `instruction` before `index`, jumps to the old instruction there
+// keep pointing at it.
+static void insertInstruction(FlowGraph* graph, int index, Instruction instruction)
+{
+    appendInstruction(graph, instruction);
+    memmove(&graph->code[index + 1], &graph->code[index], sizeof(Instruction) * (graph->count - 1 - index));
+    graph->code[index] = instruction;
+
+    for (int i = 0; i < graph->count; i++) {
+        Instruction* other = &graph->code[i];
+        if (other->target >= index)
+            other->target++;
+        for (int j = 0; j < other->caseCount; j++) {
+            if (other->cases[j] >= index)
+                other->cases[j]++;
+        }
+    }
+}
+
+// Whether instruction `index` exists and can be merged into the one
+// before it, i.e. nothing jumps between the two.
+static bool follows(FlowGraph* graph, int index, uint8_t op)
+{
+    return index < graph->count
+        && !graph->code[index].isLeader
+        && !graph->code[index].isDead
+        && graph->code[index].op == op;
+}
+
+static bool constantValue(FlowGraph* graph, Instruction* instruction, Value* value)
+{
+    switch (instruction->op) {
+    case OP_CONSTANT:
+        *value = graph->chunk->constants.values[instruction->args[0]];
+        return true;
+    case OP_NIL:
+        *value = NIL_VAL;
+        return true;
+    case OP_TRUE:
+        *value = BOOL_VAL(true);
+        return true;
+    case OP_FALSE:
+        *value = BOOL_VAL(false);
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool isFalseyConstant(Value value)
+{
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+// Returns the pool index of `value`, reusing an identical entry if there
+// is one. Numbers are compared bit for bit so 0 and -0 stay apart.
+static int internConstant(FlowGraph* graph, Value value)
+{
+    ValueArray* constants = &graph->chunk->constants;
+    for (unsigned int i = 0; i < constants->count; i++) {
+        Value existing = constants->values[i];
+        if (IS_NUMBER(value) && IS_NUMBER(existing)) {
+            double a = AS_NUMBER(value);
+            double b = AS_NUMBER(existing);
+            if (memcmp(&a, &b, sizeof(double)) == 0)
+                return i;
+        } else if ((IS_STRING(value) || IS_FUNCTION(value)) && IS_OBJ(existing) && AS_OBJ(value) == AS_OBJ(existing)) {
+            return i;
+        }
+    }
+
+    return addConstant(graph->chunk, value);
+}
+
+// Turns `instruction` into one that pushes `value`.
+static bool loadConstant(FlowGraph* graph, Instruction* instruction, Value value)
+{
+    if (IS_NIL(value)) {
+        instruction->op = OP_NIL;
+    } else if (IS_BOOL(value)) {
+        instruction->op = AS_BOOL(value) ? OP_TRUE : OP_FALSE;
+    } else {
+        int constant = internConstant(graph, value);
+        if (constant > UINT16_MAX)
+            return false;
+        instruction->op      = OP_CONSTANT;
+        instruction->args[0] = (uint16_t)constant;
+    }
+
+    instruction->argCount = instruction->op == OP_CONSTANT ? 1 : 0;
+    return true;
+}
+
+static bool foldBinary(uint8_t op, Value a, Value b, Value* result)
+{
+    if (op == OP_EQUAL || op == OP_NOT_EQUAL) {
+        bool equal = valuesEqual(a, b);
+        *result    = BOOL_VAL(op == OP_EQUAL ? equal : !equal);
+        return true;
+    }
+
+    if (op == OP_ADD && IS_STRING(a) && IS_STRING(b)) {
+        ObjString* left   = AS_STRING(a);
+        ObjString* right  = AS_STRING(b);
+        int        length = left->length + right->length;
+        char*      chars  = ALLOCATE(char, length + 1);
+        memcpy(chars, left->chars, left->length);
+        memcpy(chars + left->length, right->chars, right->length);
+        chars[length] = '\0';
+        *result       = OBJ_VAL(takeString(chars, length));
+        return true;
+    }
+
+    if (!IS_NUMBER(a) || !IS_NUMBER(b))
+        return false;
+
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+    int    n = (int)y;
+
+    switch (op) {
+    case OP_ADD:
+        *result = NUMBER_VAL(x + y);
+        return true;
+    case OP_SUBTRACT:
+        *result = NUMBER_VAL(x - y);
+        return true;
+    case OP_MULTIPLY:
+        *result = NUMBER_VAL(x * y);
+        return true;
+    case OP_DIVIDE:
+        *result = NUMBER_VAL(x / y);
+        return true;
+    case OP_MODULO:
+        if (n == 0)
+            return false;
+        *result = NUMBER_VAL((int)x % n);
+        return true;
+    case OP_BITWISE_AND:
+        *result = NUMBER_VAL((int)x & n);
+        return true;
+    case OP_BITWISE_OR:
+        *result = NUMBER_VAL((int)x | n);
+        return true;
+    case OP_BITWISE_XOR:
+        *result = NUMBER_VAL((int)x ^ n);
+        return true;
+    case OP_SHIFT_LEFT:
+        if (n < 0 || n > 31)
+            return false;
+        *result = NUMBER_VAL((int)x << n);
+        return true;
+    case OP_SHIFT_RIGHT:
+        if (n < 0 || n > 31)
+            return false;
+        *result = NUMBER_VAL((int)x >> n);
+        return true;
+    case OP_LESS:
+        *result = BOOL_VAL(x < y);
+        return true;
+    case OP_GREATER:
+        *result = BOOL_VAL(x > y);
+        return true;
+    case OP_LESS_EQUAL:
+        *result = BOOL_VAL(x <= y);
+        return true;
+    case OP_GREATER_EQUAL:
+        *result = BOOL_VAL(x >= y);
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool foldConstants(FlowGraph* graph)
+{
+    bool changed = false;
+
+    for (int i = 0; i + 1 < graph->count; i++) {
+        Instruction* left = &graph->code[i];
+        Value        a, b, result;
+        if (left->isDead || !constantValue(graph, left, &a))
+            continue;
+
+        // unary operators on a constant
+        Instruction* next = &graph->code[i + 1];
+        if (!next->isLeader && (next->op == OP_NOT || (next->op == OP_NEGATE && IS_NUMBER(a)))) {
+            result = next->op == OP_NOT ? BOOL_VAL(isFalseyConstant(a)) : NUMBER_VAL(-AS_NUMBER(a));
+            if (loadConstant(graph, left, result)) {
+                next->isDead = true;
+                changed      = true;
+            }
+            continue;
+        }
+
+        if (i + 2 >= graph->count || next->isLeader || !constantValue(graph, next, &b))
+            continue;
+
+        Instruction* operation = &graph->code[i + 2];
+        if (operation->isLeader || !foldBinary(operation->op, a, b, &result))
+            continue;
+
+        // keep a folded string reachable while the pool grows
+        lockHeap();
+        push(result);
+        bool folded = loadConstant(graph, left, result);
+        pop();
+        unlockHeap();
+
+        if (folded) {
+            next->isDead      = true;
+            operation->isDead = true;
+            changed           = true;
+        }
+    }
+
+    return changed;
+}
+
+#define MAX_EVALUATED 16
+
+// The values evaluateConstant() works on. It runs while imports compile on
+// other threads, so it keeps its own stack instead of the VM's; the
+// collector marks it, see markOptimizerRoots().
+static _Thread_local Value evaluated[MAX_EVALUATED];
+static _Thread_local int   evaluatedCount = 0;
+
+// Evaluates the code a `const` initializer compiled to, from `start` to the
+// end of `chunk`, when it only loads constants and applies operators that
+// fold. The result stays reachable until the next evaluation.
+bool evaluateConstant(Chunk* chunk, int start, Value* value)
+{
+    Value* stack  = evaluated;
+    int    depth  = 0;
+    bool   folded = true;
+    evaluatedCount = 0;
+
+    for (int offset = start; folded && offset < chunk->count;) {
+        uint8_t op = chunk->code[offset];
+        Value   result;
+
+        switch (op) {
+        case OP_CONSTANT:
+            stack[depth++] = chunk->constants.values[(chunk->code[offset + 1] << 8) | chunk->code[offset + 2]];
+            offset += 3;
+            break;
+        case OP_CONSTANT_LONG:
+            stack[depth++] = chunk->constants.values[((uint32_t)chunk->code[offset + 1] << 24)
+                | (chunk->code[offset + 2] << 16) | (chunk->code[offset + 3] << 8) | chunk->code[offset + 4]];
+            offset += 5;
+            break;
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+            stack[depth++] = op == OP_NIL ? NIL_VAL : BOOL_VAL(op == OP_TRUE);
+            offset++;
+            break;
+        case OP_NOT:
+        case OP_NEGATE:
+            if (depth == 0 || (op == OP_NEGATE && !IS_NUMBER(stack[depth - 1]))) {
+                folded = false;
+                break;
+            }
+            stack[depth - 1] = op == OP_NOT ? BOOL_VAL(isFalseyConstant(stack[depth - 1]))
+                                            : NUMBER_VAL(-AS_NUMBER(stack[depth - 1]));
+            offset++;
+            break;
+        default:
+            if (depth < 2 || !foldBinary(op, stack[depth - 2], stack[depth - 1], &result)) {
+                folded = false;
+                break;
+            }
+            stack[depth - 2] = result;
+            depth--;
+            offset++;
+            break;
+        }
+
+        evaluatedCount = depth;
+        if (depth == MAX_EVALUATED)
+            folded = false;
+    }
+
+    folded         = folded && depth == 1;
+    evaluatedCount = folded ? 1 : 0;
+    if (folded)
+        *value = stack[0];
+    return folded;
+}
+
+void markOptimizerRoots(void)
+{
+    for (int i = 0; i < evaluatedCount; i++) {
+        markValue(evaluated[i]);
+    }
+}
+
+// A conditional jump right after a constant always goes the same way:
+// `false && x` jumps straight past `x` and `true && x` never jumps.
+static bool foldBranches(FlowGraph* graph)
+{
+    bool changed = false;
+
+    for (int i = 0; i + 1 < graph->count; i++) {
+        Instruction* jump = &graph->code[i + 1];
+        Value        value;
+        if (jump->op != OP_JUMP_IF_FALSE || jump->isLeader || graph->code[i].isDead
+            || !constantValue(graph, &graph->code[i], &value))
+            continue;
+
+        if (isFalseyConstant(value))
+            jump->op = OP_JUMP;
+        else
+            jump->isDead = true;
+        changed = true;
+    }
+
+    return changed;
+}
+
+// Drops constants that are pushed only to be popped again, which is what
+// the folded branches above leave behind.
+static bool dropUnusedConstants(FlowGraph* graph)
+{
+    bool changed = false;
+
+    for (int i = 0; i + 1 < graph->count; i++) {
+        Instruction* load = &graph->code[i];
+        Instruction* pop  = &graph->code[i + 1];
+        Value        value;
+        if (load->isDead || pop->isLeader || !constantValue(graph, load, &value))
+            continue;
+
+        if (pop->op == OP_POP || (pop->op == OP_POP_N && pop->args[0] == 1)) {
+            load->isDead = true;
+            pop->isDead  = true;
+            changed      = true;
+        } else if (pop->op == OP_POP_N) {
+            load->isDead = true;
+            pop->args[0]--;
+            changed = true;
+        }
+    }
+
+    return changed;
+}
+
+// The instruction at `index` if it only runs straight after the one
+// before it, NULL otherwise.
+static Instruction* joined(FlowGraph* graph, int index)
+{
+    if (index >= graph->count || graph->code[index].isLeader || graph->code[index].isDead)
+        return NULL;
+    return &graph->code[index];
+}
+
+// Like joined() but also allows the instruction after a conditional jump,
+// as long as nothing else jumps to it.
+static Instruction* fallthrough(FlowGraph* graph, int index)
+{
+    if (index >= graph->count || graph->code[index].isTarget || graph->code[index].isDead)
+        return NULL;
+    return &graph->code[index];
+}
+
+// The local slots an instruction reads and writes. Reads happen before
+// writes, INCREMENT_LOCAL and FOR_STEP do both to their first slot.
+typedef struct {
+    int      count;
+    uint32_t slots[4];
+    bool     reads[4];
+    bool     writes[4];
+} LocalAccess;
+
+static LocalAccess localAccess(Instruction* instruction)
+{
+    LocalAccess access = { 0 };
+
+    switch (instruction->op) {
+    case OP_GET_LOCAL:
+    case OP_GET_LOCAL_2:
+    case OP_GET_LOCAL_3:
+    case OP_GET_LOCAL_4:
+    case OP_SET_LOCAL:
+    case OP_SET_LOCAL_2:
+    case OP_SET_LOCAL_3:
+    case OP_SET_LOCAL_4: {
+        bool get = instruction->op == OP_GET_LOCAL || instruction->op == OP_GET_LOCAL_2
+            || instruction->op == OP_GET_LOCAL_3 || instruction->op == OP_GET_LOCAL_4;
+        access.count = instruction->argCount;
+        for (int i = 0; i < access.count; i++) {
+            access.slots[i]  = instruction->args[i];
+            access.reads[i]  = get;
+            access.writes[i] = !get;
+        }
+        break;
+    }
+    case OP_LESS_LOCAL:
+    case OP_FOR_STEP:
+        access.count    = 2;
+        access.slots[0] = instruction->args[0];
+        access.slots[1] = instruction->args[1];
+        access.reads[0] = access.reads[1] = true;
+        access.writes[0]                  = instruction->op == OP_FOR_STEP;
+        break;
+    case OP_LESS_LOCAL_CONST:
+    case OP_INCREMENT_LOCAL:
+    case OP_FOR_STEP_CONST:
+        access.count     = 1;
+        access.slots[0]  = instruction->args[0];
+        access.reads[0]  = true;
+        access.writes[0] = instruction->op != OP_LESS_LOCAL_CONST;
+        break;
+    case OP_GET_HOISTED:
+        access.count    = 1;
+        access.slots[0] = instruction->args[0];
+        access.reads[0] = true;
+        break;
+    default:
+        break;
+    }
+
+    return access;
+}
+
+// Marks the local slots some closure in the chunk captures. A captured
+// slot can change whenever anything is called, so the passes below leave
+// it alone. Returns the number of slots the chunk touches.
+static int findCaptured(FlowGraph* graph, bool** captured)
+{
+    uint8_t* code  = graph->chunk->code;
+    int      slots = 0;
+
+    for (int i = 0; i < graph->count; i++) {
+        Instruction* instruction = &graph->code[i];
+        LocalAccess  access      = localAccess(instruction);
+        for (int j = 0; j < access.count; j++) {
+            if ((int)access.slots[j] >= slots)
+                slots = access.slots[j] + 1;
+        }
+    }
+
+    *captured = ALLOCATE(bool, slots + 1);
+    for (int i = 0; i <= slots; i++) {
+        (*captured)[i] = false;
+    }
+
+    for (int i = 0; i < graph->count; i++) {
+        Instruction* instruction = &graph->code[i];
+        if (instruction->isDead || instruction->op != OP_CLOSURE)
+            continue;
+
+        ObjFunction* function = AS_FUNCTION(graph->chunk->constants.values[instruction->args[0]]);
+        for (int k = 0; k < function->upvalueCount; k++) {
+            uint8_t* descriptor = &code[instruction->source + 3 + k * 3];
+            int      index      = (descriptor[1] << 8) | descriptor[2];
+            if (descriptor[0] && index < slots)
+                (*captured)[index] = true;
+        }
+    }
+
+    return slots;
+}
+
+typedef enum {
+    FACT_NONE,
+    FACT_CONSTANT,
+    FACT_COPY,
+} FactKind;
+
+typedef struct {
+    FactKind kind;
+    Value    value;
+    uint32_t slot;
+} LocalFact;
+
+// Forgets what is known about `slot` and about every copy of it.
+static void killFact(LocalFact* facts, int slots, uint32_t slot)
+{
+    facts[slot].kind = FACT_NONE;
+    for (int i = 0; i < slots; i++) {
+        if (facts[i].kind == FACT_COPY && facts[i].slot == slot)
+            facts[i].kind = FACT_NONE;
+    }
+}
+
+static void killFacts(LocalFact* facts, int from, int slots)
+{
+    for (int i = from; i < slots; i++) {
+        facts[i].kind = FACT_NONE;
+    }
+}
+
+// Constant and copy propagation within a block. After
+//   CONSTANT k, SET_LOCAL s   or   GET_LOCAL t, SET_LOCAL s
+// later reads of s load k or t instead, until either slot is written.
+// Popping a scope may hand its slots to new locals, so the facts go at
+// every pop other than the one ending an assignment statement, which
+// only drops the value the assignment left behind.
+static bool propagateLocals(FlowGraph* graph)
+{
+    bool* captured;
+    int   slots = findCaptured(graph, &captured);
+    if (slots == 0) {
+        FREE_ARRAY(bool, captured, 1);
+        return false;
+    }
+
+    LocalFact* facts   = ALLOCATE(LocalFact, slots);
+    bool       changed = false;
+    killFacts(facts, 0, slots);
+
+    for (int i = 0; i < graph->count; i++) {
+        Instruction* instruction = &graph->code[i];
+        if (instruction->isDead)
+            continue;
+        if (instruction->isLeader)
+            killFacts(facts, 0, slots);
+
+        Instruction* previous = i > 0 && !instruction->isLeader ? &graph->code[i - 1] : NULL;
+        if (previous != NULL && previous->isDead)
+            previous = NULL;
+
+        switch (instruction->op) {
+        case OP_GET_LOCAL: {
+            LocalFact* fact = &facts[instruction->args[0]];
+            if (fact->kind == FACT_CONSTANT && loadConstant(graph, instruction, fact->value)) {
+                changed = true;
+            } else if (fact->kind == FACT_COPY) {
+                instruction->args[0] = fact->slot;
+                changed              = true;
+            }
+            break;
+        }
+        case OP_SET_LOCAL: {
+            uint32_t slot = instruction->args[0];
+            Value    value;
+            killFact(facts, slots, slot);
+            if (captured[slot] || previous == NULL)
+                break;
+            if (constantValue(graph, previous, &value)) {
+                facts[slot].kind  = FACT_CONSTANT;
+                facts[slot].value = value;
+            } else if (previous->op == OP_GET_LOCAL && previous->args[0] != slot
+                && !captured[previous->args[0]]) {
+                facts[slot].kind = FACT_COPY;
+                facts[slot].slot = previous->args[0];
+            }
+            break;
+        }
+        case OP_POP:
+            if (previous != NULL && previous->op == OP_SET_LOCAL)
+                killFacts(facts, previous->args[0] + 1, slots);
+            else
+                killFacts(facts, 0, slots);
+            break;
+        case OP_POP_N:
+        case OP_CLOSE_UPVALUE:
+            killFacts(facts, 0, slots);
+            break;
+        default: {
+            LocalAccess access = localAccess(instruction);
+            for (int j = 0; j < access.count; j++) {
+                if (access.writes[j])
+                    killFact(facts, slots, access.slots[j]);
+            }
+            break;
+        }
+        }
+    }
+
+    FREE_ARRAY(LocalFact, facts, slots);
+    FREE_ARRAY(bool, captured, slots + 1);
+    return changed;
+}
+
+// Whether the value `SET_LOCAL slot` stores at `index` is overwritten
+// before anything in the same block reads it.
+static bool isDeadStore(FlowGraph* graph, int index, uint32_t slot)
+{
+    for (int i = index + 1; i < graph->count; i++) {
+        Instruction* instruction = &graph->code[i];
+        if (instruction->isDead)
+            continue;
+        if (instruction->isLeader || endsBlock(instruction) || isTerminator(instruction->op))
+            return false;
+
+        // the slot may belong to another local once its scope is popped
+        if (instruction->op == OP_POP_N || instruction->op == OP_CLOSE_UPVALUE)
+            return false;
+        if (instruction->op == OP_POP && graph->code[i - 1].op != OP_SET_LOCAL)
+            return false;
+
+        LocalAccess access = localAccess(instruction);
+        for (int j = 0; j < access.count; j++) {
+            if (access.slots[j] == slot && access.reads[j])
+                return false;
+        }
+        for (int j = 0; j < access.count; j++) {
+            if (access.slots[j] == slot && access.writes[j])
+                return true;
+        }
+    }
+
+    return false;
+}
+
+// Drops `SET_LOCAL s` from `SET_LOCAL s, POP` when s is written again
+// before it is read, leaving the value to be popped.
+static bool eliminateDeadStores(FlowGraph* graph)
+{
+    bool* captured;
+    int   slots   = findCaptured(graph, &captured);
+    bool  changed = false;
+
+    for (int i = 0; i + 1 < graph->count; i++) {
+        Instruction* store = &graph->code[i];
+        if (store->isDead || store->op != OP_SET_LOCAL || captured[store->args[0]])
+            continue;
+
+        Instruction* pop = joined(graph, i + 1);
+        if (pop == NULL || pop->op != OP_POP)
+            continue;
+
+        if (isDeadStore(graph, i + 1, store->args[0])) {
+            store->isDead = true;
+            changed       = true;
+        }
+    }
+
+    FREE_ARRAY(bool, captured, slots + 1);
+    return changed;
+}
+
+// What the passes below know about a value. Operators only run user code,
+// a dunder method, when both operands are instances, and only ADD makes a
+// new object, when neither operand is a number.
+typedef enum {
+    KIND_NUMBER,
+    KIND_PLAIN, // anything but an instance
+    KIND_ANY,
+} ValueKind;
+
+typedef struct {
+    uint8_t* kinds;
+    int      depth;
+    int      capacity;
+} KindStack;
+
+// The stack before each instruction: its depth, -1 where nothing reaches
+// the instruction, and at the start of each block the kind of every value
+// on it. Every path into a block must agree on the depth, or findShapes()
+// gives up on the function.
+typedef struct {
+    int*      depths;
+    uint8_t** kinds;
+    int       count;
+} StackShapes;
+
+static void pushKind(KindStack* stack, ValueKind kind)
+{
+    if (stack->capacity < stack->depth + 1) {
+        int oldCapacity = stack->capacity;
+        stack->capacity = GROW_CAPACITY(oldCapacity);
+        stack->kinds    = GROW_ARRAY(uint8_t, stack->kinds, oldCapacity, stack->capacity);
+    }
+    stack->kinds[stack->depth++] = (uint8_t)kind;
+}
+
+static bool popKinds(KindStack* stack, int count)
+{
+    if (count > stack->depth)
+        return false;
+    stack->depth -= count;
+    return true;
+}
+
+static void loadKinds(KindStack* stack, uint8_t* kinds, int depth)
+{
+    stack->depth = 0;
+    for (int i = 0; i < depth; i++) {
+        pushKind(stack, kinds[i]);
+    }
+}
+
+static void freeKinds(KindStack* stack)
+{
+    FREE_ARRAY(uint8_t, stack->kinds, stack->capacity);
+}
+
+// The kind of the value `distance` below the top of the stack.
+static ValueKind kindAt(KindStack* stack, int distance)
+{
+    return distance < stack->depth ? stack->kinds[stack->depth - 1 - distance] : KIND_ANY;
+}
+
+static ValueKind slotKind(KindStack* stack, uint32_t slot)
+{
+    return (int)slot < stack->depth ? stack->kinds[slot] : KIND_ANY;
+}
+
+static bool isOperator(uint8_t op)
+{
+    return op >= OP_EQUAL && op <= OP_SHIFT_RIGHT;
+}
+
+static ValueKind constantKind(FlowGraph* graph, uint32_t constant)
+{
+    return IS_NUMBER(graph->chunk->constants.values[constant]) ? KIND_NUMBER : KIND_PLAIN;
+}
+
+// The kind of what operator `op` leaves for operands of kinds `a` and `b`.
+static ValueKind operatorKind(uint8_t op, ValueKind a, ValueKind b)
+{
+    if (a == KIND_ANY && b == KIND_ANY)
+        return KIND_ANY;
+    if (op >= OP_EQUAL && op <= OP_LESS_EQUAL)
+        return KIND_PLAIN;
+    if (op == OP_ADD && a != KIND_NUMBER && b != KIND_NUMBER)
+        return KIND_PLAIN;
+    return KIND_NUMBER;
+}
+
+// Whether `instruction` may run user code, given the kinds on the stack
+// before it. Globals, upvalues, captured locals and the contents of any
+// object may change whenever it does.
+static bool runsUserCode(Instruction* instruction, KindStack* stack)
+{
+    switch (instruction->op) {
+    case OP_CALL:
+    case OP_CALL_BLIND:
+    case OP_INVOKE:
+    case OP_SUPER_INVOKE:
+    case OP_IMPORT:
+    case OP_INLINE:
+        return true;
+    case OP_NOT:
+        // NOT looks for a dunder on the two values on top, like the
+        // binary operators
+        return kindAt(stack, 0) == KIND_ANY && kindAt(stack, 1) == KIND_ANY;
+    case OP_LESS_LOCAL:
+        return slotKind(stack, instruction->args[0]) == KIND_ANY && slotKind(stack, instruction->args[1]) == KIND_ANY;
+    default:
+        return isOperator(instruction->op) && kindAt(stack, 0) == KIND_ANY && kindAt(stack, 1) == KIND_ANY;
+    }
+}
+
+// Applies `instruction` to the kinds on `stack`, along its jump if
+// `jumping`. Returns false for an instruction it doesn't know or one that
+// reaches below the stack.
+static bool stepKinds(FlowGraph* graph, Instruction* instruction, KindStack* stack, bool jumping)
+{
+    uint8_t op = instruction->op;
+
+    if (isOperator(op)) {
+        ValueKind a = kindAt(stack, 1);
+        ValueKind b = kindAt(stack, 0);
+        if (!popKinds(stack, 2))
+            return false;
+        pushKind(stack, operatorKind(op, a, b));
+        return true;
+    }
+
+    switch (op) {
+    case OP_CONSTANT:
+        pushKind(stack, constantKind(graph, instruction->args[0]));
+        return true;
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_CLOSURE:
+    case OP_CLASS:
+        pushKind(stack, KIND_PLAIN);
+        return true;
+    case OP_HOIST_SLOT:
+        // the empty value is never seen, the slot has the kind of what
+        // is stored in it
+        pushKind(stack, KIND_NUMBER);
+        return true;
+    case OP_GET_HOISTED:
+        if (instruction->args[0] >= (uint32_t)stack->depth)
+            return false;
+        if (jumping)
+            pushKind(stack, stack->kinds[instruction->args[0]]);
+        return true;
+    case OP_GET_LOCAL:
+    case OP_GET_LOCAL_2:
+    case OP_GET_LOCAL_3:
+    case OP_GET_LOCAL_4: {
+        int depth = stack->depth;
+        for (int i = 0; i < instruction->argCount; i++) {
+            if (instruction->args[i] >= (uint32_t)depth)
+                return false;
+            pushKind(stack, stack->kinds[instruction->args[i]]);
+        }
+        return true;
+    }
+    case OP_SET_LOCAL:
+    case OP_SET_LOCAL_2:
+    case OP_SET_LOCAL_3:
+    case OP_SET_LOCAL_4:
+        for (int i = 0; i < instruction->argCount; i++) {
+            if (stack->depth == 0 || instruction->args[i] >= (uint32_t)stack->depth)
+                return false;
+            stack->kinds[instruction->args[i]] = stack->kinds[stack->depth - 1];
+        }
+        return true;
+    case OP_INCREMENT_LOCAL:
+    case OP_FOR_STEP:
+    case OP_FOR_STEP_CONST:
+        if (instruction->args[0] >= (uint32_t)stack->depth)
+            return false;
+        stack->kinds[instruction->args[0]] = KIND_NUMBER;
+        return true;
+    case OP_LESS_LOCAL:
+    case OP_LESS_LOCAL_CONST:
+        // the condition is only left on the stack where the loop ends
+        if (jumping) {
+            bool user = runsUserCode(instruction, stack);
+            pushKind(stack, user ? KIND_ANY : KIND_PLAIN);
+        }
+        return true;
+    case OP_GET_GLOBAL:
+    case OP_GET_GLOBAL_2:
+    case OP_GET_GLOBAL_3:
+    case OP_GET_GLOBAL_4:
+        for (int i = 0; i < instruction->argCount; i++) {
+            pushKind(stack, KIND_ANY);
+        }
+        return true;
+    case OP_GET_UPVALUE:
+        pushKind(stack, KIND_ANY);
+        return true;
+    case OP_DUP:
+    case OP_PEEK: {
+        int distance = op == OP_DUP ? 0 : (int)instruction->args[0];
+        if (distance >= stack->depth)
+            return false;
+        pushKind(stack, kindAt(stack, distance));
+        return true;
+    }
+    case OP_SET_GLOBAL:
+    case OP_SET_UPVALUE:
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_SWITCH_TABLE:
+        return stack->depth > 0 || op == OP_JUMP;
+    case OP_POP:
+    case OP_DEFINE_GLOBAL:
+    case OP_DEFINE_CONSTANT:
+    case OP_CLOSE_UPVALUE:
+    case OP_DUMP:
+    case OP_INHERIT:
+    case OP_METHOD:
+    case OP_RETURN:
+    case OP_REENTER:
+        return popKinds(stack, 1);
+    case OP_POP_N:
+        return popKinds(stack, (int)instruction->args[0]);
+    case OP_CALL_BLIND:
+        return popKinds(stack, (int)instruction->args[0] + 1);
+    case OP_NOT: {
+        bool user = runsUserCode(instruction, stack);
+        if (!popKinds(stack, 1))
+            return false;
+        pushKind(stack, user ? KIND_ANY : KIND_PLAIN);
+        return true;
+    }
+    case OP_NEGATE:
+    case OP_INCREMENT:
+    case OP_DECREMENT:
+        if (!popKinds(stack, 1))
+            return false;
+        pushKind(stack, KIND_NUMBER);
+        return true;
+    case OP_GET_PROPERTY:
+    case OP_GET_SUPER:
+    case OP_IMPORT:
+        if (!popKinds(stack, 1))
+            return false;
+        pushKind(stack, KIND_ANY);
+        return true;
+    case OP_SET_PROPERTY:
+    case OP_INDEX:
+        if (!popKinds(stack, 2))
+            return false;
+        pushKind(stack, KIND_ANY);
+        return true;
+    case OP_SET_INDEX:
+    case OP_SLICE:
+        if (!popKinds(stack, 3))
+            return false;
+        pushKind(stack, KIND_PLAIN);
+        return true;
+    case OP_SET_TABLE:
+    case OP_SET_ARRAY:
+    case OP_FORMAT: {
+        int count = (int)instruction->args[0];
+        if (op == OP_SET_TABLE)
+            count *= 2;
+        else if (op == OP_FORMAT)
+            count++;
+        if (!popKinds(stack, count))
+            return false;
+        pushKind(stack, KIND_PLAIN);
+        return true;
+    }
+    case OP_CALL:
+    case OP_INVOKE:
+    case OP_SUPER_INVOKE: {
+        int count = (int)instruction->args[op == OP_CALL ? 0 : 1] + (op == OP_SUPER_INVOKE ? 2 : 1);
+        if (!popKinds(stack, count))
+            return false;
+        pushKind(stack, KIND_ANY);
+        return true;
+    }
+    case OP_INLINE: {
+        // the body runs with the callee taken out from under the arguments,
+        // the call it falls back to leaves its result
+        int argCount = (int)instruction->args[0];
+        if (argCount >= stack->depth)
+            return false;
+        if (jumping) {
+            popKinds(stack, argCount + 1);
+            pushKind(stack, KIND_ANY);
+        } else {
+            uint8_t* callee = &stack->kinds[stack->depth - 1 - argCount];
+            memmove(callee, callee + 1, argCount);
+            stack->depth--;
+        }
+        return true;
+    }
+    case OP_NATIVE_CONSTANT:
+        if (stack->depth == 0)
+            return false;
+        if (jumping)
+            stack->kinds[stack->depth - 1] = constantKind(graph, instruction->args[1]);
+        return true;
+    default:
+        return false;
+    }
+}
+
+static void freeShapes(StackShapes* shapes)
+{
+    for (int i = 0; i < shapes->count; i++) {
+        if (shapes->kinds[i] != NULL)
+            FREE_ARRAY(uint8_t, shapes->kinds[i], shapes->depths[i] + 1);
+    }
+    FREE_ARRAY(uint8_t*, shapes->kinds, shapes->count);
+    FREE_ARRAY(int, shapes->depths, shapes->count);
+}
+
+// Merges the stack on a path into the block at `index`, and queues the
+// block again if that tells it something new.
+static bool mergeShape(StackShapes* shapes, int index, KindStack* stack, int* worklist, int* pending, bool* queued)
+{
+    uint8_t* kinds   = shapes->kinds[index];
+    bool     widened = false;
+
+    if (kinds == NULL) {
+        kinds = shapes->kinds[index] = ALLOCATE(uint8_t, stack->depth + 1);
+        memcpy(kinds, stack->kinds, stack->depth);
+        shapes->depths[index] = stack->depth;
+        widened               = true;
+    } else if (shapes->depths[index] != stack->depth) {
+        return false;
+    }
+
+    for (int i = 0; i < stack->depth; i++) {
+        if (stack->kinds[i] > kinds[i]) {
+            kinds[i] = stack->kinds[i];
+            widened  = true;
+        }
+    }
+
+    if (widened && !queued[index]) {
+        queued[index]         = true;
+        worklist[(*pending)++] = index;
+    }
+    return true;
+}
+
+// Follows the stack through the whole function, starting with the callee,
+// or the receiver, and the arguments.
+static bool findShapes(FlowGraph* graph, StackShapes* shapes)
+{
+    int count      = graph->count;
+    shapes->count  = count;
+    shapes->depths = ALLOCATE(int, count);
+    shapes->kinds  = ALLOCATE(uint8_t*, count);
+
+    int*  worklist = ALLOCATE(int, count);
+    bool* queued   = ALLOCATE(bool, count);
+    int   pending  = 0;
+    for (int i = 0; i < count; i++) {
+        shapes->depths[i] = -1;
+        shapes->kinds[i]  = NULL;
+        queued[i]         = false;
+    }
+
+    KindStack stack  = { 0 };
+    KindStack jumped = { 0 };
+    for (int i = 0; i <= graph->arity; i++) {
+        pushKind(&stack, KIND_ANY);
+    }
+
+    bool valid = count > 0 && mergeShape(shapes, 0, &stack, worklist, &pending, queued);
+    while (valid && pending > 0) {
+        int block     = worklist[--pending];
+        queued[block] = false;
+        loadKinds(&stack, shapes->kinds[block], shapes->depths[block]);
+
+        for (int i = block; valid; i++) {
+            if (i == count) {
+                valid = false;
+                break;
+            }
+
+            Instruction* instruction = &graph->code[i];
+            if (i > block && instruction->isLeader) {
+                valid = mergeShape(shapes, i, &stack, worklist, &pending, queued);
+                break;
+            }
+            shapes->depths[i] = stack.depth;
+
+            if (isJump(instruction)) {
+                loadKinds(&jumped, stack.kinds, stack.depth);
+                valid = stepKinds(graph, instruction, &jumped, true)
+                    && mergeShape(shapes, instruction->target, &jumped, worklist, &pending, queued);
+                for (int j = 0; valid && j < instruction->caseCount; j++) {
+                    valid = mergeShape(shapes, instruction->cases[j], &jumped, worklist, &pending, queued);
+                }
+            }
+            if (!valid || isTerminator(instruction->op))
+                break;
+            valid = stepKinds(graph, instruction, &stack, false);
+        }
+    }
+
+    freeKinds(&stack);
+    freeKinds(&jumped);
+    FREE_ARRAY(int, worklist, count);
+    FREE_ARRAY(bool, queued, count);
+    if (!valid)
+        freeShapes(shapes);
+    return valid;
+}
+
+typedef enum {
+    EFFECT_USER_CODE = 1 << 0, // may run user code, see runsUserCode()
+    EFFECT_NUMERIC   = 1 << 1, // an operand of an operator is a number
+} Effect;
+
+// What each reachable instruction may do, from the kinds on the stack
+// before it.
+static uint8_t* findEffects(FlowGraph* graph, StackShapes* shapes)
+{
+    uint8_t*  effects = ALLOCATE(uint8_t, graph->count);
+    KindStack stack   = { 0 };
+    for (int i = 0; i < graph->count; i++) {
+        effects[i] = 0;
+    }
+
+    for (int block = 0; block < graph->count; block++) {
+        if (shapes->kinds[block] == NULL)
+            continue;
+        loadKinds(&stack, shapes->kinds[block], shapes->depths[block]);
+
+        for (int i = block; i < graph->count && (i == block || !graph->code[i].isLeader); i++) {
+            Instruction* instruction = &graph->code[i];
+            if (runsUserCode(instruction, &stack))
+                effects[i] |= EFFECT_USER_CODE;
+            if (isOperator(instruction->op) && (kindAt(&stack, 0) == KIND_NUMBER || kindAt(&stack, 1) == KIND_NUMBER))
+                effects[i] |= EFFECT_NUMERIC;
+
+            if (endsBlock(instruction) || !stepKinds(graph, instruction, &stack, false))
+                break;
+        }
+    }
+
+    freeKinds(&stack);
+    return effects;
+}
+
+// A value on the stack and its number: two values with the same number
+// are known to be equal. `start` is where the code computing it begins if
+// that code is contiguous and does nothing else, -1 otherwise.
+typedef struct {
+    int number;
+    int start;
+} NumberedValue;
+
+typedef struct {
+    int      block; // the block that numbered it, an entry of any other block is free
+    uint8_t  op;
+    uint32_t operand;
+    int      a;
+    int      b;
+    int      number;
+} NumberKey;
+
+typedef struct {
+    NumberKey* keys;
+    int        capacity;
+    int        block;
+    int        next;
+} ValueNumbers;
+
+static int freshNumber(ValueNumbers* numbers)
+{
+    return numbers->next++;
+}
+
+// The number of what `op` computes from `operand` and the values numbered
+// `a` and `b`, the same one each time it is asked in a block.
+static int numberOf(ValueNumbers* numbers, uint8_t op, uint32_t operand, int a, int b)
+{
+    uint32_t hash  = ((uint32_t)op * 31 + operand) * 2654435761u ^ (uint32_t)a * 40503u ^ (uint32_t)b * 97u;
+    int      index = hash & (numbers->capacity - 1);
+
+    for (;;) {
+        NumberKey* key = &numbers->keys[index];
+        if (key->block != numbers->block) {
+            *key = (NumberKey) { numbers->block, op, operand, a, b, freshNumber(numbers) };
+            return key->number;
+        }
+        if (key->op == op && key->operand == operand && key->a == a && key->b == b)
+            return key->number;
+        index = (index + 1) & (numbers->capacity - 1);
+    }
+}
+
+// Whether `op` only drops values from the top of the stack, or leaves
+// it as it is, with no other effect on the values left.
+static bool onlyDrops(uint8_t op)
+{
+    switch (op) {
+    case OP_POP:
+    case OP_POP_N:
+    case OP_CLOSE_UPVALUE:
+    case OP_CALL_BLIND:
+    case OP_DUMP:
+    case OP_DEFINE_GLOBAL:
+    case OP_DEFINE_CONSTANT:
+    case OP_SET_GLOBAL:
+    case OP_SET_UPVALUE:
+    case OP_SET_LOCAL:
+    case OP_SET_LOCAL_2:
+    case OP_SET_LOCAL_3:
+    case OP_SET_LOCAL_4:
+    case OP_INCREMENT_LOCAL:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static int maxDepth(StackShapes* shapes)
+{
+    int depth = 0;
+    for (int i = 0; i < shapes->count; i++) {
+        if (shapes->depths[i] > depth)
+            depth = shapes->depths[i];
+    }
+    return depth;
+}
+
+// Common subexpression elimination within a block, by value numbering.
+// Constants, locals, and globals and upvalues up to the next store or
+// call, get numbers; an operator that can't run user code numbers its
+// result from its opcode and the numbers of its operands. When the code
+// computing a global, an upvalue or an operator's result is followed by
+// nothing else and its number is already on the stack, the code goes and
+// the value is copied with DUP or PEEK instead.
+//
+// ADD makes a new table or array when neither operand is a number, so its
+// result is never reused then; EQUAL and NOT_EQUAL compare the contents of
+// arrays and are only reused until an element or property is stored.
+static bool eliminateCommonSubexpressions(FlowGraph* graph)
+{
+    StackShapes shapes;
+    if (!findShapes(graph, &shapes))
+        return false;
+
+    bool*    captured;
+    int      slots   = findCaptured(graph, &captured);
+    uint8_t* effects = findEffects(graph, &shapes);
+
+    ValueNumbers numbers = { .capacity = 8, .block = -1, .next = 0 };
+    while (numbers.capacity < graph->count * 2 + 2) {
+        numbers.capacity *= 2;
+    }
+    numbers.keys = ALLOCATE(NumberKey, numbers.capacity);
+    for (int i = 0; i < numbers.capacity; i++) {
+        numbers.keys[i].block = -1;
+    }
+
+    int            capacity = maxDepth(&shapes) + 1;
+    NumberedValue* stack    = ALLOCATE(NumberedValue, capacity);
+    bool           changed  = false;
+
+    for (int block = 0; block < graph->count; block++) {
+        if (shapes.kinds[block] == NULL)
+            continue;
+
+        numbers.block = block;
+        int depth     = shapes.depths[block];
+        for (int i = 0; i < depth; i++) {
+            stack[i] = (NumberedValue) { freshNumber(&numbers), -1 };
+        }
+        int globals  = freshNumber(&numbers);
+        int upvalues = freshNumber(&numbers);
+        int memory   = freshNumber(&numbers);
+
+        for (int i = block; i < graph->count && (i == block || !graph->code[i].isLeader); i++) {
+            Instruction* instruction = &graph->code[i];
+            uint8_t      op          = instruction->op;
+            bool         user        = effects[i] & EFFECT_USER_CODE;
+            if (endsBlock(instruction))
+                break;
+            int after = shapes.depths[i + 1];
+
+            // the value the instruction computes, if the numbering follows it
+            NumberedValue value = { -1, -1 };
+            bool          worth = false;
+
+            switch (op) {
+            case OP_CONSTANT:
+            case OP_NIL:
+            case OP_TRUE:
+            case OP_FALSE:
+                value = (NumberedValue) { numberOf(&numbers, op, op == OP_CONSTANT ? instruction->args[0] : 0, 0, 0), i };
+                break;
+            case OP_GET_LOCAL: {
+                uint32_t slot = instruction->args[0];
+                value         = (NumberedValue) { captured[slot] ? freshNumber(&numbers) : stack[slot].number, i };
+                break;
+            }
+            case OP_GET_GLOBAL:
+                value = (NumberedValue) { numberOf(&numbers, op, instruction->args[0], globals, 0), i };
+                worth = true;
+                break;
+            case OP_GET_UPVALUE:
+                value = (NumberedValue) { numberOf(&numbers, op, instruction->args[0], upvalues, 0), i };
+                worth = true;
+                break;
+            case OP_DUP:
+            case OP_PEEK: {
+                int distance = op == OP_DUP ? 0 : (int)instruction->args[0];
+                value        = (NumberedValue) { stack[depth - 1 - distance].number, i };
+                break;
+            }
+            case OP_NOT:
+            case OP_NEGATE:
+            case OP_INCREMENT:
+            case OP_DECREMENT: {
+                if (user)
+                    break;
+                NumberedValue operand = stack[depth - 1];
+                value                 = (NumberedValue) { numberOf(&numbers, op, 0, operand.number, 0), operand.start };
+                worth                 = true;
+                break;
+            }
+            default: {
+                if (!isOperator(op) || user)
+                    break;
+                NumberedValue a       = stack[depth - 2];
+                NumberedValue b       = stack[depth - 1];
+                bool          numeric = effects[i] & EFFECT_NUMERIC;
+                int           start   = a.start != -1 && b.start != -1 ? a.start : -1;
+                if (op == OP_ADD && !numeric) {
+                    value = (NumberedValue) { freshNumber(&numbers), start };
+                } else {
+                    uint32_t epoch = (op == OP_EQUAL || op == OP_NOT_EQUAL) && !numeric ? (uint32_t)memory : 0;
+                    value          = (NumberedValue) { numberOf(&numbers, op, epoch, a.number, b.number), start };
+                }
+                worth = true;
+                break;
+            }
+            }
+
+            if (value.number != -1) {
+                // anything the value's code consumed sat above `result`
+                int result = after - 1;
+                for (int j = result - 1; worth && value.start != -1 && j >= 0 && result - 1 - j <= UINT8_MAX; j--) {
+                    if (stack[j].number != value.number)
+                        continue;
+                    if (graph->code[value.start].isTarget && value.start != i)
+                        break;
+
+                    for (int k = value.start; k < i; k++) {
+                        graph->code[k].isDead = true;
+                    }
+                    instruction->op       = j == result - 1 ? OP_DUP : OP_PEEK;
+                    instruction->argCount = j == result - 1 ? 0 : 1;
+                    instruction->args[0]  = result - 1 - j;
+                    changed               = true;
+                    break;
+                }
+
+                stack[result] = value;
+                depth         = after;
+                continue;
+            }
+
+            switch (op) {
+            case OP_SET_LOCAL:
+            case OP_SET_LOCAL_2:
+            case OP_SET_LOCAL_3:
+            case OP_SET_LOCAL_4:
+                for (int k = 0; k < instruction->argCount; k++) {
+                    stack[instruction->args[k]].number = stack[depth - 1].number;
+                }
+                break;
+            case OP_INCREMENT_LOCAL:
+                stack[instruction->args[0]].number = freshNumber(&numbers);
+                break;
+            case OP_SET_GLOBAL:
+            case OP_DEFINE_GLOBAL:
+            case OP_DEFINE_CONSTANT:
+                globals = freshNumber(&numbers);
+                break;
+            case OP_SET_UPVALUE:
+                upvalues = freshNumber(&numbers);
+                break;
+            case OP_SET_INDEX:
+            case OP_SET_PROPERTY:
+                memory = freshNumber(&numbers);
+                break;
+            default:
+                break;
+            }
+
+            if (user) {
+                globals  = freshNumber(&numbers);
+                upvalues = freshNumber(&numbers);
+                memory   = freshNumber(&numbers);
+                for (int k = 0; k < depth && k < slots; k++) {
+                    if (captured[k])
+                        stack[k].number = freshNumber(&numbers);
+                }
+            }
+
+            if (onlyDrops(op)) {
+                if (after > 0)
+                    stack[after - 1].start = -1;
+            } else {
+                for (int k = (after < depth ? after : depth) - 1; k < after; k++) {
+                    if (k >= 0)
+                        stack[k] = (NumberedValue) { freshNumber(&numbers), -1 };
+                }
+            }
+            depth = after;
+        }
+    }
+
+    FREE_ARRAY(NumberedValue, stack, capacity);
+    FREE_ARRAY(NumberKey, numbers.keys, numbers.capacity);
+    FREE_ARRAY(uint8_t, effects, graph->count);
+    FREE_ARRAY(bool, captured, slots + 1);
+    freeShapes(&shapes);
+    return changed;
+}
+
+#define MAX_OCCURRENCES 256
+#define MIN_HOIST_COST  3
+
+// The loop a HOIST_SLOT starts: the instructions that can run again
+// without passing the HOIST_SLOT, and the hidden local it pushes.
+typedef struct {
+    int      hoist;
+    uint32_t slot;
+    bool*    members;
+} HoistLoop;
+
+// Code in a loop that computes a loop-invariant value and nothing else,
+// from `start` to `end`, what it is guessed to cost and how often it runs.
+typedef struct {
+    int start;
+    int end;
+    int cost;
+    int weight;
+} Occurrence;
+
+typedef struct {
+    int      start;
+    int      end;
+    uint32_t slot;
+} HoistSite;
+
+// An expression being followed through a block of a loop: where its code
+// starts, -1 if it isn't contiguous, and whether it is loop-invariant.
+typedef struct {
+    int  start;
+    int  cost;
+    bool isInvariant;
+} InvariantTree;
+
+// Lists every instruction's predecessors, `from[i]` up to `from[i + 1]`.
+static int* findPredecessors(FlowGraph* graph, int** from)
+{
+    int  count  = graph->count;
+    int* starts = ALLOCATE(int, count + 2);
+    for (int i = 0; i < count + 2; i++) {
+        starts[i] = 0;
+    }
+
+    // counted into starts[i + 2] so the second walk can fill from starts[i + 1]
+    for (int pass = 0; pass < 2; pass++) {
+        int* list = pass == 0 ? NULL : *from;
+        for (int i = 0; i < count; i++) {
+            Instruction* instruction = &graph->code[i];
+            int          edges[2]    = { -1, -1 };
+            if (!isTerminator(instruction->op) && i + 1 < count)
+                edges[0] = i + 1;
+            if (isJump(instruction) && instruction->target < count)
+                edges[1] = instruction->target;
+
+            for (int j = -2; j < instruction->caseCount; j++) {
+                int to = j < 0 ? edges[j + 2] : instruction->cases[j];
+                if (to == -1 || to >= count)
+                    continue;
+                if (pass == 0)
+                    starts[to + 2]++;
+                else
+                    list[starts[to + 1]++] = i;
+            }
+        }
+
+        if (pass == 0) {
+            for (int i = 2; i < count + 2; i++) {
+                starts[i] += starts[i - 1];
+            }
+            *from = ALLOCATE(int, starts[count + 1] + 1);
+        }
+    }
+
+    return starts;
+}
+
+// The loop starting right after the HOIST_SLOT at `hoist`, found by
+// walking back from the jumps to its first instruction. Returns false if
+// it isn't entered through there alone or the hidden slot isn't below
+// everything in it.
+static bool findLoop(FlowGraph* graph, StackShapes* shapes, int* starts, int* from, HoistLoop* loop)
+{
+    int  count   = graph->count;
+    int  header  = loop->hoist + 1;
+    bool valid   = header < count && graph->code[header].isTarget;
+    int* worklist = ALLOCATE(int, count);
+    int  pending = 0;
+
+    loop->members = ALLOCATE(bool, count);
+    for (int i = 0; i < count; i++) {
+        loop->members[i] = false;
+    }
+
+    if (valid) {
+        loop->members[header] = true;
+        for (int i = starts[header]; i < starts[header + 1]; i++) {
+            if (from[i] != loop->hoist && !loop->members[from[i]]) {
+                loop->members[from[i]] = true;
+                worklist[pending++]    = from[i];
+            }
+        }
+        valid = pending > 0;
+    }
+
+    while (valid && pending > 0) {
+        int member = worklist[--pending];
+        if (member <= loop->hoist || shapes->depths[member] <= (int)loop->slot) {
+            valid = false;
+            break;
+        }
+        for (int i = starts[member]; i < starts[member + 1]; i++) {
+            if (!loop->members[from[i]]) {
+                loop->members[from[i]] = true;
+                worklist[pending++]    = from[i];
+            }
+        }
+    }
+
+    FREE_ARRAY(int, worklist, count);
+    if (!valid)
+        FREE_ARRAY(bool, loop->members, count);
+    return valid;
+}
+
+static bool sameCode(FlowGraph* graph, Occurrence* a, Occurrence* b)
+{
+    if (a->end - a->start != b->end - b->start)
+        return false;
+
+    for (int i = 0; i <= a->end - a->start; i++) {
+        Instruction* x = &graph->code[a->start + i];
+        Instruction* y = &graph->code[b->start + i];
+        if (x->op != y->op || x->argCount != y->argCount)
+            return false;
+        for (int j = 0; j < x->argCount; j++) {
+            if (x->args[j] != y->args[j])
+                return false;
+        }
+    }
+    return true;
+}
+
+static bool isClaimed(bool* claimed, Occurrence* occurrence)
+{
+    for (int i = occurrence->start; i <= occurrence->end; i++) {
+        if (claimed[i])
+            return true;
+    }
+    return false;
+}
+
+// Collects the largest loop-invariant expressions in `loop` worth keeping
+// in its hidden slot. Returns how many it found.
+static int findInvariants(FlowGraph* graph, StackShapes* shapes, uint8_t* effects, bool* captured, int slots,
+    int* nesting, HoistLoop* loop, Occurrence* occurrences)
+{
+    int      count        = graph->count;
+    bool     runsUser     = false;
+    bool     setsUpvalue  = false;
+    bool*    written      = ALLOCATE(bool, slots + 1);
+    int      names        = graph->chunk->constants.count;
+    bool*    writtenNames = ALLOCATE(bool, names + 1);
+    for (int i = 0; i <= slots; i++) {
+        written[i] = false;
+    }
+    for (int i = 0; i <= names; i++) {
+        writtenNames[i] = false;
+    }
+
+    bool hoisted = false;
+    for (int i = 0; i < count; i++) {
+        Instruction* instruction = &graph->code[i];
+        if (!loop->members[i])
+            continue;
+
+        runsUser    = runsUser || (effects[i] & EFFECT_USER_CODE);
+        setsUpvalue = setsUpvalue || instruction->op == OP_SET_UPVALUE;
+        hoisted     = hoisted || (instruction->op == OP_GET_HOISTED && instruction->args[0] == loop->slot);
+        if (instruction->op == OP_SET_GLOBAL || instruction->op == OP_DEFINE_GLOBAL
+            || instruction->op == OP_DEFINE_CONSTANT)
+            writtenNames[instruction->args[0]] = true;
+
+        LocalAccess access = localAccess(instruction);
+        for (int j = 0; j < access.count; j++) {
+            if (access.writes[j] && (int)access.slots[j] < slots)
+                written[access.slots[j]] = true;
+        }
+    }
+
+    int            found    = 0;
+    int            capacity = maxDepth(shapes) + 1;
+    InvariantTree* stack    = ALLOCATE(InvariantTree, capacity);
+
+    for (int block = 0; !hoisted && block < count; block++) {
+        if (shapes->kinds[block] == NULL || !loop->members[block])
+            continue;
+
+        int depth = shapes->depths[block];
+        for (int i = 0; i < depth; i++) {
+            stack[i] = (InvariantTree) { -1, 0, false };
+        }
+
+        for (int i = block; i < count && (i == block || !graph->code[i].isLeader); i++) {
+            Instruction* instruction = &graph->code[i];
+            uint8_t      op          = instruction->op;
+            if (endsBlock(instruction))
+                break;
+            int after = shapes->depths[i + 1];
+
+            InvariantTree tree     = { -1, 0, false };
+            bool          computes = true;
+            switch (op) {
+            case OP_CONSTANT:
+            case OP_NIL:
+            case OP_TRUE:
+            case OP_FALSE:
+                tree = (InvariantTree) { i, 1, true };
+                break;
+            case OP_GET_LOCAL: {
+                // locals declared in the loop have slots above the hidden one
+                uint32_t slot = instruction->args[0];
+                tree          = (InvariantTree) { i, 1, slot < loop->slot && !captured[slot] && !written[slot] };
+                break;
+            }
+            case OP_GET_GLOBAL:
+                tree = (InvariantTree) { i, 3, !runsUser && !writtenNames[instruction->args[0]] };
+                break;
+            case OP_GET_UPVALUE:
+                tree = (InvariantTree) { i, 2, !runsUser && !setsUpvalue };
+                break;
+            case OP_NOT:
+            case OP_NEGATE:
+            case OP_INCREMENT:
+            case OP_DECREMENT: {
+                InvariantTree operand = stack[depth - 1];
+                bool          pure    = !(effects[i] & EFFECT_USER_CODE);
+                tree = (InvariantTree) { operand.start, operand.cost + 1, pure && operand.isInvariant };
+                break;
+            }
+            default: {
+                if (!isOperator(op) || (effects[i] & EFFECT_USER_CODE)) {
+                    computes = false;
+                    break;
+                }
+                // a new object, or a comparison of contents that may change
+                bool          numeric = effects[i] & EFFECT_NUMERIC;
+                bool          pure    = numeric || (op != OP_ADD && op != OP_EQUAL && op != OP_NOT_EQUAL);
+                InvariantTree a       = stack[depth - 2];
+                InvariantTree b       = stack[depth - 1];
+                int           start   = a.start != -1 && b.start != -1 ? a.start : -1;
+                tree = (InvariantTree) { start, a.cost + b.cost + 1, pure && a.isInvariant && b.isInvariant };
+                break;
+            }
+            }
+
+            if (computes) {
+                // code an enclosing loop hoisted already runs once per entry
+                bool guarded     = tree.start > 0 && graph->code[tree.start - 1].op == OP_GET_HOISTED;
+                tree.isInvariant = tree.isInvariant && tree.start != -1;
+                if (tree.isInvariant && !guarded && tree.cost >= MIN_HOIST_COST && found < MAX_OCCURRENCES) {
+                    int levels = nesting[tree.start] - nesting[loop->hoist + 1];
+                    levels     = levels < 0 ? 0 : levels > 5 ? 5 : levels;
+                    occurrences[found++] = (Occurrence) { tree.start, i, tree.cost, 1 << (3 * levels) };
+                }
+                stack[after - 1] = tree;
+            } else {
+                for (int k = (after < depth ? after : depth) - 1; k < after; k++) {
+                    if (k >= 0)
+                        stack[k] = (InvariantTree) { -1, 0, false };
+                }
+            }
+            depth = after;
+        }
+    }
+
+    // only the largest expressions are kept, the ones inside them go too
+    int kept = 0;
+    for (int i = 0; i < found; i++) {
+        bool inner = false;
+        for (int j = 0; j < found && !inner; j++) {
+            inner = j != i && occurrences[j].start <= occurrences[i].start && occurrences[i].end <= occurrences[j].end;
+        }
+        if (!inner)
+            occurrences[kept++] = occurrences[i];
+    }
+
+    FREE_ARRAY(InvariantTree, stack, capacity);
+    FREE_ARRAY(bool, written, slots + 1);
+    FREE_ARRAY(bool, writtenNames, names + 1);
+    return kept;
+}
+
+// Puts `GET_HOISTED slot` before and `SET_LOCAL slot` after the code of
+// each site. GET_HOISTED skips that code once the slot holds the value,
+// jumps to the code land on the GET_HOISTED.
+static void insertHoisted(FlowGraph* graph, HoistSite* sites, int siteCount)
+{
+    int          count    = graph->count;
+    int          newCount = count + siteCount * 2;
+    Instruction* code     = ALLOCATE(Instruction, newCount);
+    int*         newIndex = ALLOCATE(int, count + 1);
+
+    int live = 0;
+    int site = 0;
+    for (int i = 0; i < count; i++) {
+        Instruction* instruction = &graph->code[i];
+        newIndex[i]              = live;
+
+        if (site < siteCount && sites[site].start == i) {
+            code[live++] = (Instruction) {
+                .op        = OP_GET_HOISTED,
+                .line      = instruction->line,
+                .source    = instruction->source,
+                .argCount  = 1,
+                .args      = { sites[site].slot },
+                .target    = sites[site].end + 1,
+                .isInlined = instruction->isInlined,
+            };
+        }
+
+        code[live++] = *instruction;
+
+        if (site < siteCount && sites[site].end == i) {
+            code[live++] = (Instruction) {
+                .op        = OP_SET_LOCAL,
+                .line      = instruction->line,
+                .source    = instruction->source,
+                .argCount  = 1,
+                .args      = { sites[site].slot },
+                .target    = -1,
+                .isInlined = instruction->isInlined,
+            };
+            site++;
+        }
+    }
+    newIndex[count] = live;
+
+    for (int i = 0; i < live; i++) {
+        Instruction* instruction = &code[i];
+        if (instruction->target != -1)
+            instruction->target = newIndex[instruction->target];
+        for (int j = 0; j < instruction->caseCount; j++) {
+            instruction->cases[j] = newIndex[instruction->cases[j]];
+        }
+    }
+
+    FREE_ARRAY(int, newIndex, count + 1);
+    FREE_ARRAY(Instruction, graph->code, graph->capacity);
+    graph->code     = code;
+    graph->count    = live;
+    graph->capacity = newCount;
+}
+
+// Loop-invariant code motion. Each loop keeps a hidden local, pushed empty
+// by the HOIST_SLOT in front of it, see beginLoop() in the compiler. The
+// loop's most frequent invariant expression is computed where it first
+// runs and stored there; after that GET_HOISTED loads it instead. Nothing
+// is computed before the loop, so a loop that never runs, or never gets
+// to the expression, doesn't raise errors the original wouldn't.
+//
+// Invariant are constants, locals declared before the loop that it doesn't
+// assign, globals the loop doesn't assign and upvalues, as long as nothing
+// in the loop can run user code, and the operators applied to them that
+// can't run user code either. An expression inside a nested loop counts
+// eight times for each level, and the outer loop picks first.
+static bool hoistInvariants(FlowGraph* graph)
+{
+    if (!graph->shortJumps)
+        return false;
+
+    int loopCount = 0;
+    for (int i = 0; i < graph->count; i++) {
+        if (graph->code[i].op == OP_HOIST_SLOT)
+            loopCount++;
+    }
+    if (loopCount == 0)
+        return false;
+
+    StackShapes shapes;
+    if (!findShapes(graph, &shapes))
+        return false;
+
+    int        count = graph->count;
+    int*       from    = NULL;
+    int*       starts  = findPredecessors(graph, &from);
+    HoistLoop* loops   = ALLOCATE(HoistLoop, loopCount);
+    int*       nesting = ALLOCATE(int, count);
+    int        found   = 0;
+    for (int i = 0; i < count; i++) {
+        nesting[i] = 0;
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (graph->code[i].op != OP_HOIST_SLOT || shapes.depths[i] == -1)
+            continue;
+
+        HoistLoop loop = { .hoist = i, .slot = (uint32_t)shapes.depths[i] };
+        if (!findLoop(graph, &shapes, starts, from, &loop))
+            continue;
+
+        loops[found++] = loop;
+        for (int j = 0; j < count; j++) {
+            nesting[j] += loop.members[j];
+        }
+    }
+
+    bool*       captured;
+    int         slots       = findCaptured(graph, &captured);
+    uint8_t*    effects     = findEffects(graph, &shapes);
+    bool*       claimed     = ALLOCATE(bool, count);
+    Occurrence* occurrences = ALLOCATE(Occurrence, MAX_OCCURRENCES);
+    HoistSite*  sites       = ALLOCATE(HoistSite, MAX_OCCURRENCES * loopCount);
+    int         siteCount   = 0;
+    for (int i = 0; i < count; i++) {
+        claimed[i] = false;
+    }
+
+    for (int l = 0; l < found; l++) {
+        HoistLoop* loop  = &loops[l];
+        int        kept  = findInvariants(graph, &shapes, effects, captured, slots, nesting, loop, occurrences);
+        int        best  = -1;
+        int        score = 0;
+
+        for (int i = 0; i < kept; i++) {
+            int total = 0;
+            for (int j = 0; j < kept; j++) {
+                if (sameCode(graph, &occurrences[i], &occurrences[j]) && !isClaimed(claimed, &occurrences[j]))
+                    total += (occurrences[j].cost - 1) * occurrences[j].weight;
+            }
+            if (total > score) {
+                best  = i;
+                score = total;
+            }
+        }
+        if (best == -1)
+            continue;
+
+        Occurrence chosen = occurrences[best];
+        for (int j = 0; j < kept; j++) {
+            Occurrence* occurrence = &occurrences[j];
+            if (!sameCode(graph, &chosen, occurrence) || isClaimed(claimed, occurrence))
+                continue;
+
+            for (int k = occurrence->start; k <= occurrence->end; k++) {
+                claimed[k] = true;
+            }
+            sites[siteCount++] = (HoistSite) { occurrence->start, occurrence->end, loop->slot };
+        }
+    }
+
+    // in order, for insertHoisted()
+    for (int i = 1; i < siteCount; i++) {
+        HoistSite site = sites[i];
+        int       j    = i;
+        for (; j > 0 && sites[j - 1].start > site.start; j--) {
+            sites[j] = sites[j - 1];
+        }
+        sites[j] = site;
+    }
+
+    if (siteCount > 0)
+        insertHoisted(graph, sites, siteCount);
+
+    for (int l = 0; l < found; l++) {
+        FREE_ARRAY(bool, loops[l].members, count);
+    }
+    FREE_ARRAY(HoistSite, sites, MAX_OCCURRENCES * loopCount);
+    FREE_ARRAY(Occurrence, occurrences, MAX_OCCURRENCES);
+    FREE_ARRAY(bool, claimed, count);
+    FREE_ARRAY(uint8_t, effects, count);
+    FREE_ARRAY(bool, captured, slots + 1);
+    FREE_ARRAY(int, nesting, count);
+    FREE_ARRAY(HoistLoop, loops, loopCount);
+    FREE_ARRAY(int, from, starts[count + 1] + 1);
+    FREE_ARRAY(int, starts, count + 2);
+    freeShapes(&shapes);
+    return siteCount > 0;
+}
+
+// How many values `instruction` takes off the stack and how many it
+// leaves, for the instructions a call's arguments are usually made of.
+static bool stackEffect(Instruction* instruction, int* pops, int* pushes)
+{
+    *pops   = 0;
+    *pushes = 1;
+
+    switch (instruction->op) {
+    case OP_CONSTANT:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_LOCAL:
+    case OP_GET_GLOBAL:
+    case OP_GET_UPVALUE:
+    case OP_PEEK:
+        return true;
+    case OP_GET_LOCAL_2:
+    case OP_GET_LOCAL_3:
+    case OP_GET_LOCAL_4:
+    case OP_GET_GLOBAL_2:
+    case OP_GET_GLOBAL_3:
+    case OP_GET_GLOBAL_4:
+        *pushes = instruction->argCount;
+        return true;
+    case OP_DUP:
+        *pops   = 1;
+        *pushes = 2;
+        return true;
+    case OP_NOT:
+    case OP_NEGATE:
+    case OP_INCREMENT:
+    case OP_DECREMENT:
+    case OP_GET_PROPERTY:
+    case OP_SET_LOCAL:
+    case OP_SET_GLOBAL:
+    case OP_SET_UPVALUE:
+        *pops = 1;
+        return true;
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_NOT_EQUAL:
+    case OP_GREATER_EQUAL:
+    case OP_LESS_EQUAL:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_MODULO:
+    case OP_BITWISE_AND:
+    case OP_BITWISE_OR:
+    case OP_BITWISE_XOR:
+    case OP_SHIFT_LEFT:
+    case OP_SHIFT_RIGHT:
+    case OP_INDEX:
+        *pops = 2;
+        return true;
+    case OP_CALL:
+        *pops = instruction->args[0] + 1;
+        return true;
+    case OP_INVOKE:
+        *pops = instruction->args[1] + 1;
+        return true;
+    default:
+        return false;
+    }
+}
+
+// A value on the stack, and which property of which local it was loaded
+// from if it is known to still hold it. `slot` is -1 otherwise.
+typedef struct {
+    int      slot;
+    uint32_t name;
+} StackValue;
+
+#define MAX_TRACKED 256
+
+// Whether `op` may change a property a tracked load read. Stores do, and
+// so does anything that can run user code: calls, and operators, which
+// dispatch to dunder methods on instances.
+static bool changesProperties(uint8_t op)
+{
+    switch (op) {
+    case OP_CONSTANT:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_LOCAL:
+    case OP_GET_LOCAL_2:
+    case OP_GET_LOCAL_3:
+    case OP_GET_LOCAL_4:
+    case OP_GET_GLOBAL:
+    case OP_GET_GLOBAL_2:
+    case OP_GET_GLOBAL_3:
+    case OP_GET_GLOBAL_4:
+    case OP_GET_UPVALUE:
+    case OP_GET_PROPERTY:
+    case OP_SET_GLOBAL:
+    case OP_SET_UPVALUE:
+    case OP_DUP:
+    case OP_PEEK:
+        return false;
+    case OP_SET_PROPERTY:
+    case OP_SET_INDEX:
+    case OP_SET_LOCAL:
+    case OP_CALL:
+    case OP_INVOKE:
+    default:
+        return true;
+    }
+}
+
+// Loading the same property of the same local again, `this.x` twice in a
+// method, copies the value still on the stack with PEEK instead of looking
+// it up again. Follows the stack through each block; anything that may
+// store a property or a local, or run user code, forgets every load before
+// it, see changesProperties().
+static bool reuseProperties(FlowGraph* graph)
+{
+    StackValue stack[MAX_TRACKED];
+    int        depth   = 0;
+    bool       changed = false;
+
+    for (int i = 0; i < graph->count; i++) {
+        Instruction* instruction = &graph->code[i];
+        int          pops, pushes;
+        if (instruction->isDead)
+            continue;
+        if (instruction->isLeader)
+            depth = 0;
+
+        Instruction* load = instruction->op == OP_GET_LOCAL ? joined(graph, i + 1) : NULL;
+        if (load != NULL && load->op == OP_GET_PROPERTY) {
+            StackValue value = { (int)instruction->args[0], load->args[0] };
+            for (int j = depth - 1; j >= 0 && depth - 1 - j <= UINT8_MAX; j--) {
+                if (stack[j].slot == value.slot && stack[j].name == value.name) {
+                    instruction->isDead = true;
+                    load->op            = j == depth - 1 ? OP_DUP : OP_PEEK;
+                    load->argCount      = j == depth - 1 ? 0 : 1;
+                    load->args[0]       = depth - 1 - j;
+                    changed             = true;
+                    break;
+                }
+            }
+
+            if (depth == MAX_TRACKED)
+                depth = 0;
+            stack[depth++] = value;
+            i++;
+            continue;
+        }
+
+        if (instruction->op == OP_DUP || instruction->op == OP_PEEK) {
+            int        distance = instruction->op == OP_DUP ? 0 : (int)instruction->args[0];
+            StackValue value    = { -1, 0 };
+            if (distance < depth)
+                value = stack[depth - 1 - distance];
+            if (depth == MAX_TRACKED)
+                depth = 0;
+            stack[depth++] = value;
+            continue;
+        }
+
+        if (changesProperties(instruction->op)) {
+            for (int j = 0; j < depth; j++) {
+                stack[j].slot = -1;
+            }
+        }
+
+        if (!stackEffect(instruction, &pops, &pushes)) {
+            depth = 0;
+            continue;
+        }
+
+        depth = pops > depth ? 0 : depth - pops;
+        for (int j = 0; j < pushes; j++) {
+            if (depth == MAX_TRACKED)
+                depth = 0;
+            stack[depth++] = (StackValue) { -1, 0 };
+        }
+    }
+
+    return changed;
+}
+
+#define MAX_INLINE 8
+
+// Whether an inlined body may contain `op`: nothing that touches locals,
+// jumps or calls, so the body needs no frame of its own.
+static bool isInlinable(uint8_t op)
+{
+    switch (op) {
+    case OP_CONSTANT:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_GLOBAL:
+    case OP_NOT:
+    case OP_NEGATE:
+    case OP_INCREMENT:
+    case OP_DECREMENT:
+    case OP_GET_PROPERTY:
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_NOT_EQUAL:
+    case OP_GREATER_EQUAL:
+    case OP_LESS_EQUAL:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_MODULO:
+    case OP_BITWISE_AND:
+    case OP_BITWISE_OR:
+    case OP_BITWISE_XOR:
+    case OP_SHIFT_LEFT:
+    case OP_SHIFT_RIGHT:
+    case OP_INDEX:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Decodes a function without jumps into plain instructions up to its
+// first RETURN, with superinstructions split in two and fused loads taken
+// apart. Returns the count, or -1 if the body jumps or doesn't fit in
+// `capacity`. Decoding may add constants to the function's pool, the
+// caller drops them again once it has read them.
+static int decodeBody(ObjFunction* function, Instruction* plain, int capacity)
+{
+    FlowGraph graph;
+    if (function->lazyBody != NULL || !decodeChunk(&graph, &function->chunk))
+        return -1;
+
+    int count = 0;
+    for (int i = 0; i < graph.count; i++) {
+        Instruction* instruction = &graph.code[i];
+        uint8_t      first, second;
+        if (isJump(instruction) || count + 4 > capacity) {
+            count = -1;
+            break;
+        }
+
+        if (splitSuperinstruction(instruction->op, &first, &second)) {
+            int firstCount   = shortOperands(first);
+            Instruction head = *instruction;
+            Instruction tail = *instruction;
+            head.op          = first;
+            head.argCount    = firstCount;
+            tail.op          = second;
+            tail.argCount    = shortOperands(second);
+            for (int j = 0; j < tail.argCount; j++) {
+                tail.args[j] = instruction->args[firstCount + j];
+            }
+            plain[count++] = head;
+            plain[count++] = tail;
+        } else if ((instruction->op >= OP_GET_LOCAL_2 && instruction->op <= OP_GET_LOCAL_4)
+            || (instruction->op >= OP_GET_GLOBAL_2 && instruction->op <= OP_GET_GLOBAL_4)) {
+            bool local = instruction->op <= OP_GET_LOCAL_4;
+            for (int j = 0; j < instruction->argCount; j++) {
+                Instruction load = *instruction;
+                load.op          = local ? OP_GET_LOCAL : OP_GET_GLOBAL;
+                load.argCount    = 1;
+                load.args[0]     = instruction->args[j];
+                plain[count++]   = load;
+            }
+        } else {
+            plain[count++] = *instruction;
+        }
+
+        if (plain[count - 1].op == OP_RETURN)
+            break;
+    }
+
+    if (count > 0 && plain[count - 1].op != OP_RETURN)
+        count = -1;
+    freeGraph(&graph);
+    return count;
+}
+
+// Decodes `function` into the instructions that stand in for a call to
+// it, or returns -1 if it is not a single expression over its parameters.
+// The arguments are on the stack already, so the body must read each
+// parameter once, in order, before anything else; reading the last one
+// again becomes a DUP. With a `graph` the constants the body uses are
+// added to its chunk.
+static int inlineBody(FlowGraph* graph, ObjFunction* function, Instruction* body)
+{
+    if (function->upvalueCount != 0)
+        return -1;
+
+    Chunk*      chunk         = &function->chunk;
+    int         constantCount = chunk->constants.count;
+    Instruction plain[MAX_INLINE * 4];
+    int         plainCount = decodeBody(function, plain, MAX_INLINE * 4);
+
+    int count = -1;
+    if (plainCount > 0 && plain[plainCount - 1].op == OP_RETURN) {
+        int next  = 1;
+        int depth = function->arity;
+        int i     = 0;
+        count     = 0;
+        for (; i < plainCount && plain[i].op == OP_GET_LOCAL; i++) {
+            if (plain[i].args[0] == (uint32_t)next) {
+                next++;
+            } else if (next > 1 && plain[i].args[0] == (uint32_t)next - 1) {
+                depth++;
+                if (body != NULL)
+                    body[count] = (Instruction) { .op = OP_DUP, .line = plain[i].line };
+                count++;
+            } else {
+                break;
+            }
+        }
+        if (next != function->arity + 1)
+            count = -1;
+
+        for (; count != -1 && i < plainCount - 1; i++) {
+            int pops, pushes;
+            if (count == MAX_INLINE || !isInlinable(plain[i].op) || !stackEffect(&plain[i], &pops, &pushes)
+                || pops > depth) {
+                count = -1;
+                break;
+            }
+            depth += pushes - pops;
+            if (body != NULL)
+                body[count] = plain[i];
+            count++;
+        }
+        if (depth != 1)
+            count = -1;
+    }
+
+    // constants move over to the caller's pool before the ones decoding
+    // added here are dropped again
+    for (int i = 0; graph != NULL && i < count; i++) {
+        Instruction* instruction = &body[i];
+        for (int j = 0; j < instruction->argCount; j++) {
+            if (!isConstantOperand(instruction->op, j))
+                continue;
+            int constant = internConstant(graph, chunk->constants.values[instruction->args[j]]);
+            if (constant > UINT16_MAX)
+                count = -1;
+            instruction->args[j] = (uint32_t)constant;
+        }
+    }
+
+    chunk->constants.count = constantCount;
+    return count;
+}
+
+bool canInline(ObjFunction* function)
+{
+    return inlineBody(NULL, function, NULL) != -1;
+}
+
+// Whether `instruction` is GET_LOCAL `slot`.
+static bool loadsLocal(Instruction* instruction, uint32_t slot)
+{
+    return instruction->op == OP_GET_LOCAL && instruction->args[0] == slot;
+}
+
+// Recognizes the methods invoke() can run without a frame:
+//   GET_LOCAL 0, GET_PROPERTY name, RETURN                    a getter
+//   GET_LOCAL 0, GET_LOCAL 1, SET_PROPERTY name, RETURN       a setter
+//   ... SET_PROPERTY name, POP, NIL, RETURN                   one returning nil
+//   CONSTANT, RETURN                                          a constant
+void classifyAccessor(ObjFunction* function)
+{
+    function->accessor      = ACCESSOR_NONE;
+    function->accessorValue = NIL_VAL;
+
+    // none of them takes more than a few bytes, even before optimizing
+    Chunk* chunk = &function->chunk;
+    if (chunk->count > 16)
+        return;
+
+    int         constantCount = chunk->constants.count;
+    Instruction plain[8];
+    int         count = decodeBody(function, plain, 8);
+    FlowGraph   graph = { .chunk = chunk };
+    Value       value;
+
+    if (count == 2 && constantValue(&graph, &plain[0], &value)) {
+        function->accessor      = ACCESSOR_CONSTANT;
+        function->accessorValue = value;
+    } else if (count == 3 && function->arity == 0 && loadsLocal(&plain[0], 0) && plain[1].op == OP_GET_PROPERTY) {
+        function->accessor      = ACCESSOR_GETTER;
+        function->accessorValue = chunk->constants.values[plain[1].args[0]];
+    } else if ((count == 4 || count == 6) && function->arity == 1 && loadsLocal(&plain[0], 0)
+        && loadsLocal(&plain[1], 1) && plain[2].op == OP_SET_PROPERTY
+        && (count == 4 || (plain[3].op == OP_POP && plain[4].op == OP_NIL))) {
+        function->accessor      = count == 4 ? ACCESSOR_SETTER : ACCESSOR_SETTER_NIL;
+        function->accessorValue = chunk->constants.values[plain[2].args[0]];
+    }
+
+    chunk->constants.count = constantCount;
+}
+
+// The CALL that calls what the instruction at `index` loads, if it is in
+// the same block and passes `arity` arguments.
+static int findCall(FlowGraph* graph, int index, int arity)
+{
+    int depth = 0;
+    for (int i = index + 1; i < graph->count; i++) {
+        Instruction* instruction = &graph->code[i];
+        int          pops, pushes;
+        if (instruction->isDead)
+            continue;
+        if (instruction->isLeader || isJump(instruction))
+            return -1;
+        if (instruction->op == OP_CALL && instruction->args[0] == (uint32_t)depth)
+            return depth == arity ? i : -1;
+        if (!stackEffect(instruction, &pops, &pushes) || pops > depth)
+            return -1;
+        depth += pushes - pops;
+    }
+
+    return -1;
+}
+
+// Inlines calls to small global functions:
+//   GET_GLOBAL f, arguments, CALL n
+//     becomes GET_GLOBAL f, arguments, INLINE n f, body of f
+// INLINE drops f and runs the body if f is still the function inlined,
+// otherwise it calls whatever f is now and skips the body.
+static bool inlineCalls(FlowGraph* graph)
+{
+    if (graph->knownGlobals == NULL || graph->knownGlobals->count == 0 || !graph->shortJumps)
+        return false;
+
+    bool changed = false;
+    for (int i = 0; i < graph->count; i++) {
+        Instruction* load = &graph->code[i];
+        Value        callee;
+        if (load->isDead || load->op != OP_GET_GLOBAL
+            || !tableGet(graph->knownGlobals, graph->chunk->constants.values[load->args[0]], &callee)
+            || !IS_FUNCTION(callee))
+            continue;
+
+        ObjFunction* function = AS_FUNCTION(callee);
+        int          call     = findCall(graph, i, function->arity);
+        if (call == -1)
+            continue;
+
+        Instruction body[MAX_INLINE];
+        int         count = inlineBody(graph, function, body);
+        if (count == -1)
+            continue;
+        int constant = internConstant(graph, callee);
+        if (constant > UINT16_MAX)
+            continue;
+
+        Instruction* site = &graph->code[call];
+        site->op          = OP_INLINE;
+        site->argCount    = 2;
+        site->args[0]     = function->arity;
+        site->args[1]     = (uint32_t)constant;
+
+        // the body keeps the callee's lines, so errors raised in it can
+        // still name the function
+        for (int j = 0; j < count; j++) {
+            Instruction instruction = body[j];
+            instruction.isInlined   = true;
+            instruction.source      = graph->code[call].source;
+            instruction.target      = -1;
+            instruction.cases       = NULL;
+            instruction.caseCount   = 0;
+            instruction.isLong      = false;
+            instruction.isTarget    = false;
+            instruction.isLeader    = false;
+            instruction.isDead      = false;
+            insertInstruction(graph, call + 1 + j, instruction);
+        }
+        graph->code[call].target = call + 1 + count;
+        changed                  = true;
+    }
+
+    return changed;
+}
+
+#define MAX_FOLDED_ARGS 4
+
+// The pool index of the value `use` leaves in place of `module` when the
+// constants in `args` are pushed between the two: a number the module
+// defines, or what one of its pure functions returns. -1 if it can't be
+// worked out here.
+static int foldNative(FlowGraph* graph, NativeModuleEntry* module, Instruction* use, int argCount, Value* args)
+{
+    Value name     = graph->chunk->constants.values[use->args[0]];
+    int   constant = -1;
+
+    // natives push and allocate, which other compiling threads must not
+    // see half done
+    lockHeap();
+    if (use->op == OP_GET_PROPERTY && argCount == 0) {
+        ObjTable* table = loadNativeModule(module);
+        Value     value;
+        if (tableGet(&table->table, name, &value) && IS_NUMBER(value))
+            constant = internConstant(graph, value);
+    } else if (use->op == OP_INVOKE && use->args[1] == (uint32_t)argCount) {
+        NativeFnEntry* entry = findModuleFn(module, AS_STRING(name));
+        if (entry != NULL && entry->pure) {
+            Value* base = vm.stackTop;
+            push(NIL_VAL);
+            for (int i = 0; i < argCount; i++) {
+                push(args[i]);
+            }
+
+            if (entry->function(argCount, vm.stackTop - argCount)) {
+                Value result = base[0];
+                if (!IS_OBJ(result) || IS_STRING(result))
+                    constant = internConstant(graph, result);
+            }
+            vm.stackTop = base;
+        }
+    }
+    unlockHeap();
+
+    return constant;
+}
+
+// Folds what a native module's constants and pure functions give for
+// constant arguments:
+//   GET_GLOBAL math, CONSTANT 2, INVOKE sqrt 1
+//     becomes GET_GLOBAL math, NATIVE_CONSTANT math 1.41, CONSTANT 2, INVOKE sqrt 1
+// NATIVE_CONSTANT replaces the module with the value and skips the rest as
+// long as the global still holds the module and nothing changed the module,
+// otherwise the rest runs as before.
+static bool foldNatives(FlowGraph* graph)
+{
+    if (graph->knownGlobals == NULL || graph->knownGlobals->count == 0 || !graph->shortJumps)
+        return false;
+
+    bool changed = false;
+    for (int i = 0; i < graph->count; i++) {
+        Instruction* load = &graph->code[i];
+        Value        known;
+        if (load->isDead || load->op != OP_GET_GLOBAL
+            || !tableGet(graph->knownGlobals, graph->chunk->constants.values[load->args[0]], &known)
+            || !IS_STRING(known))
+            continue;
+
+        NativeModuleEntry* module = findNativeModule(nativeModules, AS_CSTRING(known));
+        if (module == NULL)
+            continue;
+
+        Value args[MAX_FOLDED_ARGS];
+        int   argCount = 0;
+        int   end      = i + 1;
+        while (argCount < MAX_FOLDED_ARGS && joined(graph, end) != NULL
+            && constantValue(graph, &graph->code[end], &args[argCount])) {
+            argCount++;
+            end++;
+        }
+
+        Instruction* use = joined(graph, end);
+        int          constant;
+        if (use == NULL || (constant = foldNative(graph, module, use, argCount, args)) == -1 || constant > UINT16_MAX)
+            continue;
+
+        Instruction folded = {
+            .op        = OP_NATIVE_CONSTANT,
+            .line      = load->line,
+            .source    = load->source,
+            .argCount  = 2,
+            .args      = { (uint32_t)(module - nativeModules), (uint32_t)constant },
+            .target    = -1,
+            .isInlined = load->isInlined,
+        };
+        insertInstruction(graph, i + 1, folded);
+        graph->code[i + 1].target = end + 2;
+        changed                   = true;
+    }
+
+    return changed;
+}
+
+// Fuses the pieces of a numeric loop:
+//   GET_LOCAL a, GET_LOCAL b / CONSTANT k, LESS, JUMP_IF_FALSE, POP
+//     becomes LESS_LOCAL / LESS_LOCAL_CONST
+//   GET_LOCAL s, INCREMENT, SET_LOCAL s, POP
+//     becomes INCREMENT_LOCAL
+//   INCREMENT_LOCAL s, JUMP back to a LESS_LOCAL on s
+//     becomes FOR_STEP, which keeps the jump as its fallback
+static bool fuseLoops(FlowGraph* graph)
+{
+    bool changed = false;
+    if (!graph->shortJumps)
+        return false;
+
+    for (int i = 0; i < graph->count; i++) {
+        Instruction* first = &graph->code[i];
+        if (first->isDead)
+            continue;
+
+        Instruction* second = joined(graph, i + 1);
+        Instruction* third  = second != NULL ? joined(graph, i + 2) : NULL;
+        Instruction* fourth = third != NULL ? joined(graph, i + 3) : NULL;
+        Instruction* fifth  = fourth != NULL ? fallthrough(graph, i + 4) : NULL;
+
+        if (first->op == OP_GET_LOCAL && fifth != NULL
+            && (second->op == OP_GET_LOCAL || second->op == OP_CONSTANT) && second->args[0] <= UINT16_MAX
+            && third->op == OP_LESS && fourth->op == OP_JUMP_IF_FALSE && fifth->op == OP_POP
+            && fourth->target > i + 4) {
+            first->op       = second->op == OP_GET_LOCAL ? OP_LESS_LOCAL : OP_LESS_LOCAL_CONST;
+            first->args[1]  = second->args[0];
+            first->argCount = 2;
+            first->target   = fourth->target;
+            second->isDead  = true;
+            third->isDead   = true;
+            fourth->isDead  = true;
+            fifth->isDead   = true;
+            changed         = true;
+            continue;
+        }
+
+        if (first->op == OP_GET_LOCAL && fourth != NULL
+            && second->op == OP_INCREMENT && third->op == OP_SET_LOCAL && fourth->op == OP_POP
+            && third->args[0] == first->args[0]) {
+            first->op      = OP_INCREMENT_LOCAL;
+            second->isDead = true;
+            third->isDead  = true;
+            fourth->isDead = true;
+            changed        = true;
+            continue;
+        }
+
+        if (first->op == OP_INCREMENT_LOCAL && second != NULL && second->op == OP_JUMP
+            && second->target < i) {
+            int          condition = second->target;
+            Instruction* compare   = &graph->code[condition];
+            if ((compare->op != OP_LESS_LOCAL && compare->op != OP_LESS_LOCAL_CONST)
+                || compare->args[0] != first->args[0])
+                continue;
+
+            first->op       = compare->op == OP_LESS_LOCAL ? OP_FOR_STEP : OP_FOR_STEP_CONST;
+            first->args[1]  = compare->args[1];
+            first->argCount = 2;
+            first->target   = condition + 1;
+            changed         = true;
+            continue;
+        }
+
+        // the back edge of a for loop jumps to the increment clause, give
+        // it a copy of the fused step so the body loops to itself
+        if (first->op == OP_JUMP && first->target < i && isForStep(graph->code[first->target].op)) {
+            Instruction* step     = &graph->code[first->target];
+            Instruction* fallback = fallthrough(graph, first->target + 1);
+            if (fallback == NULL || fallback->op != OP_JUMP)
+                continue;
+
+            Instruction jump   = *fallback;
+            bool        leader = first->isLeader;
+            jump.line          = first->line;
+            *first             = *step;
+            first->line        = jump.line;
+            first->isLeader    = leader;
+            insertInstruction(graph, i + 1, jump);
+            changed = true;
+            i++;
+        }
+    }
+
+    return changed;
+}
+
+// Whether two instructions report the same place in an error, inlined
+// code names its own function.
+static bool onSameLine(Instruction* a, Instruction* b)
+{
+    return a->line == b->line && a->isInlined == b->isInlined;
+}
+
+// Fuses runs of `single` into the wider forms, e.g. GET_LOCAL GET_LOCAL
+// into GET_LOCAL_2. Ops that can raise an error are only fused within a
+// line so runtime errors keep pointing at the right place.
+static bool fuseRuns(FlowGraph* graph, uint8_t single, uint8_t wide, bool sameLine)
+{
+    bool changed = false;
+
+    for (int i = 0; i < graph->count; i++) {
+        Instruction* first = &graph->code[i];
+        if (first->isDead || first->op != single)
+            continue;
+
+        int next = i + 1;
+        while (first->argCount < 4 && follows(graph, next, single)
+            && (!sameLine || onSameLine(&graph->code[next], first))) {
+            first->args[first->argCount++] = graph->code[next].args[0];
+            graph->code[next].isDead       = true;
+            next++;
+        }
+
+        if (first->argCount > 1) {
+            first->op = wide + (first->argCount - 2);
+            changed   = true;
+        }
+        i = next - 1;
+    }
+
+    return changed;
+}
+
+static bool fuseGlobals(FlowGraph* graph)
+{
+    return fuseRuns(graph, OP_GET_GLOBAL, OP_GET_GLOBAL_2, true);
+}
+
+static bool fuseLocals(FlowGraph* graph)
+{
+    bool changed = fuseRuns(graph, OP_GET_LOCAL, OP_GET_LOCAL_2, false);
+    changed |= fuseRuns(graph, OP_SET_LOCAL, OP_SET_LOCAL_2, false);
+    return changed;
+}
+
+#ifndef OPCODE_PROFILING
+// Fuses the pairs listed in superinstructions.def once every other pass
+// is done, they would hide the single opcodes from the patterns above.
+// Both halves have to share a line so errors still point at the right
+// one, and the final instruction is left alone for the REENTER patch.
+static bool fuseSuperinstructions(FlowGraph* graph)
+{
+    bool changed = false;
+
+    for (int i = 0; i + 2 < graph->count; i++) {
+        Instruction* first  = &graph->code[i];
+        Instruction* second = joined(graph, i + 1);
+        if (first->isDead || second == NULL || !onSameLine(first, second))
+            continue;
+
+        bool wide = false;
+        for (int j = 0; j < first->argCount; j++) {
+            wide |= first->args[j] > UINT16_MAX;
+        }
+        for (int j = 0; j < second->argCount; j++) {
+            wide |= second->args[j] > UINT16_MAX;
+        }
+        if (wide)
+            continue;
+
+        uint8_t fused;
+        switch (first->op << 8 | second->op) {
+#define SUPERINSTRUCTION(a, b, operands)   \
+    case OP_##a << 8 | OP_##b:             \
+        fused = OP_##a##__##b;             \
+        break;
+#include "superinstructions.def"
+#undef SUPERINSTRUCTION
+        default:
+            continue;
+        }
+
+        for (int j = 0; j < second->argCount; j++) {
+            first->args[first->argCount++] = second->args[j];
+        }
+        first->op      = fused;
+        second->isDead = true;
+        changed        = true;
+        i++;
+    }
+
+    return changed;
+}
+
+// Integer literals that fit in a byte are pushed from the operand instead
+// of the pool, which runs before renumbering so their constants are freed.
+static void pushSmallIntegers(FlowGraph* graph)
+{
+    for (int i = 0; i < graph->count; i++) {
+        Instruction* instruction = &graph->code[i];
+        Value        value;
+        if (instruction->op != OP_CONSTANT || !constantValue(graph, instruction, &value) || !IS_NUMBER(value))
+            continue;
+
+        double number = AS_NUMBER(value);
+        if (number >= 0 && number <= UINT8_MAX && number == (int)number && !signbit(number)) {
+            instruction->op      = OP_PUSH_BYTE;
+            instruction->args[0] = (uint16_t)number;
+        }
+    }
+}
+
+static uint8_t byteForm(uint8_t op)
+{
+    switch (op) {
+    case OP_CONSTANT:
+        return OP_CONSTANT_BYTE;
+    case OP_GET_LOCAL:
+        return OP_GET_LOCAL_BYTE;
+    case OP_SET_LOCAL:
+        return OP_SET_LOCAL_BYTE;
+    case OP_GET_GLOBAL:
+        return OP_GET_GLOBAL_BYTE;
+    case OP_SET_GLOBAL:
+        return OP_SET_GLOBAL_BYTE;
+    case OP_GET_UPVALUE:
+        return OP_GET_UPVALUE_BYTE;
+    case OP_SET_UPVALUE:
+        return OP_SET_UPVALUE_BYTE;
+    case OP_CALL:
+        return OP_CALL_BYTE;
+    default:
+        return op;
+    }
+}
+
+// Picks the shortest encoding for each instruction once the constants
+// have their final numbers: no operand for the first four locals and
+// constants, a single byte for anything else below 256.
+static void compactOperands(FlowGraph* graph)
+{
+    for (int i = 0; i < graph->count; i++) {
+        Instruction* instruction = &graph->code[i];
+        if (instruction->argCount != 1 || instruction->args[0] > UINT8_MAX)
+            continue;
+
+        if (instruction->op == OP_GET_LOCAL && instruction->args[0] < 4) {
+            instruction->op       = OP_LOAD_LOCAL_0 + instruction->args[0];
+            instruction->argCount = 0;
+        } else if (instruction->op == OP_CONSTANT && instruction->args[0] < 4) {
+            instruction->op       = OP_LOAD_CONSTANT_0 + instruction->args[0];
+            instruction->argCount = 0;
+        } else {
+            instruction->op = byteForm(instruction->op);
+        }
+    }
+}
+#endif
+
+static bool mergePops(FlowGraph* graph)
+{
+    bool changed = false;
+
+    for (int i = 0; i < graph->count; i++) {
+        Instruction* first = &graph->code[i];
+        if (first->isDead || (first->op != OP_POP && first->op != OP_POP_N))
+            continue;
+
+        int count = first->op == OP_POP ? 1 : first->args[0];
+        int next  = i + 1;
+        while (count < UINT8_MAX && follows(graph, next, OP_POP)) {
+            graph->code[next].isDead = true;
+            count++;
+            next++;
+        }
+
+        if (next > i + 1) {
+            first->op       = OP_POP_N;
+            first->argCount = 1;
+            first->args[0]  = (uint16_t)count;
+            changed         = true;
+        }
+        i = next - 1;
+    }
+
+    return changed;
+}
+
+// Whether `jump` can skip straight to where `next` would send it. Jumps
+// that leave the condition on the stack may also pass through another
+// JUMP_IF_FALSE, which tests the same value.
+static bool canThread(Instruction* jump, Instruction* next)
+{
+    switch (jump->op) {
+    case OP_JUMP_IF_FALSE:
+    case OP_LESS_LOCAL:
+    case OP_LESS_LOCAL_CONST:
+        return next->op == OP_JUMP || next->op == OP_JUMP_IF_FALSE;
+    default:
+        return next->op == OP_JUMP;
+    }
+}
+
+static bool threadJumps(FlowGraph* graph)
+{
+    bool changed = false;
+
+    for (int i = 0; i < graph->count; i++) {
+        Instruction* jump = &graph->code[i];
+        if (jump->isDead || !isJump(jump))
+            continue;
+        if (!graph->shortJumps && jump->op != OP_JUMP && jump->op != OP_JUMP_IF_FALSE)
+            continue;
+
+        // conditional jumps only go forward, FOR_STEP only goes back
+        bool forward  = jump->op != OP_JUMP && jump->op != OP_FOR_STEP && jump->op != OP_FOR_STEP_CONST;
+        bool backward = jump->op == OP_FOR_STEP || jump->op == OP_FOR_STEP_CONST;
+
+        int target = jump->target;
+        for (int steps = 0; steps < graph->count && target < graph->count; steps++) {
+            Instruction* next = &graph->code[target];
+            if (!canThread(jump, next) || next->target == target)
+                break;
+            if ((forward && next->target <= i) || (backward && next->target > i))
+                break;
+            target = next->target;
+        }
+
+        if (target != jump->target) {
+            jump->target = target;
+            changed      = true;
+        }
+
+        // a jump to the very next instruction does nothing
+        if (jump->op == OP_JUMP && jump->target == i + 1) {
+            jump->isDead = true;
+            changed      = true;
+        }
+    }
+
+    return changed;
+}
+
+static bool eliminateDeadCode(FlowGraph* graph)
+{
+    if (graph->count == 0)
+        return false;
+
+    bool* reachable = ALLOCATE(bool, graph->count);
+    int*  worklist  = ALLOCATE(int, graph->count);
+    int   pending   = 0;
+
+    for (int i = 0; i < graph->count; i++) {
+        reachable[i] = false;
+    }
+
+    reachable[0]        = true;
+    worklist[pending++] = 0;
+
+    while (pending > 0) {
+        int i = worklist[--pending];
+        for (; i < graph->count; i++) {
+            Instruction* instruction = &graph->code[i];
+            reachable[i]             = true;
+
+            if (isJump(instruction) && instruction->target < graph->count && !reachable[instruction->target]) {
+                reachable[instruction->target] = true;
+                worklist[pending++]            = instruction->target;
+            }
+            for (int j = 0; j < instruction->caseCount; j++) {
+                int target = instruction->cases[j];
+                if (target < graph->count && !reachable[target]) {
+                    reachable[target]   = true;
+                    worklist[pending++] = target;
+                }
+            }
+
+            if (isTerminator(instruction->op))
+                break;
+            if (i + 1 < graph->count && reachable[i + 1])
+                break;
+        }
+    }
+
+    // the final instruction always stays, native callbacks patch the last
+    // byte of a chunk to re-enter the interpreter
+    bool changed = false;
+    for (int i = 0; i < graph->count - 1; i++) {
+        if (!reachable[i] && !graph->code[i].isDead) {
+            graph->code[i].isDead = true;
+            changed               = true;
+        }
+    }
+
+    FREE_ARRAY(bool, reachable, graph->count);
+    FREE_ARRAY(int, worklist, graph->count);
+    return changed;
+}
+
+// Numbers the pool entries that are still referenced, folding leaves its
+// operands behind, and points the instructions at the new numbers.
+static int* renumberConstants(FlowGraph* graph)
+{
+    ValueArray* constants = &graph->chunk->constants;
+    int*        newIndex  = ALLOCATE(int, constants->count);
+    for (unsigned int i = 0; i < constants->count; i++) {
+        newIndex[i] = -1;
+    }
+
+    for (int i = 0; i < graph->count; i++) {
+        Instruction* instruction = &graph->code[i];
+        for (int j = 0; j < instruction->argCount; j++) {
+            if (isConstantOperand(instruction->op, j))
+                newIndex[instruction->args[j]] = 0;
+        }
+    }
+
+    int live = 0;
+    for (unsigned int i = 0; i < constants->count; i++) {
+        if (newIndex[i] != -1)
+            newIndex[i] = live++;
+    }
+
+    for (int i = 0; i < graph->count; i++) {
+        Instruction* instruction = &graph->code[i];
+        for (int j = 0; j < instruction->argCount; j++) {
+            if (isConstantOperand(instruction->op, j))
+                instruction->args[j] = (uint32_t)newIndex[instruction->args[j]];
+        }
+    }
+
+    return newIndex;
+}
+
+static void dropConstants(ValueArray* constants, int* newIndex)
+{
+    int live = 0;
+    for (unsigned int i = 0; i < constants->count; i++) {
+        if (newIndex[i] != -1)
+            constants->values[live++] = constants->values[i];
+    }
+    constants->count = live;
+}
+
+static OptimizerPass passes[] = {
+    inlineCalls,
+    foldNatives,
+    foldConstants,
+    foldBranches,
+    dropUnusedConstants,
+    propagateLocals,
+    eliminateDeadStores,
+    eliminateCommonSubexpressions,
+    hoistInvariants,
+    reuseProperties,
+    eliminateDeadCode,
+    threadJumps,
+    fuseLoops,
+    fuseGlobals,
+    fuseLocals,
+    mergePops,
+    NULL,
+};
+
+static void emitByteTo(Chunk* chunk, uint8_t byte, Instruction* instruction)
+{
+    writeInlinedChunk(chunk, byte, instruction->line, instruction->isInlined);
+}
+
+static void emitShortTo(Chunk* chunk, uint16_t value, Instruction* instruction)
+{
+    emitByteTo(chunk, (value >> 8) & 0xff, instruction);
+    emitByteTo(chunk, value & 0xff, instruction);
+}
+
+static void emitLongTo(Chunk* chunk, uint32_t value, Instruction* instruction)
+{
+    emitShortTo(chunk, (uint16_t)(value >> 16), instruction);
+    emitShortTo(chunk, (uint16_t)(value & 0xffff), instruction);
+}
+
+static void layOut(FlowGraph* graph, int* offsets)
+{
+    int offset = 0;
+    for (int i = 0; i < graph->count; i++) {
+        offsets[i] = offset;
+        offset += encodedLength(&graph->code[i]);
+    }
+    offsets[graph->count] = offset;
+}
+
+// Jumps start short and switch to their long form when the distance
+// doesn't fit in 16 bits. Growing one can push others past the limit, so
+// this repeats until nothing grows.
+static void relaxJumps(FlowGraph* graph, int* offsets)
+{
+    for (bool grew = true; grew;) {
+        layOut(graph, offsets);
+        grew = false;
+
+        for (int i = 0; i < graph->count; i++) {
+            Instruction* instruction = &graph->code[i];
+            if ((instruction->op != OP_JUMP && instruction->op != OP_JUMP_IF_FALSE) || instruction->isLong)
+                continue;
+
+            int from = offsets[i] + 3;
+            int to   = offsets[instruction->target];
+            if ((to >= from ? to - from : from - to) > UINT16_MAX) {
+                instruction->isLong = true;
+                grew                = true;
+            }
+        }
+    }
+}
+
+static bool emitGraph(FlowGraph* graph, Chunk* chunk)
+{
+    int* offsets = ALLOCATE(int, graph->count + 1);
+    relaxJumps(graph, offsets);
+
+    Chunk output;
+    initChunk(&output);
+
+    bool valid = true;
+    for (int i = 0; valid && i < graph->count; i++) {
+        Instruction* instruction = &graph->code[i];
+
+        switch (instruction->op) {
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE: {
+            int from     = offsets[i] + encodedLength(instruction);
+            int to       = offsets[instruction->target];
+            int distance = to >= from ? to - from : from - to;
+            if (instruction->op == OP_JUMP_IF_FALSE && to < from) {
+                valid = false;
+                break;
+            }
+
+            if (instruction->isLong) {
+                uint8_t op = OP_LOOP_LONG;
+                if (to >= from)
+                    op = instruction->op == OP_JUMP ? OP_JUMP_LONG : OP_JUMP_IF_FALSE_LONG;
+                emitByteTo(&output, op, instruction);
+                emitLongTo(&output, (uint32_t)distance, instruction);
+            } else {
+                emitByteTo(&output, to >= from ? instruction->op : OP_LOOP, instruction);
+                emitShortTo(&output, (uint16_t)distance, instruction);
+            }
+            break;
+        }
+        case OP_CONSTANT:
+            if (instruction->args[0] > UINT16_MAX) {
+                emitByteTo(&output, OP_CONSTANT_LONG, instruction);
+                emitLongTo(&output, instruction->args[0], instruction);
+            } else {
+                emitByteTo(&output, instruction->op, instruction);
+                emitShortTo(&output, (uint16_t)instruction->args[0], instruction);
+            }
+            break;
+        case OP_LESS_LOCAL:
+        case OP_LESS_LOCAL_CONST: {
+            int from = offsets[i] + 8;
+            int to   = offsets[instruction->target];
+            if (to < from || to - from > UINT16_MAX) {
+                valid = false;
+                break;
+            }
+            emitByteTo(&output, instruction->op, instruction);
+            emitShortTo(&output, instruction->args[0], instruction);
+            emitShortTo(&output, instruction->args[1], instruction);
+            emitByteTo(&output, OP_JUMP_IF_FALSE, instruction);
+            emitShortTo(&output, (uint16_t)(to - from), instruction);
+            emitByteTo(&output, OP_POP, instruction);
+            break;
+        }
+        case OP_FOR_STEP:
+        case OP_FOR_STEP_CONST: {
+            int from = offsets[i] + 7;
+            int to   = offsets[instruction->target];
+            if (to > from || from - to > UINT16_MAX) {
+                valid = false;
+                break;
+            }
+            emitByteTo(&output, instruction->op, instruction);
+            emitShortTo(&output, instruction->args[0], instruction);
+            emitShortTo(&output, instruction->args[1], instruction);
+            emitShortTo(&output, (uint16_t)(from - to), instruction);
+            break;
+        }
+        case OP_INLINE:
+        case OP_NATIVE_CONSTANT: {
+            int from = offsets[i] + 7;
+            int to   = offsets[instruction->target];
+            if (to < from || to - from > UINT16_MAX) {
+                valid = false;
+                break;
+            }
+            emitByteTo(&output, instruction->op, instruction);
+            emitShortTo(&output, instruction->args[0], instruction);
+            emitShortTo(&output, instruction->args[1], instruction);
+            emitShortTo(&output, (uint16_t)(to - from), instruction);
+            break;
+        }
+        case OP_GET_HOISTED: {
+            int from = offsets[i] + 5;
+            int to   = offsets[instruction->target];
+            if (to < from || to - from > UINT16_MAX) {
+                valid = false;
+                break;
+            }
+            emitByteTo(&output, instruction->op, instruction);
+            emitShortTo(&output, instruction->args[0], instruction);
+            emitShortTo(&output, (uint16_t)(to - from), instruction);
+            break;
+        }
+        case OP_SWITCH_TABLE: {
+            int base = offsets[i] + encodedLength(instruction);
+            emitByteTo(&output, instruction->op, instruction);
+            emitShortTo(&output, instruction->args[0], instruction);
+            emitShortTo(&output, (uint16_t)instruction->caseCount, instruction);
+            for (int j = -1; valid && j < instruction->caseCount; j++) {
+                int to = offsets[j == -1 ? instruction->target : instruction->cases[j]];
+                if (to < base || to - base > UINT16_MAX) {
+                    valid = false;
+                    break;
+                }
+                emitShortTo(&output, (uint16_t)(to - base), instruction);
+            }
+            break;
+        }
+        case OP_CLOSURE:
+            emitByteTo(&output, instruction->op, instruction);
+            emitShortTo(&output, instruction->args[0], instruction);
+            for (int j = 3; j < instruction->length; j++) {
+                emitByteTo(&output, chunk->code[instruction->source + j], instruction);
+            }
+            break;
+        case OP_POP_N:
+        case OP_PEEK:
+            emitByteTo(&output, instruction->op, instruction);
+            emitByteTo(&output, (uint8_t)instruction->args[0], instruction);
+            break;
+        default:
+            if (isByteForm(instruction->op)) {
+                emitByteTo(&output, instruction->op, instruction);
+                emitByteTo(&output, (uint8_t)instruction->args[0], instruction);
+                break;
+            }
+            // only OP_CONSTANT has a form for constants past 16 bits
+            for (int j = 0; j < instruction->argCount; j++) {
+                if (instruction->args[j] > UINT16_MAX)
+                    valid = false;
+            }
+            emitByteTo(&output, instruction->op, instruction);
+            for (int j = 0; j < instruction->argCount; j++) {
+                emitShortTo(&output, instruction->args[j], instruction);
+            }
+            break;
+        }
+    }
+
+    FREE_ARRAY(int, offsets, graph->count + 1);
+
+    if (!valid) {
+        FREE_ARRAY(uint8_t, output.code, output.capacity);
+        FREE_ARRAY(LineStart, output.lines, output.lineCapacity);
+        return false;
+    }
+
+    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+    FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
+    chunk->code         = output.code;
+    chunk->count        = output.count;
+    chunk->capacity     = output.capacity;
+    chunk->lines        = output.lines;
+    chunk->lineCount    = output.lineCount;
+    chunk->lineCapacity = output.lineCapacity;
+    return true;
+}
+
+// `shortJumps` allows the instructions whose jumps always take 16 bits,
+// the fused loops, switch tables and hoisted loads, to be created or
+// retargeted.
+static bool optimizeGraph(Chunk* chunk, int arity, bool shortJumps, Table* knownGlobals)
+{
+    FlowGraph graph;
+    if (!decodeChunk(&graph, chunk))
+        return false;
+    graph.shortJumps   = shortJumps;
+    graph.knownGlobals = knownGlobals;
+    graph.arity        = arity;
+
+    for (int round = 0; round < MAX_ROUNDS; round++) {
+        bool changed = false;
+        for (OptimizerPass* pass = passes; *pass != NULL; pass++) {
+            findLeaders(&graph);
+            if ((*pass)(&graph)) {
+                compact(&graph);
+                changed = true;
+            }
+        }
+
+        if (!changed)
+            break;
+    }
+
+    // profiling builds keep to the plain opcodes so the pair counts stay
+    // comparable with the superinstructions already generated
+#ifndef OPCODE_PROFILING
+    findLeaders(&graph);
+    if (fuseSuperinstructions(&graph))
+        compact(&graph);
+    pushSmallIntegers(&graph);
+#endif
+
+    int  constantCount = chunk->constants.count;
+    int* newIndex      = renumberConstants(&graph);
+#ifndef OPCODE_PROFILING
+    compactOperands(&graph);
+#endif
+    bool emitted = emitGraph(&graph, chunk);
+    if (emitted)
+        dropConstants(&chunk->constants, newIndex);
+
+    FREE_ARRAY(int, newIndex, constantCount);
+    freeGraph(&graph);
+    return emitted;
+}
+
+void optimizeChunk(Chunk* chunk, int arity, Table* knownGlobals)
+{
+    // in a very large function a fused loop can end up too long for its
+    // jump, the chunk is then optimized again without them
+    if (!optimizeGraph(chunk, arity, true, knownGlobals))
+        optimizeGraph(chunk, arity, false, knownGlobals);
+}
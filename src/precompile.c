@@ -0,0 +1,144 @@
+#include "precompile.h"
+
+#include "cache.h"
+#include "compiler.h"
+#include "memory.h"
+#include "vm.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+// Before a script runs, the files it imports through string literals are
+// compiled ahead of time, a wave of newly found imports at a time with each
+// wave spread over a thread per core. OP_IMPORT then takes the compiled
+// function from vm.precompiled instead of compiling the file itself. A file
+// that fails to compile here is compiled again by OP_IMPORT, so its errors
+// are still reported when the import runs.
+
+#define MAX_COMPILE_THREADS 64
+
+typedef struct {
+    char*        path;
+    ObjFunction* function;
+} PendingImport;
+
+typedef struct {
+    PendingImport* imports;
+    int            count;
+    int            capacity;
+    atomic_int     next;
+} ImportWave;
+
+static void queueImport(const char* name, ObjFunction* importer, void* context)
+{
+    ImportWave* wave = (ImportWave*)context;
+    char*       path = (char*)resolveRelativePath(name, importer->source);
+    Value       key  = OBJ_VAL(copyString(path, (int)strlen(path)));
+    Value       existing;
+
+    // seen files are recorded as nil until they are compiled, so each one
+    // is only queued once
+    if (tableGet(&vm.precompiled, key, &existing) || access(path, R_OK) != 0) {
+        free(path);
+        return;
+    }
+
+    push(key);
+    tableSet(&vm.precompiled, key, NIL_VAL);
+    pop();
+
+    if (wave->count == wave->capacity) {
+        wave->capacity = GROW_CAPACITY(wave->capacity);
+        wave->imports  = realloc(wave->imports, sizeof(PendingImport) * wave->capacity);
+    }
+    wave->imports[wave->count++] = (PendingImport) { path, NULL };
+}
+
+static void* compileImports(void* context)
+{
+    ImportWave* wave = (ImportWave*)context;
+    silentErrors     = true;
+
+    int i;
+    while ((i = atomic_fetch_add(&wave->next, 1)) < wave->count) {
+        PendingImport* import = &wave->imports[i];
+        utf8_int8_t*   source = readFile(import->path);
+        import->function      = compileCached(import->path, source);
+        free(source);
+    }
+
+    silentErrors = false;
+    return NULL;
+}
+
+static void compileWave(ImportWave* wave)
+{
+    pthread_t threads[MAX_COMPILE_THREADS];
+    long      cores   = sysconf(_SC_NPROCESSORS_ONLN);
+    int       started = 0;
+    int       wanted  = (int)(cores < wave->count ? cores : wave->count) - 1;
+    if (wanted > MAX_COMPILE_THREADS)
+        wanted = MAX_COMPILE_THREADS;
+
+    shareHeap(true);
+    while (started < wanted && pthread_create(&threads[started], NULL, compileImports, wave) == 0)
+        started++;
+
+    // this thread compiles too, and alone when no thread could start
+    compileImports(wave);
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    // nothing is collected while the heap is shared, so the new functions
+    // are safe until they are in the table
+    for (int i = 0; i < wave->count; i++) {
+        PendingImport* import = &wave->imports[i];
+        if (import->function == NULL)
+            continue;
+
+        Value key = OBJ_VAL(copyString(import->path, (int)strlen(import->path)));
+        push(key);
+        tableSet(&vm.precompiled, key, OBJ_VAL(import->function));
+        pop();
+    }
+    shareHeap(false);
+}
+
+void precompileImports(ObjFunction* script)
+{
+    ImportWave wave = { NULL, 0, 0, 0 };
+    push(OBJ_VAL(script));
+    findImports(script, queueImport, &wave);
+
+    while (wave.count > 0) {
+        compileWave(&wave);
+
+        ImportWave next = { NULL, 0, 0, 0 };
+        for (int i = 0; i < wave.count; i++) {
+            // a compiled module keeps its path as its source
+            if (wave.imports[i].function != NULL)
+                findImports(wave.imports[i].function, queueImport, &next);
+            else
+                free(wave.imports[i].path);
+        }
+
+        free(wave.imports);
+        wave = next;
+    }
+
+    pop();
+}
+
+ObjFunction* takePrecompiled(const char* path)
+{
+    if (vm.precompiled.count == 0)
+        return NULL;
+
+    Value key = OBJ_VAL(copyString(path, (int)strlen(path)));
+    Value function;
+    if (!tableGet(&vm.precompiled, key, &function) || !IS_FUNCTION(function))
+        return NULL;
+
+    tableDelete(&vm.precompiled, key);
+    return AS_FUNCTION(function);
+}
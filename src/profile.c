@@ -0,0 +1,85 @@
+#include "profile.h"
+
+#include "vm.h"
+
+#ifdef OPCODE_PROFILING
+
+// Counts how often each opcode directly follows another while running, and
+// merges the counts into a plain text file, one "count first second" line
+// per pair. tools/superinstructions.py turns the busiest pairs into
+// superinstructions.def.
+
+static const char* opcodeNames[] = {
+#define OPCODE(op) #op,
+#include "opcodes.h"
+#undef OPCODE
+};
+
+static const char* profilePath = NULL;
+
+static int findOpcode(const char* name)
+{
+    for (int op = 0; op < OPCODE_COUNT; op++) {
+        if (strcmp(opcodeNames[op], name) == 0)
+            return op;
+    }
+    return -1;
+}
+
+static void readPairProfile(void)
+{
+    FILE* file = fopen(profilePath, "r");
+    if (file == NULL)
+        return;
+
+    char line[256];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        unsigned long long count;
+        char               first[64];
+        char               second[64];
+        if (line[0] == '#' || sscanf(line, "%llu %63s %63s", &count, first, second) != 3)
+            continue;
+
+        int a = findOpcode(first);
+        int b = findOpcode(second);
+        if (a != -1 && b != -1)
+            vm.pairCounts[a * OPCODE_COUNT + b] += count;
+    }
+
+    fclose(file);
+}
+
+static void writePairProfile(void)
+{
+    FILE* file = fopen(profilePath, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Could not write profile \"%s\".\n", profilePath);
+        return;
+    }
+
+    fprintf(file, "# count first second\n");
+    for (int a = 0; a < OPCODE_COUNT; a++) {
+        for (int b = 0; b < OPCODE_COUNT; b++) {
+            uint64_t count = vm.pairCounts[a * OPCODE_COUNT + b];
+            if (count != 0)
+                fprintf(file, "%llu %s %s\n", (unsigned long long)count, opcodeNames[a], opcodeNames[b]);
+        }
+    }
+
+    fclose(file);
+}
+
+void startPairProfile(const char* path)
+{
+    profilePath   = path;
+    vm.pairCounts = calloc(OPCODE_COUNT * OPCODE_COUNT, sizeof(uint64_t));
+    if (vm.pairCounts == NULL) {
+        fprintf(stderr, "Not enough memory to profile opcode pairs.\n");
+        exit(74);
+    }
+
+    readPairProfile();
+    atexit(writePairProfile);
+}
+
+#endif
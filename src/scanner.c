@@ -5,35 +5,72 @@
 #include "identifiers.def"
 #include "scanner.h"
 
-typedef struct
-{
-    utf8_int8_t* start;
-    utf8_int8_t* current;
-    int          line;
-} Scanner;
-
-Scanner scanner;
+static _Thread_local Scanner scanner;
+
+enum {
+    CHAR_ALPHA = 1 << 0, // letters, '_' and every byte of a multibyte character
+    CHAR_DIGIT = 1 << 1,
+    CHAR_HEX   = 1 << 2,
+    CHAR_SPACE = 1 << 3, // ' ', '\r' and '\t'
+};
+
+#define CHAR_CLASS(c)                                                                                   \
+    ((((c) >= 'a' && (c) <= 'z') || ((c) >= 'A' && (c) <= 'Z') || (c) == '_' || (c) > 0x7F ? CHAR_ALPHA : 0) \
+        | ((c) >= '0' && (c) <= '9' ? CHAR_DIGIT | CHAR_HEX : 0)                                        \
+        | (((c) >= 'a' && (c) <= 'f') || ((c) >= 'A' && (c) <= 'F') ? CHAR_HEX : 0)                      \
+        | ((c) == ' ' || (c) == '\r' || (c) == '\t' ? CHAR_SPACE : 0))
+#define CHAR_CLASS4(c) CHAR_CLASS(c), CHAR_CLASS(c + 1), CHAR_CLASS(c + 2), CHAR_CLASS(c + 3)
+#define CHAR_CLASS16(c) CHAR_CLASS4(c), CHAR_CLASS4(c + 4), CHAR_CLASS4(c + 8), CHAR_CLASS4(c + 12)
+#define CHAR_CLASS64(c) CHAR_CLASS16(c), CHAR_CLASS16(c + 16), CHAR_CLASS16(c + 32), CHAR_CLASS16(c + 48)
+
+// Classes of every byte value. Bytes of multibyte UTF-8 characters are
+// all >= 0x80, so runs of them can be classified a byte at a time too.
+static const uint8_t charClass[256] = {
+    CHAR_CLASS64(0),
+    CHAR_CLASS64(64),
+    CHAR_CLASS64(128),
+    CHAR_CLASS64(192),
+};
+
+#undef CHAR_CLASS64
+#undef CHAR_CLASS16
+#undef CHAR_CLASS4
+#undef CHAR_CLASS
+
+#define CLASS_OF(c) charClass[(uint8_t)(c)]
 
 void initScanner(utf8_int8_t* source)
 {
     scanner.start   = (utf8_int8_t*)source;
     scanner.current = (utf8_int8_t*)source;
+    scanner.end     = (utf8_int8_t*)source + strlen(source);
     scanner.line    = 1;
 }
 
-static bool isAlpha(utf8_int32_t c)
+void initScannerAt(utf8_int8_t* source, int line)
+{
+    initScanner(source);
+    scanner.line = line;
+}
+
+Scanner saveScanner(void)
 {
-    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' || c > 0x7F;
+    return scanner;
 }
 
-static bool isDigit(char c)
+void restoreScanner(Scanner state)
 {
-    return c >= '0' && c <= '9';
+    scanner = state;
 }
 
-static bool isHexDigit(char c)
+static bool isDigit(utf8_int32_t c)
 {
-    return isDigit(c) || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+    return c < 0x80 && (CLASS_OF(c) & CHAR_DIGIT);
+}
+
+static bool isHexDigit(utf8_int32_t c)
+{
+    return c < 0x80 && (CLASS_OF(c) & CHAR_HEX);
 }
 
 static bool isOctalDigit(char c)
@@ -56,10 +93,21 @@ utf8_int32_t previous()
     return *(scanner.current - 1);
 }
 
+// Decodes the character at `at` into `codepoint` and returns where the next
+// one starts. ASCII, which is nearly all of a script, skips the decoder.
+static inline utf8_int8_t* decode(utf8_int8_t* at, utf8_int32_t* codepoint)
+{
+    if ((uint8_t)*at < 0x80) {
+        *codepoint = (uint8_t)*at;
+        return at + 1;
+    }
+    return utf8codepoint(at, codepoint);
+}
+
 utf8_int32_t peek()
 {
-    utf8_int32_t codepoint = 0;
-    utf8codepoint(scanner.current, &codepoint);
+    utf8_int32_t codepoint;
+    decode(scanner.current, &codepoint);
     return codepoint;
 }
 
@@ -68,9 +116,8 @@ utf8_int32_t peekNext()
     if (isAtEnd())
         return '\0';
 
-    utf8_int32_t peek      = 0;
-    utf8_int32_t codepoint = 0;
-    utf8codepoint(utf8codepoint(scanner.current, &peek), &codepoint);
+    utf8_int32_t codepoint;
+    decode(decode(scanner.current, &codepoint), &codepoint);
     return codepoint;
 }
 
@@ -79,27 +126,27 @@ utf8_int32_t peekNextNext()
     if (isAtEnd())
         return '\0';
 
-    utf8_int32_t peek      = 0;
-    utf8_int32_t codepoint = 0;
-    utf8codepoint(utf8codepoint(utf8codepoint(scanner.current, &peek), &peek), &codepoint);
+    utf8_int32_t codepoint;
+    utf8_int8_t* next = decode(scanner.current, &codepoint);
+    if (codepoint == '\0' || *next == '\0')
+        return '\0';
+    decode(decode(next, &codepoint), &codepoint);
     return codepoint;
 }
 
 utf8_int32_t advance()
 {
-    utf8_int32_t codepoint = 0;
-    utf8_int8_t* end       = utf8codepoint(scanner.current, &codepoint);
-    scanner.current        = end;
+    utf8_int32_t codepoint;
+    scanner.current = decode(scanner.current, &codepoint);
     return codepoint;
 }
 
-static bool match(utf8_int32_t expected)
+// `expected` is always ASCII, and no byte of a multibyte character is.
+static bool match(char expected)
 {
-    if (isAtEnd())
-        return false;
-    if (peek() != expected)
+    if (*scanner.current != expected || isAtEnd())
         return false;
-    scanner.current += utf8codepointsize(expected);
+    scanner.current++;
     return true;
 }
 
@@ -123,25 +170,42 @@ static Token errorToken(utf8_int8_t* message)
     return token;
 }
 
+// Indentation comes in long runs of spaces, which are skipped a word at a
+// time while there are eight bytes left to compare.
+static void skipSpaces()
+{
+    const uint64_t spaces = 0x2020202020202020;
+    uint64_t       word;
+
+    while (scanner.end - scanner.current >= 8) {
+        memcpy(&word, scanner.current, sizeof(word));
+        if (word != spaces)
+            break;
+        scanner.current += 8;
+    }
+
+    while (CLASS_OF(*scanner.current) & CHAR_SPACE)
+        scanner.current++;
+}
+
 static void skipWhitespace()
 {
     for (;;) {
-        utf8_int32_t c = peek();
-        switch (c) {
+        switch (*scanner.current) {
         case ' ':
         case '\r':
         case '\t':
-            advance();
+            skipSpaces();
             break;
         case '\n':
             scanner.line++;
-            advance();
+            scanner.current++;
             break;
         case '/':
             if (peekNext() == '/') {
                 // A comment goes until the end of the line.
-                while (peek() != '\n' && !isAtEnd())
-                    advance();
+                utf8_int8_t* newline = memchr(scanner.current, '\n', scanner.end - scanner.current);
+                scanner.current      = newline != NULL ? newline : scanner.end;
             } else if (peekNext() == '*') {
                 // A comment goes until the end of the block.
                 while (!(peek() == '*' && peekNext() == '/') && !isAtEnd()) {
@@ -183,12 +247,12 @@ static TokenType identifierType()
 
 static Token identifier()
 {
-    while (isAlpha(peek()) || isDigit(peek()))
-        advance();
+    while (CLASS_OF(*scanner.current) & (CHAR_ALPHA | CHAR_DIGIT))
+        scanner.current++;
     return makeToken(identifierType());
 }
 
-static Token number(const char c)
+static Token number(utf8_int32_t c)
 {
     bool couldBeHex    = c == '0' && peek() == 'x';
     bool couldBeBinary = c == '0' && peek() == 'b';
@@ -224,10 +288,10 @@ static Token number(const char c)
 
 static Token string()
 {
-    while (peek() != '"' && !isAtEnd()) {
-        if (peek() == '\n')
+    while (*scanner.current != '"' && !isAtEnd()) {
+        if (*scanner.current == '\n')
             scanner.line++;
-        advance();
+        scanner.current++;
     }
 
     if (isAtEnd())
@@ -263,10 +327,10 @@ static Token heredoc()
 
 static Token stringSingle()
 {
-    while (peek() != '\'' && !isAtEnd()) {
-        if (peek() == '\n')
+    while (*scanner.current != '\'' && !isAtEnd()) {
+        if (*scanner.current == '\n')
             scanner.line++;
-        advance();
+        scanner.current++;
     }
 
     if (isAtEnd())
@@ -284,11 +348,11 @@ Token scanToken()
     if (isAtEnd())
         return makeToken(TOKEN_EOF);
 
-    utf8_int32_t c = advance();
-
-    if (isAlpha(c))
+    if (CLASS_OF(*scanner.current) & CHAR_ALPHA)
         return identifier();
 
+    utf8_int32_t c = advance();
+
     if (isDigit(c))
         return number(c);
 
@@ -8,9 +8,10 @@
 
 void initTable(Table* table)
 {
-    table->count    = 0;
-    table->capacity = 0;
-    table->entries  = NULL;
+    table->count      = 0;
+    table->tombstones = 0;
+    table->capacity   = 0;
+    table->entries    = NULL;
 }
 
 void freeTable(Table* table)
@@ -66,7 +67,8 @@ static void adjustCapacity(Table* table, unsigned int capacity)
         entries[i].value = NIL_VAL;
     }
 
-    table->count = 0;
+    table->count      = 0;
+    table->tombstones = 0;
     for (unsigned int i = 0; i < table->capacity; i++) {
         Entry* entry = &table->entries[i];
         if (IS_EMPTY(entry->key))
@@ -85,15 +87,20 @@ static void adjustCapacity(Table* table, unsigned int capacity)
 
 bool tableSet(Table* table, Value key, Value value)
 {
-    if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
+    // deleted entries still take up probe slots, so they count towards the
+    // load until the table is rebuilt
+    if (table->count + table->tombstones + 1 > table->capacity * TABLE_MAX_LOAD) {
         int capacity = GROW_CAPACITY(table->capacity);
         adjustCapacity(table, capacity);
     }
 
     Entry* entry    = findEntry(table->entries, table->capacity, key);
     bool   isNewKey = IS_EMPTY(entry->key);
-    if (isNewKey && IS_NIL(entry->value))
+    if (isNewKey) {
         table->count++;
+        if (!IS_NIL(entry->value))
+            table->tombstones--;
+    }
 
     entry->key   = key;
     entry->value = value;
@@ -114,6 +121,7 @@ bool tableDelete(Table* table, Value key)
     entry->key   = EMPTY_VAL;
     entry->value = BOOL_VAL(true);
     table->count--;
+    table->tombstones++;
     return true;
 }
 
@@ -140,12 +148,12 @@ ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t
             // Stop if we find an empty non-tombstone entry.
             if (IS_NIL(entry->value))
                 return NULL;
-        }
-
-        ObjString* string = AS_STRING(entry->key);
-        if (string->length == length && memcmp(string->chars, chars, length) == 0) {
-            // We found it.
-            return string;
+        } else {
+            ObjString* string = AS_STRING(entry->key);
+            if (string->length == length && memcmp(string->chars, chars, length) == 0) {
+                // We found it.
+                return string;
+            }
         }
 
         index = (index + 1) & (table->capacity - 1);
@@ -181,7 +189,8 @@ void tableRemoveWhite(Table* table)
 {
     for (unsigned int i = 0; i < table->capacity; i++) {
         Entry* entry = &table->entries[i];
-        if (IS_EMPTY(entry->key)) {
+        if (!IS_EMPTY(entry->key) && IS_OBJ(entry->key) && !AS_OBJ(entry->key)->isMarked
+            && !AS_OBJ(entry->key)->isImmortal) {
             tableDelete(table, entry->key);
         }
     }
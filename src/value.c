@@ -112,6 +112,8 @@ uint32_t hashValue(Value value)
         return AS_STRING(value)->hash;
     } else if (IS_EMPTY(value)) {
         return 0;
+    } else if (IS_POINTER(value)) {
+        return (uint32_t)(uintptr_t)AS_POINTER(value);
     }
 #else
     switch (value.type) {
@@ -1,11 +1,15 @@
 #include <libgen.h>
 #include <math.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "cache.h"
 #include "compiler.h"
 #include "debug.h"
+#include "image.h"
 #include "ph_string.h"
+#include "precompile.h"
 #include "vm.h"
 
 VM vm;
@@ -29,9 +33,19 @@ void runtimeError(const char* format, ...)
     for (int i = vm.frameCount - 1; i >= 0; i--) {
         CallFrame*   frame       = &vm.frames[i];
         ObjFunction* function    = frame->closure->function;
-        size_t       instruction = frame->ip - function->chunk.code - 1;
-        fprintf(stderr, "[line %d] in ",
-            (int)AS_NUMBER(function->chunk.lines.values[instruction]));
+        Chunk*       chunk       = &function->chunk;
+        int          instruction = (int)(frame->ip - chunk->code - 1);
+
+        // code the optimizer inlined reports its own function, and then the
+        // call it runs in place of
+        int site = getInlineSite(chunk, instruction);
+        if (site != -1) {
+            ObjFunction* inlined = AS_FUNCTION(chunk->constants.values[(chunk->code[site + 3] << 8) | chunk->code[site + 4]]);
+            fprintf(stderr, "[line %d] in %s\n", getLine(chunk, instruction), inlined->name->chars);
+            instruction = site;
+        }
+
+        fprintf(stderr, "[line %d] in ", getLine(chunk, instruction));
         if (function->name == NULL) {
             fprintf(stderr, "%s\n", basename((char*)function->source));
         } else {
@@ -64,6 +78,16 @@ void initVM(void)
     resetStack();
     vm.objects = NULL;
 
+    vm.immortals      = NULL;
+    vm.immortalIndex  = NULL;
+    vm.immortalCount  = 0;
+    vm.immortalMarks  = NULL;
+    vm.preforkWorkers = 0;
+    vm.runDepth       = 0;
+#ifdef OPCODE_PROFILING
+    vm.pairCounts = NULL;
+#endif
+
     vm.bytesAllocated = 0;
     vm.nextGC         = 1024 * 1024;
     vm.grayCount      = 0;
@@ -73,6 +97,11 @@ void initVM(void)
 
     initTable(&vm.globals);
     initTable(&vm.strings);
+    initTable(&vm.bundle);
+    initTable(&vm.imports);
+    initTable(&vm.modules);
+    initTable(&vm.precompiled);
+    initTable(&vm.constGlobals);
 
     vm.initString   = NULL;
     vm.initString   = copyString("init", 4);
@@ -120,6 +149,11 @@ void freeVM(void)
 {
     freeTable(&vm.globals);
     freeTable(&vm.strings);
+    freeTable(&vm.bundle);
+    freeTable(&vm.imports);
+    freeTable(&vm.modules);
+    freeTable(&vm.precompiled);
+    freeTable(&vm.constGlobals);
     vm.initString   = NULL;
     vm.strString    = NULL;
     vm.addString    = NULL;
@@ -161,6 +195,11 @@ __attribute__((always_inline)) inline static Value peek(int distance)
 
 bool call(ObjClosure* closure, int argCount)
 {
+    if (closure->function->lazyBody != NULL && !compileLazy(closure->function)) {
+        runtimeError("Could not compile '%s'.", closure->function->name->chars);
+        return false;
+    }
+
     if (argCount != closure->function->arity) {
         runtimeError("Expected %d arguments but got %d.", closure->function->arity, argCount);
         return false;
@@ -211,7 +250,9 @@ static bool callValue(Value callee, int argCount)
             NativeFn native = AS_NATIVE(callee);
             if (native(argCount, vm.stackTop - argCount)) {
                 vm.stackTop -= argCount;
-                return true;
+                // an error in a script the native called back into has
+                // already been reported and unwound every frame
+                return !vm.errorState;
             } else {
                 runtimeError(AS_STRING(vm.stackTop[-argCount - 1])->chars);
                 return false;
@@ -225,6 +266,74 @@ static bool callValue(Value callee, int argCount)
     return false;
 }
 
+// Records an import in vm.imports. Returns false when `module` was already
+// imported at the same `version`, so it does not need to run again.
+static bool firstImport(Value module, Value version)
+{
+    Value imported;
+    if (tableGet(&vm.imports, module, &imported) && valuesEqual(imported, version))
+        return false;
+
+    push(module);
+    tableSet(&vm.imports, module, version);
+    pop();
+    return true;
+}
+
+// Files are keyed by their canonical path, so every relative spelling of a
+// path matches, and versioned by modification time.
+static bool firstImportOfFile(const char* path)
+{
+    struct stat info;
+    char*       canonical = realpath(path, NULL);
+    if (canonical == NULL || stat(canonical, &info) != 0) {
+        free(canonical);
+        return true;
+    }
+
+    Value module = OBJ_VAL(copyString(canonical, (int)strlen(canonical)));
+    free(canonical);
+    return firstImport(module, NUMBER_VAL((double)info.st_mtime));
+}
+
+// Runs a method classifyAccessor() recognized without pushing a frame for
+// it. Returns false if the call has to go through call() after all.
+static bool invokeAccessor(ObjFunction* function, int argCount)
+{
+    Value receiver = vm.stackTop[-argCount - 1];
+    if (function->accessor == ACCESSOR_NONE || argCount != function->arity)
+        return false;
+
+    switch (function->accessor) {
+    case ACCESSOR_CONSTANT:
+        vm.stackTop -= argCount;
+        vm.stackTop[-1] = function->accessorValue;
+        return true;
+
+    case ACCESSOR_GETTER: {
+        Value value;
+        if (!IS_INSTANCE(receiver) || !tableGet(&AS_INSTANCE(receiver)->fields, function->accessorValue, &value))
+            return false;
+        vm.stackTop[-1] = value;
+        return true;
+    }
+
+    case ACCESSOR_SETTER:
+    case ACCESSOR_SETTER_NIL: {
+        if (!IS_INSTANCE(receiver))
+            return false;
+        tableSet(&AS_INSTANCE(receiver)->fields, function->accessorValue, vm.stackTop[-1]);
+        Value value = function->accessor == ACCESSOR_SETTER ? vm.stackTop[-1] : NIL_VAL;
+        vm.stackTop--;
+        vm.stackTop[-1] = value;
+        return true;
+    }
+
+    default:
+        return false;
+    }
+}
+
 static bool invokeFromClass(ObjClass* klass, Value name, int argCount)
 {
     Value method;
@@ -232,7 +341,11 @@ static bool invokeFromClass(ObjClass* klass, Value name, int argCount)
         runtimeError("1Undefined property '%s'.", stringValue(name));
         return false;
     }
-    return call(AS_CLOSURE(method), argCount);
+
+    ObjClosure* closure = AS_CLOSURE(method);
+    if (invokeAccessor(closure->function, argCount))
+        return true;
+    return call(closure, argCount);
 }
 
 static bool invoke(Value name, int argCount)
@@ -407,7 +520,7 @@ static void concatenate(void)
     push(OBJ_VAL(result));
 }
 
-InterpretResult run(void)
+static InterpretResult execute(void)
 {
     register CallFrame*   frame;
     register Value*       stackStart;
@@ -435,8 +548,10 @@ InterpretResult run(void)
 #define PEEK4() (*(vm.stackTop - 4))
 #define READ_BYTE() (*ip++)
 #define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define READ_LONG() (ip += 4, ((uint32_t)ip[-4] << 24) | ((uint32_t)ip[-3] << 16) | ((uint32_t)ip[-2] << 8) | ip[-1])
 
 #define READ_CONSTANT() (fn->chunk.constants.values[READ_SHORT()])
+#define READ_CONSTANT_BYTE() (fn->chunk.constants.values[READ_BYTE()])
 #define READ_STRING() AS_STRING(READ_CONSTANT())
 
 #define BINARY_OP(valueType, op)                         \
@@ -483,6 +598,39 @@ InterpretResult run(void)
         LOAD_FRAME();                                                          \
     }
 
+// The fused loop compares are followed by the JUMP_IF_FALSE and POP of
+// the original condition. Numbers take the branch right away, anything
+// else is pushed and compared like OP_LESS would.
+#define LESS_AND_BRANCH(a, b)                                  \
+    do {                                                       \
+        if (IS_NUMBER(a) && IS_NUMBER(b)) {                    \
+            if (AS_NUMBER(a) < AS_NUMBER(b)) {                 \
+                ip += 4;                                       \
+            } else {                                           \
+                PUSH(BOOL_VAL(false));                         \
+                ip += 3 + (uint16_t)((ip[1] << 8) | ip[2]);    \
+            }                                                  \
+        } else {                                               \
+            PUSH(a);                                           \
+            PUSH(b);                                           \
+            if (IS_INSTANCE(PEEK()) && IS_INSTANCE(PEEK2())) { \
+                INVOKE_DUNDER(vm.ltString);                    \
+            } else {                                           \
+                BINARY_OP(BOOL_VAL, <);                        \
+            }                                                  \
+        }                                                      \
+    } while (false)
+
+#define INCREMENT_SLOT(slot)                                            \
+    do {                                                                \
+        if (!IS_NUMBER(stackStart[slot])) {                             \
+            STORE_FRAME();                                              \
+            runtimeError("Operand must be a number.");                  \
+            return INTERPRET_RUNTIME_ERROR;                             \
+        }                                                               \
+        stackStart[slot] = NUMBER_VAL(AS_NUMBER(stackStart[slot]) + 1); \
+    } while (false)
+
 #ifdef DEBUG_TRACE_EXECUTION
 #define TRACE_EXECUTION()                                              \
     do {                                                               \
@@ -508,6 +656,31 @@ InterpretResult run(void)
     } while (false)
 #endif
 
+#ifdef OPCODE_PROFILING
+    int previous = -1;
+#define PROFILE_PAIR()                                              \
+    do {                                                            \
+        if (vm.pairCounts != NULL && previous != -1)                \
+            vm.pairCounts[previous * OPCODE_COUNT + instruction]++; \
+        previous = instruction;                                     \
+    } while (false)
+#else
+#define PROFILE_PAIR() \
+    do {               \
+    } while (false)
+#endif
+
+// The first half of a superinstruction, only pushes and pops qualify so
+// the second half can run its own handler unchanged.
+#define LEAD_CONSTANT() PUSH(READ_CONSTANT())
+#define LEAD_NIL() PUSH(NIL_VAL)
+#define LEAD_TRUE() PUSH(BOOL_VAL(true))
+#define LEAD_FALSE() PUSH(BOOL_VAL(false))
+#define LEAD_POP() DROP()
+#define LEAD_DUP() PUSH(PEEK())
+#define LEAD_GET_LOCAL() PUSH(stackStart[READ_SHORT()])
+#define LEAD_GET_UPVALUE() PUSH(*frame->closure->upvalues[READ_SHORT()]->location)
+
 #ifdef COMPUTED_GOTO
     static void* dispatchTable[] = {
 #define OPCODE(op) &&code_##op,
@@ -517,21 +690,32 @@ InterpretResult run(void)
 
 #define INTERPRET_LOOP DISPATCH();
 #define CASE_CODE(name) code_##name
-#define DISPATCH()                                              \
-    TRACE_EXECUTION();                                          \
-    if (!vm.errorState) {                                       \
-        goto* dispatchTable[instruction = (OpCode)READ_BYTE()]; \
-    } else {                                                    \
-        return INTERPRET_RUNTIME_ERROR;                         \
+#define CONTINUE_WITH(name) goto code_##name
+#define DISPATCH()                         \
+    TRACE_EXECUTION();                     \
+    if (!vm.errorState) {                  \
+        instruction = (OpCode)READ_BYTE(); \
+        PROFILE_PAIR();                    \
+        goto* dispatchTable[instruction];  \
+    } else {                               \
+        return INTERPRET_RUNTIME_ERROR;    \
     }
 
 #else
-#define INTERPRET_LOOP \
-    loop:              \
-    TRACE_EXECUTION(); \
-    switch (instruction = (OpCode)READ_BYTE())
+#define INTERPRET_LOOP                 \
+    loop:                              \
+    TRACE_EXECUTION();                 \
+    instruction = (OpCode)READ_BYTE(); \
+    PROFILE_PAIR();                    \
+    dispatch:                          \
+    switch (instruction)
 
 #define CASE_CODE(name) case OP_##name
+#define CONTINUE_WITH(name)      \
+    do {                         \
+        instruction = OP_##name; \
+        goto dispatch;           \
+    } while (false)
 #define DISPATCH()                      \
     if (!vm.errorState) {               \
         goto loop;                      \
@@ -554,6 +738,14 @@ InterpretResult run(void)
             DISPATCH();
         }
 
+        CASE_CODE(CONSTANT_LONG)
+            :
+        {
+            Value constant = fn->chunk.constants.values[READ_LONG()];
+            PUSH(constant);
+            DISPATCH();
+        }
+
         CASE_CODE(NIL)
             :
         {
@@ -871,6 +1063,14 @@ InterpretResult run(void)
             DISPATCH();
         }
 
+        CASE_CODE(PEEK)
+            :
+        {
+            Value value = vm.stackTop[-1 - READ_BYTE()];
+            PUSH(value);
+            DISPATCH();
+        }
+
         CASE_CODE(GET_LOCAL)
             :
         {
@@ -929,7 +1129,7 @@ InterpretResult run(void)
             uint16_t slotA    = READ_SHORT();
             uint16_t slotB    = READ_SHORT();
             stackStart[slotA] = PEEK();
-            stackStart[slotB] = PEEK2();
+            stackStart[slotB] = PEEK();
             DISPATCH();
         }
 
@@ -940,8 +1140,8 @@ InterpretResult run(void)
             uint16_t slotB    = READ_SHORT();
             uint16_t slotC    = READ_SHORT();
             stackStart[slotA] = PEEK();
-            stackStart[slotB] = PEEK2();
-            stackStart[slotC] = PEEK3();
+            stackStart[slotB] = PEEK();
+            stackStart[slotC] = PEEK();
             DISPATCH();
         }
 
@@ -953,9 +1153,9 @@ InterpretResult run(void)
             uint16_t slotC    = READ_SHORT();
             uint16_t slotD    = READ_SHORT();
             stackStart[slotA] = PEEK();
-            stackStart[slotB] = PEEK2();
-            stackStart[slotC] = PEEK3();
-            stackStart[slotD] = PEEK4();
+            stackStart[slotB] = PEEK();
+            stackStart[slotC] = PEEK();
+            stackStart[slotD] = PEEK();
             DISPATCH();
         }
 
@@ -1073,7 +1273,27 @@ InterpretResult run(void)
             :
         {
             Value name = READ_CONSTANT();
+            if (tableGet(&vm.constGlobals, name, NULL)) {
+                STORE_FRAME();
+                runtimeError("Can't redeclare constant '%s'.", stringValue(name));
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            tableSet(&vm.globals, name, PEEK());
+            DROP();
+            DISPATCH();
+        }
+
+        CASE_CODE(DEFINE_CONSTANT)
+            :
+        {
+            Value name = READ_CONSTANT();
+            if (tableGet(&vm.constGlobals, name, NULL)) {
+                STORE_FRAME();
+                runtimeError("Can't redeclare constant '%s'.", stringValue(name));
+                return INTERPRET_RUNTIME_ERROR;
+            }
             tableSet(&vm.globals, name, PEEK());
+            tableSet(&vm.constGlobals, name, TRUE_VAL);
             DROP();
             DISPATCH();
         }
@@ -1082,6 +1302,11 @@ InterpretResult run(void)
             :
         {
             Value name = READ_CONSTANT();
+            if (tableGet(&vm.constGlobals, name, NULL)) {
+                STORE_FRAME();
+                runtimeError("Can't assign to constant '%s'.", stringValue(name));
+                return INTERPRET_RUNTIME_ERROR;
+            }
             if (tableSet(&vm.globals, name, PEEK())) {
                 tableDelete(&vm.globals, name);
                 STORE_FRAME();
@@ -1153,6 +1378,7 @@ InterpretResult run(void)
 
             case OBJ_TABLE: {
                 ObjTable* table = AS_TABLE(PEEK2());
+                table->module   = -1;
                 tableSet(&table->table, READ_CONSTANT(), PEEK());
                 Value value = POP();
                 DROP();
@@ -1220,6 +1446,269 @@ InterpretResult run(void)
             DISPATCH();
         }
 
+        CASE_CODE(JUMP_LONG)
+            :
+        {
+            uint32_t offset = READ_LONG();
+            ip += offset;
+            DISPATCH();
+        }
+
+        CASE_CODE(JUMP_IF_FALSE_LONG)
+            :
+        {
+            uint32_t offset = READ_LONG();
+            if (isFalsey(PEEK()))
+                ip += offset;
+            DISPATCH();
+        }
+
+        CASE_CODE(LOOP_LONG)
+            :
+        {
+            uint32_t offset = READ_LONG();
+            ip -= offset;
+            DISPATCH();
+        }
+
+        CASE_CODE(SWITCH_TABLE)
+            :
+        {
+            // a number operand is the lowest case of a dense jump array,
+            // a table maps each case value to its place in the array
+            Value    cases    = READ_CONSTANT();
+            uint16_t count    = READ_SHORT();
+            uint8_t* jumps    = ip;
+            Value    value    = PEEK();
+            int      slot     = -1;
+            ip += 2 + count * 2;
+
+            if (IS_NUMBER(cases)) {
+                double index = IS_NUMBER(value) ? AS_NUMBER(value) - AS_NUMBER(cases) : -1;
+                if (index >= 0 && index < count && valuesEqual(value, NUMBER_VAL(AS_NUMBER(cases) + (int)index)))
+                    slot = (int)index;
+            } else if (IS_NUMBER(value) || IS_STRING(value)) {
+                Value found;
+                if (tableGet(&AS_TABLE(cases)->table, value, &found))
+                    slot = (int)AS_NUMBER(found);
+            }
+
+            jumps += 2 + slot * 2;
+            ip += (uint16_t)((jumps[0] << 8) | jumps[1]);
+            DISPATCH();
+        }
+
+        CASE_CODE(LESS_LOCAL)
+            :
+        {
+            Value a = stackStart[READ_SHORT()];
+            Value b = stackStart[READ_SHORT()];
+            LESS_AND_BRANCH(a, b);
+            DISPATCH();
+        }
+
+        CASE_CODE(LESS_LOCAL_CONST)
+            :
+        {
+            Value a = stackStart[READ_SHORT()];
+            Value b = READ_CONSTANT();
+            LESS_AND_BRANCH(a, b);
+            DISPATCH();
+        }
+
+        CASE_CODE(INCREMENT_LOCAL)
+            :
+        {
+            uint16_t slot = READ_SHORT();
+            INCREMENT_SLOT(slot);
+            DISPATCH();
+        }
+
+        CASE_CODE(FOR_STEP)
+            :
+        {
+            // increment, then loop back past the condition while it still
+            // holds; otherwise fall through to the jump that re-runs it
+            uint16_t slot   = READ_SHORT();
+            uint16_t limit  = READ_SHORT();
+            uint16_t offset = READ_SHORT();
+            INCREMENT_SLOT(slot);
+            Value bound = stackStart[limit];
+            if (IS_NUMBER(bound) && AS_NUMBER(stackStart[slot]) < AS_NUMBER(bound))
+                ip -= offset;
+            DISPATCH();
+        }
+
+        CASE_CODE(FOR_STEP_CONST)
+            :
+        {
+            uint16_t slot   = READ_SHORT();
+            Value    bound  = READ_CONSTANT();
+            uint16_t offset = READ_SHORT();
+            INCREMENT_SLOT(slot);
+            if (IS_NUMBER(bound) && AS_NUMBER(stackStart[slot]) < AS_NUMBER(bound))
+                ip -= offset;
+            DISPATCH();
+        }
+
+        CASE_CODE(CONSTANT_BYTE)
+            :
+        {
+            PUSH(READ_CONSTANT_BYTE());
+            DISPATCH();
+        }
+
+        CASE_CODE(GET_LOCAL_BYTE)
+            :
+        {
+            uint8_t slot = READ_BYTE();
+            PUSH(stackStart[slot]);
+            DISPATCH();
+        }
+
+        CASE_CODE(SET_LOCAL_BYTE)
+            :
+        {
+            uint8_t slot     = READ_BYTE();
+            stackStart[slot] = PEEK();
+            DISPATCH();
+        }
+
+        CASE_CODE(GET_GLOBAL_BYTE)
+            :
+        {
+            Value name = READ_CONSTANT_BYTE();
+            Value value;
+            if (!tableGet(&vm.globals, name, &value)) {
+                STORE_FRAME();
+                runtimeError("Undefined variable '%s'.", stringValue(name));
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            PUSH(value);
+            DISPATCH();
+        }
+
+        CASE_CODE(SET_GLOBAL_BYTE)
+            :
+        {
+            Value name = READ_CONSTANT_BYTE();
+            if (tableGet(&vm.constGlobals, name, NULL)) {
+                STORE_FRAME();
+                runtimeError("Can't assign to constant '%s'.", stringValue(name));
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            if (tableSet(&vm.globals, name, PEEK())) {
+                tableDelete(&vm.globals, name);
+                STORE_FRAME();
+                runtimeError("Undefined variable '%s'.", stringValue(name));
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            DISPATCH();
+        }
+
+        CASE_CODE(GET_UPVALUE_BYTE)
+            :
+        {
+            uint8_t slot = READ_BYTE();
+            PUSH(*frame->closure->upvalues[slot]->location);
+            DISPATCH();
+        }
+
+        CASE_CODE(SET_UPVALUE_BYTE)
+            :
+        {
+            uint8_t slot                              = READ_BYTE();
+            *frame->closure->upvalues[slot]->location = PEEK();
+            DISPATCH();
+        }
+
+        CASE_CODE(CALL_BYTE)
+            :
+        {
+            int argCount = READ_BYTE();
+            STORE_FRAME();
+
+            if (!callValue(peek(argCount), argCount)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+
+            LOAD_FRAME();
+            DISPATCH();
+        }
+
+        CASE_CODE(PUSH_BYTE)
+            :
+        {
+            PUSH(NUMBER_VAL(READ_BYTE()));
+            DISPATCH();
+        }
+
+        CASE_CODE(LOAD_LOCAL_0)
+            :
+        {
+            PUSH(stackStart[0]);
+            DISPATCH();
+        }
+
+        CASE_CODE(LOAD_LOCAL_1)
+            :
+        {
+            PUSH(stackStart[1]);
+            DISPATCH();
+        }
+
+        CASE_CODE(LOAD_LOCAL_2)
+            :
+        {
+            PUSH(stackStart[2]);
+            DISPATCH();
+        }
+
+        CASE_CODE(LOAD_LOCAL_3)
+            :
+        {
+            PUSH(stackStart[3]);
+            DISPATCH();
+        }
+
+        CASE_CODE(LOAD_CONSTANT_0)
+            :
+        {
+            PUSH(fn->chunk.constants.values[0]);
+            DISPATCH();
+        }
+
+        CASE_CODE(LOAD_CONSTANT_1)
+            :
+        {
+            PUSH(fn->chunk.constants.values[1]);
+            DISPATCH();
+        }
+
+        CASE_CODE(LOAD_CONSTANT_2)
+            :
+        {
+            PUSH(fn->chunk.constants.values[2]);
+            DISPATCH();
+        }
+
+        CASE_CODE(LOAD_CONSTANT_3)
+            :
+        {
+            PUSH(fn->chunk.constants.values[3]);
+            DISPATCH();
+        }
+
+#define SUPERINSTRUCTION(first, second, operands) \
+    CASE_CODE(first##__##second)                  \
+        :                                         \
+    {                                             \
+        LEAD_##first();                           \
+        CONTINUE_WITH(second);                    \
+    }
+#include "superinstructions.def"
+#undef SUPERINSTRUCTION
+
         CASE_CODE(DUMP)
             :
         {
@@ -1257,6 +1746,71 @@ InterpretResult run(void)
             DISPATCH();
         }
 
+        CASE_CODE(INLINE)
+            :
+        {
+            // the body of a small global function follows, it runs in place
+            // of the call as long as the callee is still that function
+            uint16_t     argCount = READ_SHORT();
+            ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
+            uint16_t     offset   = READ_SHORT();
+            Value        callee   = peek(argCount);
+            if (IS_CLOSURE(callee) && AS_CLOSURE(callee)->function == function) {
+                Value* slot = vm.stackTop - argCount - 1;
+                memmove(slot, slot + 1, sizeof(Value) * argCount);
+                DROP();
+                DISPATCH();
+            }
+
+            ip += offset;
+            STORE_FRAME();
+            if (!callValue(callee, argCount)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+
+            LOAD_FRAME();
+            DISPATCH();
+        }
+
+        CASE_CODE(NATIVE_CONSTANT)
+            :
+        {
+            // the code up to the target was folded at compile time, its value
+            // holds as long as the module on the stack is unchanged
+            uint16_t module = READ_SHORT();
+            Value    value  = READ_CONSTANT();
+            uint16_t offset = READ_SHORT();
+            if (IS_TABLE(PEEK()) && AS_TABLE(PEEK())->module == module) {
+                DROP();
+                PUSH(value);
+                ip += offset;
+            }
+            DISPATCH();
+        }
+
+        CASE_CODE(HOIST_SLOT)
+            :
+        {
+            // the slot a loop keeps an invariant value in, empty until the
+            // value is first computed
+            PUSH(EMPTY_VAL);
+            DISPATCH();
+        }
+
+        CASE_CODE(GET_HOISTED)
+            :
+        {
+            // a value computed on an earlier pass through the loop skips the
+            // code that computes and stores it
+            Value    value  = stackStart[READ_SHORT()];
+            uint16_t offset = READ_SHORT();
+            if (!IS_EMPTY(value)) {
+                PUSH(value);
+                ip += offset;
+            }
+            DISPATCH();
+        }
+
         CASE_CODE(INDEX)
             :
         {
@@ -1341,6 +1895,7 @@ InterpretResult run(void)
                 Value     value = POP();
                 Value     index = POP();
                 ObjTable* table = AS_TABLE(POP());
+                table->module   = -1;
                 tableSet(&table->table, index, value);
                 PUSH(OBJ_VAL(table));
                 break;
@@ -1440,8 +1995,15 @@ InterpretResult run(void)
             :
         {
             ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
-            ObjClosure*  closure  = newClosure(function);
+            if (function->upvalueCount == 0) {
+                // nothing to capture, so one closure serves every evaluation
+                if (function->cachedClosure == NULL)
+                    function->cachedClosure = newClosure(function);
+                PUSH(OBJ_VAL(function->cachedClosure));
+                DISPATCH();
+            }
 
+            ObjClosure* closure = newClosure(function);
             PUSH(OBJ_VAL(closure));
 
             for (int i = 0; i < closure->upvalueCount; i++) {
@@ -1617,18 +2179,38 @@ InterpretResult run(void)
         {
             ObjString*   fileName   = AS_STRING(POP());
             ObjFunction* parentFunc = fn;
-            const char*  sourcePath = resolveRelativePath(fileName->chars, parentFunc->source);
-            char*        source     = readFile(sourcePath);
-            ObjFunction* function   = compile(sourcePath, source);
-            if (function == NULL)
-                return INTERPRET_COMPILE_ERROR;
+            ObjFunction* function   = findBundled(fileName->chars, parentFunc->source);
+            if (function != NULL && !firstImport(OBJ_VAL(function), BOOL_VAL(true))) {
+                PUSH(NIL_VAL);
+                DISPATCH();
+            }
+
+            if (function == NULL) {
+                const char* sourcePath = resolveRelativePath(fileName->chars, parentFunc->source);
+                if (!firstImportOfFile(sourcePath)) {
+                    free((void*)sourcePath);
+                    PUSH(NIL_VAL);
+                    DISPATCH();
+                }
+
+                function = takePrecompiled(sourcePath);
+                if (function != NULL) {
+                    free((void*)sourcePath);
+                } else {
+                    char* source = readFile(sourcePath);
+                    function     = compileCached(sourcePath, source);
+                    free(source);
+                    if (function == NULL)
+                        return INTERPRET_COMPILE_ERROR;
+                }
+            }
+
+            // the module runs like a call, its result is popped after
             PUSH(OBJ_VAL(function));
-            ObjClosure* closure = newClosure(function);
-            POP();
+            vm.stackTop[-1] = OBJ_VAL(newClosure(function));
             STORE_FRAME();
-            call(closure, 0);
+            call(AS_CLOSURE(vm.stackTop[-1]), 0);
             LOAD_FRAME();
-            free(source);
             DISPATCH();
         }
     }
@@ -1637,11 +2219,25 @@ InterpretResult run(void)
 #undef DISPATCH
 #undef READ_BYTE
 #undef READ_SHORT
+#undef READ_LONG
 #undef READ_CONSTANT
+#undef READ_CONSTANT_BYTE
 #undef READ_STRING
 #undef BINARY_OP
 #undef BINARY_OP_INT
 #undef INVOKE_DUNDER
+#undef LESS_AND_BRANCH
+#undef INCREMENT_SLOT
+#undef PROFILE_PAIR
+#undef LEAD_CONSTANT
+#undef LEAD_NIL
+#undef LEAD_TRUE
+#undef LEAD_FALSE
+#undef LEAD_POP
+#undef LEAD_DUP
+#undef LEAD_GET_LOCAL
+#undef LEAD_GET_UPVALUE
+#undef CONTINUE_WITH
 #undef PUSH
 #undef POP
 #undef PEEK
@@ -1653,12 +2249,18 @@ InterpretResult run(void)
 #undef LOAD_FRAME
 }
 
-InterpretResult interpret(const char* sourcePath, utf8_int8_t* source)
+// Natives that call back into scripts nest further runs, vm.runDepth
+// tells them apart from the outermost one.
+InterpretResult run(void)
 {
-    ObjFunction* function = compile(sourcePath, source);
-    if (function == NULL)
-        return INTERPRET_COMPILE_ERROR;
+    vm.runDepth++;
+    InterpretResult result = execute();
+    vm.runDepth--;
+    return result;
+}
 
+static InterpretResult runFunction(ObjFunction* function)
+{
     push(OBJ_VAL(function));
 
     ObjClosure* closure = newClosure(function);
@@ -1670,3 +2272,34 @@ InterpretResult interpret(const char* sourcePath, utf8_int8_t* source)
 
     return INTERPRET_RUNTIME_ERROR;
 }
+
+InterpretResult interpret(const char* sourcePath, utf8_int8_t* source)
+{
+    ObjFunction* function = compileCached(sourcePath, source);
+    if (function == NULL)
+        return INTERPRET_COMPILE_ERROR;
+
+    precompileImports(function);
+    return runFunction(function);
+}
+
+InterpretResult interpretBundle(const char* path)
+{
+    ObjFunction* function = loadBundle(path);
+    if (function == NULL) {
+        fprintf(stderr, "Could not load bundle \"%s\".\n", path);
+        return INTERPRET_COMPILE_ERROR;
+    }
+
+    return runFunction(function);
+}
+
+InterpretResult interpretImage(const char* path)
+{
+    if (!loadImage(path)) {
+        fprintf(stderr, "Could not load image \"%s\".\n", path);
+        return INTERPRET_COMPILE_ERROR;
+    }
+
+    return run();
+}
@@ -0,0 +1,111 @@
+#!/usr/bin/env python3
+"""Generates src/include/superinstructions.def from opcode pair profiles.
+
+Build phelt with OPCODE_PROFILING defined in src/include/common.h, run a
+corpus with --profile-pairs (the counts accumulate in the file across
+runs), then pass the profile here:
+
+    for f in phelt/*.ph; do ./phelt --profile-pairs pairs.txt $f; done
+    tools/superinstructions.py pairs.txt
+
+The busiest pairs whose first opcode only pushes or pops and whose second
+opcode has plain short operands are written out, the VM, disassembler and
+optimizer pick them up from the .def file on the next build.
+"""
+
+import argparse
+import collections
+import os
+import sys
+
+# Opcodes that can start a superinstruction, with their operand shorts.
+# Each needs a LEAD_<op>() macro in vm.c.
+LEADS = {
+    "CONSTANT": 1,
+    "NIL": 0,
+    "TRUE": 0,
+    "FALSE": 0,
+    "POP": 0,
+    "DUP": 0,
+    "GET_LOCAL": 1,
+    "GET_UPVALUE": 1,
+}
+
+# Opcodes that can finish one: everything whose operands are only shorts
+# and that does not branch, with their operand shorts.
+FOLLOWS = {
+    "CONSTANT": 1, "NIL": 0, "TRUE": 0, "FALSE": 0,
+    "EQUAL": 0, "GREATER": 0, "LESS": 0, "NOT_EQUAL": 0,
+    "GREATER_EQUAL": 0, "LESS_EQUAL": 0,
+    "ADD": 0, "SUBTRACT": 0, "MULTIPLY": 0, "DIVIDE": 0, "MODULO": 0,
+    "BITWISE_AND": 0, "BITWISE_OR": 0, "BITWISE_XOR": 0,
+    "SHIFT_LEFT": 0, "SHIFT_RIGHT": 0,
+    "NOT": 0, "NEGATE": 0, "INCREMENT": 0, "DECREMENT": 0,
+    "POP": 0, "DUP": 0,
+    "GET_LOCAL": 1, "GET_LOCAL_2": 2, "GET_LOCAL_3": 3,
+    "SET_LOCAL": 1, "SET_LOCAL_2": 2, "SET_LOCAL_3": 3,
+    "GET_GLOBAL": 1, "GET_GLOBAL_2": 2, "GET_GLOBAL_3": 3,
+    "GET_UPVALUE": 1, "SET_UPVALUE": 1,
+    "DEFINE_GLOBAL": 1, "SET_GLOBAL": 1,
+    "GET_PROPERTY": 1, "SET_PROPERTY": 1, "GET_SUPER": 1,
+    "SET_TABLE": 1, "SET_ARRAY": 1, "SLICE": 0, "FORMAT": 1,
+    "DUMP": 0, "CALL": 1, "CALL_BLIND": 1, "INDEX": 0, "SET_INDEX": 0,
+    "INVOKE": 2, "SUPER_INVOKE": 2, "CLOSE_UPVALUE": 0, "RETURN": 0,
+    "INHERIT": 0, "METHOD": 1,
+}
+
+MAX_OPERANDS = 4
+
+HEADER = """\
+// Generated by tools/superinstructions.py from a --profile-pairs run.
+// SUPERINSTRUCTION(first, second, operands) fuses `first` followed by
+// `second` into one opcode carrying both operand lists, `operands` shorts.
+"""
+
+
+def read_profiles(paths):
+    counts = collections.Counter()
+    for path in paths:
+        with open(path) as profile:
+            for line in profile:
+                fields = line.split()
+                if len(fields) != 3 or line.startswith("#"):
+                    continue
+                counts[(fields[1], fields[2])] += int(fields[0])
+    return counts
+
+
+def main():
+    root = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("profiles", nargs="+", help="--profile-pairs output files")
+    parser.add_argument("-n", "--count", type=int, default=16,
+                        help="number of superinstructions to generate (default 16)")
+    parser.add_argument("-o", "--output",
+                        default=os.path.join(root, "src", "include", "superinstructions.def"))
+    args = parser.parse_args()
+
+    counts = read_profiles(args.profiles)
+    total = sum(counts.values())
+    pairs = [
+        (count, first, second)
+        for (first, second), count in counts.items()
+        if first in LEADS and second in FOLLOWS
+        and LEADS[first] + FOLLOWS[second] <= MAX_OPERANDS
+    ]
+    pairs.sort(key=lambda pair: (-pair[0], pair[1], pair[2]))
+    chosen = pairs[:args.count]
+
+    with open(args.output, "w") as output:
+        output.write(HEADER)
+        for count, first, second in chosen:
+            output.write("SUPERINSTRUCTION(%s, %s, %d)\n"
+                         % (first, second, LEADS[first] + FOLLOWS[second]))
+
+    for count, first, second in chosen:
+        share = 100.0 * count / total if total else 0
+        print("%12d %5.2f%%  %s %s" % (count, share, first, second), file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()